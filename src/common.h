@@ -16,15 +16,15 @@ typedef u64 file_offset;
 typedef u32 block_index;
 
 #define Assert(exp)                 \
-    if(exp == 0) {                  \
+    if((exp) == 0) {                \
         *(int*)1 = 0;               \
     }
 
 #define OffsetOf(structure, element) (ptrdiff_t)&(((structure*)0)->element)
-#define RoundUpDivision(a, b) ((a) + (b) - 1 ) / (b)
+#define RoundUpDivision(a, b) (((a) + (b) - 1) / (b))
 
-#define MIN(a, b) ((a) < (b)) ? (a) : (b)
-#define MAX(a, b) ((a) > (b)) ? (a) : (b)
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 #define KiloBytes(n) ((n) * 1024LL)
 #define MegaBytes(n) (KiloBytes(n) * 1024LL)
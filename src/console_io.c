@@ -15,13 +15,87 @@ int len(const char *buf){
 
 
 
-DWORD print(const char *format, ...) {   
+#define WRITE_BUFFER_SIZE (64 * 1024)
+#define PRINT_WIDTH_MAX 256
+#define PRINT_NUMBER_SIZE 32
+
+// print formats into this buffer, it is written out when it fills up,
+// before input is read and at the end of every command
+static struct {
+    char buf[WRITE_BUFFER_SIZE];
+    u32 used;
+} ConsoleBuffer;
+
+static void ConsoleWrite(const char *buf, size_t size) {
 #if defined(_WIN32)
     HANDLE OutputConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 #elif defined(__linux__)
     unsigned int OutputConsole = 1;
 #endif
 
+    while(size) {
+        DWORD written = ConsoleOut(OutputConsole, buf, size);
+        if(!written || written > size)
+            return;
+        buf += written;
+        size -= written;
+    }
+}
+
+static void FlushConsole() {
+    ConsoleWrite(ConsoleBuffer.buf, ConsoleBuffer.used);
+    ConsoleBuffer.used = 0;
+}
+
+// room for size more bytes, size is at most WRITE_BUFFER_SIZE
+static inline char *ConsoleReserve(size_t size) {
+    if(ConsoleBuffer.used + size > WRITE_BUFFER_SIZE)
+        FlushConsole();
+    return ConsoleBuffer.buf + ConsoleBuffer.used;
+}
+
+static inline void ConsoleAppend(const char *buf, size_t size) {
+    if(size > WRITE_BUFFER_SIZE) {
+        FlushConsole();
+        ConsoleWrite(buf, size);
+        return;
+    }
+    MemCopy(ConsoleReserve(size), buf, size);
+    ConsoleBuffer.used += size;
+}
+
+static inline void ConsolePad(int count) {
+    MemSet(ConsoleReserve(count), ' ', count);
+    ConsoleBuffer.used += count;
+}
+
+// the number is formatted where it ends up and moved right when it has to
+// be padded to width
+static inline int ConsoleNumber(char specifier, va_list *args, int width, int decimals) {
+    if(width > PRINT_WIDTH_MAX)
+        width = PRINT_WIDTH_MAX;
+    char *dst = ConsoleReserve(width + PRINT_NUMBER_SIZE);
+
+    int length = 0;
+    if(specifier == 'd')
+        length = IntegerDumps(va_arg(*args, int), dst);
+    else if(specifier == 'u')
+        length = UIntegerDumps(va_arg(*args, unsigned int), dst);
+    else
+        length = FloatDumps(va_arg(*args, double), decimals, dst);
+
+    int pad = width - length;
+    if(pad > 0) {
+        for(int i = length; i-- > 0;)
+            dst[i + pad] = dst[i];
+        MemSet(dst, ' ', pad);
+        length = width;
+    }
+    ConsoleBuffer.used += length;
+    return length;
+}
+
+DWORD print(const char *format, ...) {   
     va_list args;
     va_start(args, format);
 
@@ -36,7 +110,9 @@ DWORD print(const char *format, ...) {
         switch(ch){
             case 0:
             {   
-                bytes_written += ConsoleOut(OutputConsole, next_buffer_begin, nchar_to_print);
+                ConsoleAppend(next_buffer_begin, nchar_to_print);
+                bytes_written += nchar_to_print;
+                va_end(args);
                 return bytes_written;
             } break;
 
@@ -45,14 +121,15 @@ DWORD print(const char *format, ...) {
                 tmp++;
                 char specifier = *tmp++;
 
-                bytes_written += ConsoleOut(OutputConsole, next_buffer_begin, nchar_to_print);
+                ConsoleAppend(next_buffer_begin, nchar_to_print);
+                bytes_written += nchar_to_print;
 
                 int length_to_print = -1;
                 int decimals_to_print = -1;
 
                 if(isDigit(specifier)) {
                     tmp--;
-                    ExtractInteger((char **)&tmp, (int*)&bytes_written);
+                    ExtractInteger((char **)&tmp, &length_to_print);
                     specifier = *tmp++;
                 }
 
@@ -74,57 +151,22 @@ DWORD print(const char *format, ...) {
                     if(length_to_print != -1) {
                         if(length_to_print <= buf_size)
                             buf_size = length_to_print;
-                        else{
-                            for(int i = 0; i < length_to_print - buf_size; ++i)
-                                bytes_written += ConsoleOut(OutputConsole, " ", 1);
-                        }
-                    }
-
-                    bytes_written += ConsoleOut(OutputConsole, buf_arg, buf_size);
-                }
-
-                else if(specifier == 'd') {
-                    char str_int[MAX_INT_LENGTH];
-                    int len_str_int = IntegerDumps(va_arg(args, int), str_int);
-
-                    if(length_to_print != -1) {
-                        if(length_to_print > len_str_int) {
-                            for(int i = 0; i < length_to_print - len_str_int; ++i)
-                                bytes_written += ConsoleOut(OutputConsole, " ", 1);
+                        else {
+                            int pad = MIN(length_to_print, PRINT_WIDTH_MAX);
+                            pad -= buf_size;
+                            if(pad > 0) {
+                                ConsolePad(pad);
+                                bytes_written += pad;
+                            }
                         }
                     }
 
-                    bytes_written += ConsoleOut(OutputConsole, str_int, len_str_int);
-                }
-
-                else if(specifier == 'u') {
-                    char str_int[MAX_INT_LENGTH];
-                    int len_str_int = UIntegerDumps(va_arg(args, int), str_int);
-
-                    if(length_to_print != -1) {
-                        if(length_to_print > len_str_int) {
-                            for(int i = 0; i < length_to_print - len_str_int; ++i)
-                                bytes_written += ConsoleOut(OutputConsole, " ", 1);
-                        }
-                    }
-
-                    bytes_written += ConsoleOut(OutputConsole, str_int, len_str_int);
-                }
-
-                else if(specifier == 'f') {
-                    char str_int[30];
-                    int len_str_int = FloatDumps(va_arg(args, double), decimals_to_print, str_int);
-
-                    if(length_to_print != -1) {
-                        if(length_to_print > len_str_int) {
-                            for(int i = 0; i < length_to_print - len_str_int; ++i)
-                                bytes_written += ConsoleOut(OutputConsole, " ", 1);
-                        }
-                    }
-
-                    bytes_written += ConsoleOut(OutputConsole, str_int, len_str_int);
+                    ConsoleAppend(buf_arg, buf_size);
+                    bytes_written += buf_size;
                 }
 
+                else if(specifier == 'd' || specifier == 'u' || specifier == 'f')
+                    bytes_written += ConsoleNumber(specifier, &args, length_to_print, decimals_to_print);
 
             } break;
 
@@ -135,10 +177,6 @@ DWORD print(const char *format, ...) {
             }break;
         }
     }
-
-    va_end(args);
-
-    return bytes_written;
 }
 
 static inline int CopyBuffer(char *src, char *dst, int dst_size) {
@@ -159,6 +197,9 @@ static int scan(const char *format, ...) {
     va_list args;
     va_start(args, format);
 
+    // whatever was printed, the prompt included, has to be out first
+    FlushConsole();
+
     int bytes_read = 0;
     const char *tmp = format;
     while(1) {
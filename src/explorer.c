@@ -6,8 +6,9 @@
 #define PATH   "\x1B[38;5;190m"
 #define RESET "\x1B[0m"
 
-static const char *usage_msg = "Usage: slim64 <mode> <file name>\n";
-static const char *modes_msg = "mode:\n  m[ount] = mount existing instance of the file system\n  n[ew]   = create new instance of the file system\n";
+static const char *usage_msg = "Usage: slim64 <mode> <file name>[,<file name>...] [--stripe-unit <blocks>] [--mirror <file name>[,<file name>...]] [--flush]\n";
+static const char *modes_msg = "mode:\n  m[ount] = mount existing instance of the file system\n  n[ew]   = create new instance of the file system\n  r[am]   = keep the file system in memory, loaded from <file name> if it holds one.\n            --flush saves it back on quit\n";
+static const char *undone_msg = "The image is too full to commit the last changes, they have been undone\n";
 static const char *help_msg = \
 "\
     This is a command line based explorer for Slim64 File System\n\n\
@@ -24,8 +25,10 @@ static const char *help_msg = \
     \tTerminates the program\n\
     clear:\n\
     \tClear the console\n\
-    list:\n\
-    \tLists the list of files and diectories in the current working directory\n\
+    list [--unsorted] [--limit <n>] [--page <p>] [--ext <ext>]:\n\
+    \tLists the list of files and diectories in the current working directory. --unsorted\n\
+    \tprints them as they are stored, --limit stops after <n> and --page shows the <p>-th\n\
+    \tpage of <n> entries. --ext shows only the files with the extension <ext>\n\
     ren <old> <new>:\n\
     \tChanges the name of <old> to <new>\n\
     copy <files> <dst>:\n\
@@ -36,27 +39,129 @@ static const char *help_msg = \
     \tImports <src> from OS filesystem to <dst> in the Slim64 filesystem\n\
     open <file>\n\
     \tOpens the <file>\n\
-    del <files>\n\
-    \tDeletes the items listed in <files>\n\
+    del <files>, del --ext <ext> [path]\n\
+    \tDeletes the items listed in <files>, or every file with the extension <ext> under <path>\n\
+    defrag [--compact] [--steps <n>]\n\
+    \tMakes every file contiguous, --compact also moves the data to the start of the image\n\
+    \tand shrinks it. --steps pauses after <n> steps, defrag again resumes the pass\n\
+    snapshot create|rollback|delete <name>, snapshot list\n\
+    \tTakes a snapshot of the whole image, brings the image back to it or drops it.\n\
+    \tlist shows the generation of each snapshot and the space it holds\n\
+    send [--since <gen>] <file>\n\
+    \tTakes a snapshot for a new generation and writes the blocks changed since the snapshot\n\
+    \tof generation <gen> to <file>, or all of them without --since\n\
+    receive <file>\n\
+    \tApplies a stream written by send to this image. The image must have no snapshots and,\n\
+    \tunless the stream is a full one, be at the generation the stream was sent from\n\
+    archive <path> <file>\n\
+    \tWrites <path> and everything under it to <file> on the OS filesystem\n\
+    unarchive <file> <dst>\n\
+    \tRecreates the contents of an archive written by archive in <dst>\n\
+    du [path]\n\
+    \tShows the number of files under <path> and their total size\n\
+    save [file]\n\
+    \tWrites an image kept in memory to <file>, or to the file it was loaded from\n\
+    find <pattern> [path] [--depth <n>] [--type f|d] [--ext <ext>]\n\
+    \tShows everything under <path> whose name contains <pattern>, at most <n> levels down.\n\
+    \t--type f shows only files and --type d only directories, --ext only the files with\n\
+    \tthe extension <ext>. find --ext <ext> alone shows all of them\n\
+    index create|drop\n\
+    \tBuilds an index of the names and extensions on the image or drops it. find looks\n\
+    \tpatterns of three characters or more and extensions up in the index instead of reading\n\
+    \tevery directory, and so does del --ext\n\
 ";
 
-static explorer_state ExplorerBegin(Arena *arena, char *name, int create_new) {
+#define CWD_INITIAL_FRAMES 16
+
+// frames and path are not taken from an arena, the old ones are freed
+// whenever they grow
+static void CwdReserve(explorer_state *Explorer, u32 count) {
+    if(count <= Explorer->frames_total)
+        return;
+
+    u32 total = MAX(2 * Explorer->frames_total, CWD_INITIAL_FRAMES);
+    total = MAX(total, count);
+    cwd_frame *frames = MemAlloc(total * sizeof(cwd_frame));
+    m_copy(Explorer->frames, frames, Explorer->depth * sizeof(cwd_frame));
+    if(Explorer->frames)
+        MemFree(Explorer->frames, Explorer->frames_total * sizeof(cwd_frame));
+    Explorer->frames = frames;
+    Explorer->frames_total = total;
+}
+
+static void CwdChanged(explorer_state *Explorer) {
+    cwd_frame *top = Explorer->frames + Explorer->depth - 1;
+    Explorer->current_working_directory->base_block = top->block;
+    _strcpy(top->name, Explorer->current_working_directory->name, 123);
+
+    u32 length = 2;
+    for(u32 i = 0; i < Explorer->depth; ++i)
+        length += _strlen(Explorer->frames[i].name) + 1;
+    if(length > Explorer->path_total) {
+        if(Explorer->path)
+            MemFree(Explorer->path, Explorer->path_total);
+        Explorer->path_total = MAX(2 * length, 256);
+        Explorer->path = MemAlloc(Explorer->path_total);
+    }
+
+    u32 written = 0;
+    for(u32 i = 0; i < Explorer->depth; ++i) {
+        written += _strcpy(Explorer->frames[i].name, Explorer->path + written, 127);
+        Explorer->path[written++] = '/';
+    }
+    Explorer->path[written - 1] = '>';
+    Explorer->path[written] = '\0';
+}
+
+// rebuilds the frames by walking up from directory to the root
+static void CwdLoad(explorer_state *Explorer, block_index directory) {
+    FileSystem *fs = &Explorer->fs;
+    Explorer->depth = 0;
+    for(block_index current = directory;; current = SLM_ReadParent(fs, current)) {
+        CwdReserve(Explorer, Explorer->depth + 1);
+        cwd_frame *frame = Explorer->frames + Explorer->depth++;
+        *frame = (cwd_frame){ 0 };
+        frame->block = current;
+        SLM_ReadName(fs, current, frame->name, 124);
+        if(current == fs->header.root)
+            break;
+    }
+
+    for(u32 i = 0; i < Explorer->depth / 2; ++i) {
+        cwd_frame temp = Explorer->frames[i];
+        Explorer->frames[i] = Explorer->frames[Explorer->depth - 1 - i];
+        Explorer->frames[Explorer->depth - 1 - i] = temp;
+    }
+    CwdChanged(Explorer);
+}
+
+static u32 CwdFind(explorer_state *Explorer, block_index directory) {
+    for(u32 i = 0; i < Explorer->depth; ++i) {
+        if(Explorer->frames[i].block == directory)
+            return i;
+    }
+    return UINT_MAX;
+}
+
+static explorer_state ExplorerBegin(Arena *arena, Arena *scratch, char **names, char **mirrors, u32 nstripes, u32 stripe_blocks, int create_new, int in_memory) {
     explorer_state Explorer = { 0 };
 
-    Explorer.fs = create_new ? SLM_CreateNewFileSystem(name, DEFAULT_FS_SIZE) :
-                               SLM_OpenExistingFileSystem(name);
+    if(in_memory) {
+        Explorer.fs = create_new ? SLM_CreateNewFileSystem(0, 0, 1, stripe_blocks, DEFAULT_FS_SIZE) :
+                                   SLM_LoadFileSystem(names[0]);
+        Explorer.image_name = names[0];
+    }
+    else
+        Explorer.fs = create_new ? SLM_CreateNewFileSystem(names, mirrors, nstripes, stripe_blocks, DEFAULT_FS_SIZE) :
+                                   SLM_OpenExistingFileSystem(names, mirrors);
+    if(!Explorer.fs.header.block_size)
+        return Explorer;
     Explorer.arena = arena;
+    Explorer.scratch = scratch;
     
-    SLM_File root = SLM_ReadRoot(&Explorer.fs);
     Explorer.current_working_directory = PushStruct(arena, file);
     Explorer.current_working_directory->isDirectory = 1;
-    Explorer.current_working_directory->base_block = Explorer.fs.header.root;
-    Explorer.current_working_directory->size = SLM_ReadUsedSize(&Explorer.fs, root.self);
-    SLM_ReadName(&Explorer.fs, root.self, Explorer.current_working_directory->name, 124);
-    
-    int char_copied = _strcpy(Explorer.current_working_directory->name, Explorer.path, 256);
-    Explorer.path[char_copied] = '>';
-    Explorer.path[char_copied + 1] = '\0';
+    CwdLoad(&Explorer, Explorer.fs.header.root);
     return Explorer;
 }
 
@@ -72,51 +177,134 @@ inline int list_item_comp(const void *_a, const void *_b){
     return compare_str(((ListItem*)_a)->name, ((ListItem*)_b)->name);
 } 
 
-void swap(Arena *arena, void* a, void* b, size_t size) {
-    void *buf = PushSize(arena, size);
-    m_copy(a, buf, size);
-    m_copy(b, a, size);
-    m_copy(buf, b, size);
+// sorts count pointers to items, the items themselves never move
+#define SORT_INSERTION_ITEMS 16
+
+static void InsertionSort(void **items, u32 count, comparator cmp) {
+    for(u32 i = 1; i < count; ++i) {
+        void *item = items[i];
+        u32 j = i;
+        for(; j > 0 && cmp(item, items[j - 1]) < 0; --j)
+            items[j] = items[j - 1];
+        items[j] = item;
+    }
 }
 
-int partition(Arena *arena, void *arr, int low, int high, size_t size,
-              int (*cmp)(const void *, const void *)) {
-    void *pivot = (char*)arr + high * size;
-    int i = low - 1;
+static void SiftDown(void **items, u32 root, u32 count, comparator cmp) {
+    void *item = items[root];
+    for(u32 child; (child = 2 * root + 1) < count; root = child) {
+        if(child + 1 < count && cmp(items[child], items[child + 1]) < 0)
+            child++;
+        if(cmp(item, items[child]) >= 0)
+            break;
+        items[root] = items[child];
+    }
+    items[root] = item;
+}
 
-    for (int j = low; j <= high - 1; j++) {
-        if (cmp((char*)arr + j * size, pivot) < 0) {
-            i++;
-            swap(arena, (char*)arr + i * size, (char*)arr + j * size, size);
-        }
+static void HeapSort(void **items, u32 count, comparator cmp) {
+    for(u32 i = count / 2; i-- > 0;)
+        SiftDown(items, i, count, cmp);
+    for(u32 end = count; end-- > 1;) {
+        void *top = items[0];
+        items[0] = items[end];
+        items[end] = top;
+        SiftDown(items, 0, end, cmp);
     }
+}
 
-    swap(arena, (char*)arr + (i+1) * size, (char*)arr + high * size, size);
-    return (i + 1);
+static inline void SwapPointers(void **a, void **b) {
+    void *tmp = *a;
+    *a = *b;
+    *b = tmp;
 }
 
-void q_sort(Arena *arena, void *arr, int low, int high, size_t size,
-               int (*cmp)(const void *, const void *)) {
-    if (low < high) {
-        int pi = partition(arena, arr, low, high, size, cmp);
+// quicksort with the median of the first, middle and last item as pivot.
+// the smaller side is recursed into, a range that has been split too often
+// is heap sorted and small ranges are left to the insertion sort at the end
+static void IntroSortRange(void **items, u32 count, comparator cmp, u32 depth) {
+    while(count > SORT_INSERTION_ITEMS) {
+        if(!depth--) {
+            HeapSort(items, count, cmp);
+            return;
+        }
+
+        void **first = items, **middle = items + count / 2, **last = items + count - 1;
+        if(cmp(*middle, *first) < 0)
+            SwapPointers(middle, first);
+        if(cmp(*last, *middle) < 0) {
+            SwapPointers(last, middle);
+            if(cmp(*middle, *first) < 0)
+                SwapPointers(middle, first);
+        }
+        void *pivot = *middle;
+
+        u32 i = 0, j = count - 1;
+        for(;;) {
+            while(cmp(items[i], pivot) < 0)
+                i++;
+            while(cmp(pivot, items[j]) < 0)
+                j--;
+            if(i >= j)
+                break;
+            SwapPointers(items + i++, items + j--);
+        }
 
-        q_sort(arena, arr, low, pi - 1, size, cmp);
-        q_sort(arena, arr, pi + 1, high, size, cmp);
+        u32 left = j + 1;
+        if(left < count - left) {
+            IntroSortRange(items, left, cmp, depth);
+            items += left;
+            count -= left;
+        }
+        else {
+            IntroSortRange(items + left, count - left, cmp, depth);
+            count = left;
+        }
     }
 }
 
-void sort(Vector *v, comparator comp) {
-    q_sort(v->arena, v->mem, 0, v->count - 1, v->unit_size, comp);
+static void IntroSort(void **items, u32 count, comparator cmp) {
+    u32 depth = 0;
+    for(u32 n = count; n > 1; n >>= 1)
+        depth += 2;
+    IntroSortRange(items, count, cmp, depth);
+    InsertionSort(items, count, cmp);
 }
 
-static void ChangeWorkingDirectory(explorer_state *Explorer, block_index cwd_new) {
-    Explorer->current_working_directory->base_block = cwd_new;
-    Explorer->current_working_directory->size = SLM_ReadUsedSize(&Explorer->fs, cwd_new);
-    SLM_ReadName(&Explorer->fs, cwd_new, Explorer->current_working_directory->name, 123);
+// applies the components of path to the frames, only the directories
+// entered are looked up. nothing changes if a component is not a directory
+static u32 ChangeWorkingDirectory(explorer_state *Explorer, Vector *path) {
+    u32 depth = Explorer->depth;
+    Vector entered = VectorBegin(Explorer->scratch, 8, sizeof(cwd_frame));
+    for(int i = 0; i < path->count; ++i) {
+        char **name = VectorGet(path, i);
+        if(_strcmp(*name, "."))
+            continue;
+        if(_strcmp(*name, "..")) {
+            if(entered.count)
+                entered.count--;
+            else if(depth > 1)
+                depth--;
+            continue;
+        }
+
+        cwd_frame *top = entered.count ? VectorGet(&entered, entered.count - 1) :
+                                         Explorer->frames + depth - 1;
+        SLM_DirectoryEntry entry;
+        if(SLM_FindNamedEntry(&Explorer->fs, top->block, *name, &entry) == UINT_MAX || !entry.is_directory)
+            return 0;
 
-    int char_copied = SLM_BuildPath(&Explorer->fs, cwd_new, Explorer->path, 256);
-    Explorer->path[char_copied] = '>';
-    Explorer->path[char_copied + 1] = '\0';
+        cwd_frame frame = { 0 };
+        frame.block = entry.base_block;
+        _strcpy(entry.name, frame.name, 127);
+        VectorPush(&entered, &frame);
+    }
+
+    CwdReserve(Explorer, depth + entered.count);
+    m_copy(entered.mem, Explorer->frames + depth, entered.count * sizeof(cwd_frame));
+    Explorer->depth = depth + entered.count;
+    CwdChanged(Explorer);
+    return 1;
 }
 
 static ExecutionBlock ExplorerProcessInput(Arena *arena) {
@@ -148,6 +336,666 @@ static inline void DisplayChild(char *name, u32 is_dircetory, u32 size) {
     print("%s\t%s\n", is_dircetory ? "<dir>" : "     ", name);
 }
 
+#define LIST_PAGE_SIZE 50
+#define LIST_RUN_ITEMS 16384
+#define LIST_RADIX_ITEMS 1024
+#define LIST_RADIX_SMALL 32
+#define LIST_MERGE_WAYS 8
+#define LIST_MERGE_ITEMS 32
+#define LIST_SPILL_FILE ".\\tmp\\list.runs"
+
+// what is left to skip before printing and how many more may be printed,
+// limit 0 prints everything. with ext set only the files with that
+// extension are counted
+typedef struct ListOutput {
+    u32 skip;
+    u32 limit;
+    u32 printed;
+    char *ext;
+} ListOutput;
+
+static inline u32 HasExtension(char *name, char *ext) {
+    char own[EXTENSION_SIZE + 1];
+    return SLM_NameExtension(name, own) && _strcmp(own, ext);
+}
+
+// returns 0 once the limit is reached
+static u32 ListEmit(ListOutput *out, ListItem *item) {
+    if(out->ext && (item->is_directory || !HasExtension(item->name, out->ext)))
+        return 1;
+    if(out->skip) {
+        out->skip--;
+        return 1;
+    }
+    DisplayChild(item->name, item->is_directory, item->size);
+    out->printed++;
+    return !out->limit || out->printed < out->limit;
+}
+
+static inline void ListReadItems(FileSystem *fs, block_index directory, u32 first, u32 count, ListItem *items) {
+    SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+    SLM_ReadEntries(fs, directory, first, count, entries);
+    for(u32 i = 0; i < count; ++i) {
+        items[i].size = entries[i].size;
+        items[i].is_directory = entries[i].is_directory;
+        m_copy(entries[i].name, items[i].name, sizeof(items[i].name));
+    }
+}
+
+// entries in the order the directory keeps them, batches that are skipped
+// whole are not read unless they have to be filtered
+static void ListUnsorted(FileSystem *fs, block_index directory, ListOutput *out) {
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+    u32 first = out->ext ? 0 : out->skip - out->skip % ENTRIES_PER_READ;
+    out->skip -= first;
+
+    ListItem items[ENTRIES_PER_READ];
+    for(; first < nentries; first += ENTRIES_PER_READ) {
+        u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+        ListReadItems(fs, directory, first, count, items);
+        for(u32 i = 0; i < count; ++i) {
+            if(!ListEmit(out, items + i))
+                return;
+        }
+    }
+}
+
+// buckets of the radix sort, 0 for names that have ended and then every
+// byte in the order compare_str puts them
+#define NAME_RANKS 257
+#define NameRank(c) ((c) ? (u32)(u8)((signed char)(c) + 128) + 1 : 0)
+
+// MSD radix sort on the byte at depth, buckets that get small are left to
+// the introsort. names that have ended at depth are equal
+static void ListRadixSort(ListItem **items, ListItem **tmp, u32 count, u32 depth) {
+    while(count > LIST_RADIX_SMALL && depth < sizeof(items[0]->name)) {
+        u32 counts[NAME_RANKS] = { 0 }, next[NAME_RANKS];
+        for(u32 i = 0; i < count; ++i)
+            counts[NameRank(items[i]->name[depth])]++;
+
+        // a prefix all of them share is skipped without moving anything
+        u32 rank = NameRank(items[0]->name[depth]);
+        if(counts[rank] == count) {
+            if(!rank)
+                return;
+            depth++;
+            continue;
+        }
+
+        u32 offset = 0;
+        for(u32 r = 0; r < NAME_RANKS; ++r) {
+            next[r] = offset;
+            offset += counts[r];
+        }
+        for(u32 i = 0; i < count; ++i)
+            tmp[next[NameRank(items[i]->name[depth])]++] = items[i];
+        MemCopy(items, tmp, count * sizeof(ListItem*));
+
+        offset = counts[0];
+        for(u32 r = 1; r < NAME_RANKS; ++r) {
+            if(counts[r] > 1)
+                ListRadixSort(items + offset, tmp + offset, counts[r], depth + 1);
+            offset += counts[r];
+        }
+        return;
+    }
+    IntroSort((void**)items, count, list_item_comp);
+}
+
+// sorts count items and copies the first keep of them to sorted in order
+static void ListSortRun(ListItem *items, u32 count, u32 keep, ListItem *sorted, ListItem **order, ListItem **tmp) {
+    for(u32 i = 0; i < count; ++i)
+        order[i] = items + i;
+    if(count >= LIST_RADIX_ITEMS)
+        ListRadixSort(order, tmp, count, 0);
+    else
+        IntroSort((void**)order, count, list_item_comp);
+
+    for(u32 i = 0; i < keep; ++i)
+        sorted[i] = *order[i];
+}
+
+typedef struct ListRunReader {
+    file_offset off;
+    u32 left;
+    u32 pos;
+    u32 count;
+    ListItem items[LIST_MERGE_ITEMS];
+} ListRunReader;
+
+static ListItem* ListRunPeek(active_file *spill, ListRunReader *run) {
+    if(run->pos == run->count) {
+        if(!run->left)
+            return 0;
+        run->count = MIN(run->left, LIST_MERGE_ITEMS);
+        ReadFromFileAtOffset(spill, run->items, run->count * sizeof(ListItem), run->off);
+        run->off += run->count * sizeof(ListItem);
+        run->left -= run->count;
+        run->pos = 0;
+    }
+    return run->items + run->pos;
+}
+
+// merges the sorted runs of run_length items that follow each other at src
+// and hold nitems in all. the result is printed when out is given and
+// written to dst otherwise, returns 0 once out is full
+static u32 ListMergeRuns(active_file *spill, file_offset src, u32 run_length, u32 nitems, file_offset dst, ListOutput *out) {
+    ListRunReader runs[LIST_MERGE_WAYS];
+    u32 nruns = 0;
+    for(u32 first = 0; first < nitems && nruns < LIST_MERGE_WAYS; first += run_length) {
+        ListRunReader *run = runs + nruns++;
+        run->off = src + (file_offset)first * sizeof(ListItem);
+        run->left = MIN(run_length, nitems - first);
+        run->pos = 0;
+        run->count = 0;
+    }
+
+    ListItem merged[LIST_MERGE_ITEMS];
+    u32 nmerged = 0;
+    while(1) {
+        ListRunReader *next = 0;
+        ListItem *next_item = 0;
+        for(u32 i = 0; i < nruns; ++i) {
+            ListItem *item = ListRunPeek(spill, runs + i);
+            if(item && (!next_item || list_item_comp(item, next_item) < 0)) {
+                next = runs + i;
+                next_item = item;
+            }
+        }
+        if(!next)
+            break;
+        next->pos++;
+
+        if(out) {
+            if(!ListEmit(out, next_item))
+                return 0;
+            continue;
+        }
+        merged[nmerged++] = *next_item;
+        if(nmerged == LIST_MERGE_ITEMS) {
+            WriteToFileAtOffset(spill, merged, sizeof(merged), dst);
+            dst += sizeof(merged);
+            nmerged = 0;
+        }
+    }
+    WriteToFileAtOffset(spill, merged, nmerged * sizeof(ListItem), dst);
+    return 1;
+}
+
+// entries sorted by name with a bounded amount of memory. a window that
+// fits a run keeps only its smallest items, a directory that fits a run is
+// sorted in memory and anything larger is sorted in runs of LIST_RUN_ITEMS
+// spilled to a host file and merged LIST_MERGE_WAYS at a time. runs are
+// sorted as pointers and the items copied once, in order
+static void ListSorted(explorer_state *Explorer, block_index directory, ListOutput *out) {
+    FileSystem *fs = &Explorer->fs;
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+
+    u32 capacity = MIN(nentries, LIST_RUN_ITEMS) + ENTRIES_PER_READ;
+    ListItem *items = PushArray(Explorer->scratch, ListItem, capacity);
+    ListItem *sorted = PushArray(Explorer->scratch, ListItem, capacity);
+    ListItem **order = PushArray(Explorer->scratch, ListItem*, capacity);
+    ListItem **tmp = PushArray(Explorer->scratch, ListItem*, capacity);
+
+    u32 window = out->limit && !out->ext ? out->skip + out->limit : 0;
+    if(nentries <= LIST_RUN_ITEMS || (window && window <= LIST_RUN_ITEMS)) {
+        u32 count = 0;
+        for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+            u32 batch = MIN(nentries - first, ENTRIES_PER_READ);
+            ListReadItems(fs, directory, first, batch, items + count);
+            count += batch;
+            if(count > LIST_RUN_ITEMS) {
+                ListSortRun(items, count, window, sorted, order, tmp);
+                ListItem *kept = sorted;
+                sorted = items;
+                items = kept;
+                count = window;
+            }
+        }
+        ListSortRun(items, count, count, sorted, order, tmp);
+        for(u32 i = 0; i < count && ListEmit(out, sorted + i); ++i);
+        return;
+    }
+
+    CreateDirectoryA("tmp", 0);
+    active_file spill = CreateNewFile(LIST_SPILL_FILE);
+    for(u32 begin = 0; begin < nentries; begin += LIST_RUN_ITEMS) {
+        u32 count = MIN(nentries - begin, LIST_RUN_ITEMS);
+        for(u32 first = 0; first < count; first += ENTRIES_PER_READ)
+            ListReadItems(fs, directory, begin + first, MIN(count - first, ENTRIES_PER_READ), items + first);
+        ListSortRun(items, count, count, sorted, order, tmp);
+        WriteToFileAtOffset(&spill, sorted, count * sizeof(ListItem), (file_offset)begin * sizeof(ListItem));
+    }
+
+    // every pass writes its runs to the other half of the file
+    file_offset src = 0, dst = (file_offset)nentries * sizeof(ListItem);
+    u32 run_length = LIST_RUN_ITEMS;
+    while(RoundUpDivision(nentries, run_length) > LIST_MERGE_WAYS) {
+        u32 group_length = run_length * LIST_MERGE_WAYS;
+        for(u32 first = 0; first < nentries; first += group_length) {
+            file_offset off = (file_offset)first * sizeof(ListItem);
+            ListMergeRuns(&spill, src + off, run_length, MIN(nentries - first, group_length), dst + off, 0);
+        }
+
+        file_offset swap = src;
+        src = dst;
+        dst = swap;
+        run_length = group_length;
+    }
+    ListMergeRuns(&spill, src, run_length, nentries, 0, out);
+
+    TruncateFile(&spill, 0);
+    CloseFile(&spill);
+}
+
+#define FIND_BATCH_DIRS 1024
+
+// the most directories the queue holds. the room left in it is shared by
+// the directories of a batch, the subdirectories past its share are walked
+// by the walker that found them
+#define FIND_QUEUE_DIRS (16 * FIND_BATCH_DIRS)
+
+// the most bytes of matches a walker keeps in memory, the ones before them
+// are spilled to a host file of its own until the batch is printed
+#define FIND_OUT_MAX (64 * 1024)
+#define FIND_SPILL_FILE ".\\tmp\\find"
+
+// a directory waiting to be read and, once a walker has read it, where its
+// matches and its subdirectories are in the buffers of that walker
+typedef struct find_dir {
+    block_index block;
+    u32 depth;
+    char *path;
+    u32 path_length;
+
+    u32 walker;
+    file_offset out_first;
+    file_offset out_end;
+    u32 dirs_first;
+    u32 dirs_end;
+} find_dir;
+
+typedef struct find_search {
+    FileSystem *fs;
+    substring_search token;
+    u32 max_depth;
+    u32 type;
+    char *ext;
+
+    // cleared when the directories to read are all known from the index.
+    // share is how many subdirectories every directory of the batch queues
+    u32 descend;
+    u32 share;
+
+    // the part of the queue being walked, next is the first directory no
+    // walker has taken yet
+    find_dir *batch;
+    u32 count;
+    volatile u32 next;
+} find_search;
+
+// a directory a walker is reading. the reader and the path buffer of a
+// level are kept for every directory walked at that depth
+typedef struct find_level {
+    find_dir dir;
+    SLM_DirectoryReader *reader;
+    char *path;
+    u32 path_total;
+} find_level;
+
+// the paths of the directories a walker queues live in its arena until the
+// search ends, out holds the lines of its matches. levels are the
+// directories being read, the first one is from the queue and the ones
+// above it are subdirectories past its share. the first spilled bytes of
+// the matches of a batch are in spill, out holds the ones after them
+typedef struct find_walker {
+    find_search *search;
+    u32 index;
+    Arena arena;
+    Vector out;
+    Vector dirs;
+    Vector levels;
+
+    active_file spill;
+    u32 spill_open;
+    file_offset spilled;
+} find_walker;
+
+static inline file_offset FindOutEnd(find_walker *walker) {
+    return walker->spilled + walker->out.count;
+}
+
+// a walker walking a large subtree past its share would keep every match
+// of it until the batch is printed
+static void FindSpill(find_walker *walker) {
+    if(!walker->spill_open) {
+        char name[32] = FIND_SPILL_FILE;
+        u32 length = _strlen(name);
+        _utostr(walker->index, name + length, sizeof(name) - length);
+        CreateDirectoryA("tmp", 0);
+        walker->spill = CreateNewFile(name);
+        walker->spill_open = 1;
+    }
+    WriteToFileAtOffset(&walker->spill, walker->out.mem, walker->out.count, walker->spilled);
+    walker->spilled += walker->out.count;
+    walker->out.count = 0;
+}
+
+// the matches between first and end, the spilled part is read back through
+// the console buffer
+static void FindPrint(find_walker *walker, file_offset first, file_offset end) {
+    while(first < end && first < walker->spilled) {
+        u32 count = MIN(MIN(end, walker->spilled) - first, WRITE_BUFFER_SIZE);
+        ReadFromFileAtOffset(&walker->spill, ConsoleReserve(count), count, first);
+        ConsoleBuffer.used += count;
+        first += count;
+    }
+    if(first < end)
+        ConsoleAppend((char*)walker->out.mem + (first - walker->spilled), end - first);
+}
+
+static void FindChildPath(find_dir *dir, char *name, u32 length, char *path) {
+    m_copy(dir->path, path, dir->path_length);
+    path[dir->path_length] = '/';
+    m_copy(name, path + dir->path_length + 1, length + 1);
+}
+
+// starts reading dir at level top. a subdirectory walked right away is
+// given with its name, its path is built in the buffer of the level
+static void FindEnterLevel(find_walker *walker, u32 top, find_dir *dir, char *name, u32 length) {
+    if(top == walker->levels.count) {
+        find_level level = { 0 };
+        level.reader = PushStruct(&walker->arena, SLM_DirectoryReader);
+        VectorPush(&walker->levels, &level);
+    }
+
+    find_level *level = (find_level*)walker->levels.mem + top;
+    level->dir = *dir;
+    if(name) {
+        level->dir.path_length = dir->path_length + 1 + length;
+        if(level->dir.path_length + 1 > level->path_total) {
+            ReleaseBlock(&walker->arena, level->path, level->path_total);
+            level->path_total = MAX(2 * (level->dir.path_length + 1), 128);
+            level->path = PushBlock(&walker->arena, level->path_total);
+        }
+        FindChildPath(dir, name, length, level->path);
+        level->dir.path = level->path;
+    }
+    SLM_DirectoryReaderBegin(level->reader, walker->search->fs, level->dir.block);
+}
+
+// the first search->share subdirectories of dir are queued, the others are
+// walked right away, depth first, and their matches go with those of dir
+static void FindWalkDirectory(find_walker *walker, find_dir *dir) {
+    find_search *search = walker->search;
+    SLM_DirectoryEntry entry;
+    u32 share = search->share;
+
+    u32 top = 0;
+    FindEnterLevel(walker, top, dir, 0, 0);
+    while(1) {
+        find_level *level = (find_level*)walker->levels.mem + top;
+        if(!SLM_DirectoryReaderNext(level->reader, &entry)) {
+            if(!top--)
+                break;
+            continue;
+        }
+
+        find_dir *current = &level->dir;
+        u32 length = _strlen(entry.name);
+        u32 wanted = !search->type || (search->type == FIND_DIRECTORIES) == (entry.is_directory != 0);
+        if(search->ext)
+            wanted = wanted && !entry.is_directory && HasExtension(entry.name, search->ext);
+        if(wanted && SubstringFind(&search->token, entry.name) != UINT_MAX) {
+            VectorAppend(&walker->out, current->path, current->path_length);
+            VectorAppend(&walker->out, "/", 1);
+            VectorAppend(&walker->out, entry.name, length);
+            if(entry.is_directory)
+                VectorAppend(&walker->out, "/\n", 2);
+            else
+                VectorAppend(&walker->out, "\n", 1);
+            if(walker->out.count >= FIND_OUT_MAX)
+                FindSpill(walker);
+        }
+
+        u32 depth = current->depth + 1;
+        if(!entry.is_directory || !search->descend || depth >= search->max_depth)
+            continue;
+
+        find_dir child = { 0 };
+        child.block = entry.base_block;
+        child.depth = depth;
+        if(!top && share) {
+            child.path_length = current->path_length + 1 + length;
+            child.path = PushString(&walker->arena, child.path_length + 1);
+            FindChildPath(current, entry.name, length, child.path);
+            VectorPush(&walker->dirs, &child);
+            share--;
+            continue;
+        }
+
+        child.path = current->path;
+        child.path_length = current->path_length;
+        FindEnterLevel(walker, ++top, &child, entry.name, length);
+    }
+}
+
+static void FindWalk(void *data) {
+    find_walker *walker = data;
+    find_search *search = walker->search;
+
+    while(1) {
+        u32 index = AtomicIncrement(&search->next);
+        if(index >= search->count)
+            break;
+
+        find_dir *dir = search->batch + index;
+        dir->walker = walker->index;
+        dir->out_first = FindOutEnd(walker);
+        dir->dirs_first = walker->dirs.count;
+        FindWalkDirectory(walker, dir);
+        dir->out_end = FindOutEnd(walker);
+        dir->dirs_end = walker->dirs.count;
+    }
+}
+
+// reads block on disk, twice as many walkers as processors keep more of
+// them in flight
+static void FindBegin(explorer_state *Explorer) {
+    u32 nwalkers = MIN(2 * ProcessorCount(), WORKERS_MAX + 1);
+    Explorer->nwalkers = nwalkers;
+    Explorer->walkers = MemAlloc(nwalkers * sizeof(find_walker));
+    for(u32 i = 0; i < nwalkers; ++i) {
+        Explorer->walkers[i].index = i;
+        InitMemArena(&Explorer->walkers[i].arena, ARENA_CHUNK_SIZE, 0);
+    }
+    if(nwalkers > 1)
+        Explorer->find_pool = StartWorkers(nwalkers - 1);
+}
+
+// with an index on the image only the directories it has for every trigram
+// of the pattern and for the extension are read, in the order of their blocks. those not under
+// root or deeper than the search goes are left out
+static u32 FindCandidates(explorer_state *Explorer, find_search *search, char *pattern, find_dir *first, Vector *queue) {
+    FileSystem *fs = &Explorer->fs;
+    Vector directories = VectorBegin(Explorer->scratch, 64, sizeof(block_index));
+    if(!SLM_IndexLookup(fs, pattern, search->ext, &directories))
+        return 0;
+    search->descend = 0;
+
+    // names of the directories between root and the candidate, deepest first
+    Vector names = VectorBegin(Explorer->scratch, 16, 128);
+    for(u32 i = 0; i < directories.count; ++i) {
+        block_index directory = ((block_index*)directories.mem)[i];
+
+        // the root of the image is its own parent
+        names.count = 0;
+        u32 length = first->path_length;
+        block_index block = directory;
+        while(block != first->block) {
+            block_index parent = SLM_ReadParent(fs, block);
+            if(parent == block || names.count + 1 >= search->max_depth)
+                break;
+
+            char name[128];
+            SLM_ReadName(fs, block, name, sizeof(name));
+            length += 1 + _strlen(name);
+            VectorPush(&names, name);
+            block = parent;
+        }
+        if(block != first->block)
+            continue;
+
+        find_dir dir = { 0 };
+        dir.block = directory;
+        dir.depth = names.count;
+        dir.path = PushString(Explorer->scratch, length + 1);
+        m_copy(first->path, dir.path, first->path_length);
+        dir.path_length = first->path_length;
+        for(u32 j = names.count; j-- > 0;) {
+            char *name = (char*)names.mem + j * 128;
+            u32 name_length = _strlen(name);
+            dir.path[dir.path_length++] = '/';
+            m_copy(name, dir.path + dir.path_length, name_length);
+            dir.path_length += name_length;
+        }
+        dir.path[dir.path_length] = 0;
+        VectorPush(queue, &dir);
+    }
+    return 1;
+}
+
+// breadth first, the walkers share FIND_BATCH_DIRS directories of the queue
+// at a time. what they found is taken in queue order once the batch is
+// done, so the output is the same whichever walker read what. the share of
+// a directory only depends on the queue, so neither do the subtrees walked
+// past it
+static void Find(explorer_state *Explorer, FindArgs *args, block_index root, char *label) {
+    if(!Explorer->walkers)
+        FindBegin(Explorer);
+
+    find_search search = { 0 };
+    search.fs = &Explorer->fs;
+    SubstringSearchBegin(&search.token, args->str_to_search);
+    search.max_depth = args->max_depth;
+    search.type = args->type;
+    search.ext = args->ext;
+    search.descend = 1;
+
+    void *data[WORKERS_MAX + 1];
+    ArenaMarker markers[WORKERS_MAX + 1];
+    for(u32 i = 0; i < Explorer->nwalkers; ++i) {
+        find_walker *walker = Explorer->walkers + i;
+        markers[i] = ArenaSave(&walker->arena);
+        walker->search = &search;
+        walker->out = VectorBegin(&walker->arena, KiloBytes(4), 1);
+        walker->dirs = VectorBegin(&walker->arena, 64, sizeof(find_dir));
+        walker->levels = VectorBegin(&walker->arena, 16, sizeof(find_level));
+        data[i] = walker;
+    }
+
+    find_dir first = { 0 };
+    first.block = root;
+    first.path = label;
+    first.path_length = _strlen(label);
+    while(first.path_length > 1 && label[first.path_length - 1] == '/')
+        first.path_length--;
+
+    Vector queue = VectorBegin(Explorer->scratch, FIND_BATCH_DIRS, sizeof(find_dir));
+    if(!FindCandidates(Explorer, &search, args->str_to_search, &first, &queue))
+        VectorPush(&queue, &first);
+
+    u32 head = 0;
+    while(head < queue.count) {
+        search.batch = (find_dir*)queue.mem + head;
+        search.count = MIN(queue.count - head, FIND_BATCH_DIRS);
+        search.next = 0;
+        u32 pending = queue.count - head - search.count;
+        search.share = pending < FIND_QUEUE_DIRS ? (FIND_QUEUE_DIRS - pending) / search.count : 0;
+        for(u32 i = 0; i < Explorer->nwalkers; ++i) {
+            Explorer->walkers[i].out.count = 0;
+            Explorer->walkers[i].spilled = 0;
+            Explorer->walkers[i].dirs.count = 0;
+        }
+
+        u32 nwalkers = MIN(Explorer->nwalkers, search.count);
+        RunWorkers(Explorer->find_pool, FindWalk, data, nwalkers);
+
+        for(u32 i = 0; i < search.count; ++i) {
+            find_dir dir = ((find_dir*)queue.mem)[head + i];
+            find_walker *walker = Explorer->walkers + dir.walker;
+            FindPrint(walker, dir.out_first, dir.out_end);
+            VectorAppend(&queue, (find_dir*)walker->dirs.mem + dir.dirs_first, dir.dirs_end - dir.dirs_first);
+        }
+        head += search.count;
+
+        // the walked part of the queue is dropped once it outgrows the rest
+        if(head > queue.count - head) {
+            u32 left = queue.count - head;
+            m_copy((find_dir*)queue.mem + head, queue.mem, left * sizeof(find_dir));
+            queue.count = left;
+            head = 0;
+        }
+    }
+
+    for(u32 i = 0; i < Explorer->nwalkers; ++i) {
+        find_walker *walker = Explorer->walkers + i;
+        ArenaRestore(&walker->arena, markers[i]);
+        if(walker->spill_open) {
+            TruncateFile(&walker->spill, 0);
+            CloseFile(&walker->spill);
+            walker->spill_open = 0;
+        }
+    }
+}
+
+// the root of the image is its own parent
+static u32 IsUnder(FileSystem *fs, block_index directory, block_index root) {
+    while(directory != root) {
+        block_index parent = SLM_ReadParent(fs, directory);
+        if(parent == directory)
+            return 0;
+        directory = parent;
+    }
+    return 1;
+}
+
+// deletes every file with extension ext under root and returns how many.
+// with an index only the directories it has for the extension are read,
+// without one the whole subtree is
+static u32 DeleteByExtension(explorer_state *Explorer, block_index root, char *ext) {
+    FileSystem *fs = &Explorer->fs;
+    Vector directories = VectorBegin(Explorer->scratch, 64, sizeof(block_index));
+    u32 indexed = SLM_IndexLookup(fs, 0, ext, &directories);
+    if(!indexed)
+        VectorPush(&directories, &root);
+
+    // a directory is read whole first, every removal moves its last entry
+    Vector entries = VectorBegin(Explorer->scratch, ENTRIES_PER_READ, sizeof(SLM_DirectoryEntry));
+    u32 deleted = 0;
+    for(u32 i = 0; i < directories.count; ++i) {
+        block_index directory = ((block_index*)directories.mem)[i];
+        if(indexed && !IsUnder(fs, directory, root))
+            continue;
+
+        u32 nentries = SLM_ReadNEntries(fs, directory);
+        VectorReserve(&entries, nentries);
+        SLM_ReadEntries(fs, directory, 0, nentries, entries.mem);
+        for(u32 j = 0; j < nentries; ++j) {
+            SLM_DirectoryEntry *entry = (SLM_DirectoryEntry*)entries.mem + j;
+            if(entry->is_directory) {
+                if(!indexed)
+                    VectorPush(&directories, &entry->base_block);
+            }
+            else if(HasExtension(entry->name, ext)) {
+                SLM_DeleteFile(fs, directory, entry);
+                deleted++;
+            }
+        }
+    }
+    return deleted;
+}
+
 static Vector ParsePath(Arena *arena, char *path) {
     Vector res = VectorBegin(arena, 5, sizeof(char*));
 
@@ -171,7 +1019,10 @@ typedef enum {
 
 typedef struct {
     block_index terminating;
-    block_index penultimate;
+
+    // directory holding terminating and the entry that points to it
+    block_index parent;
+    SLM_DirectoryEntry entry;
     
     traverse_errors err;
     char *str;
@@ -181,14 +1032,11 @@ traverse_result TraversePath(Vector *path, FileSystem *fs, file *cwd) {
     traverse_result res = { 0 };
 
     res.terminating = cwd->base_block;
-    res.penultimate = cwd->base_block;
+    res.parent = cwd->base_block;
     for(int i = 0; i < path->count; ++i) {
         char **_target = VectorGet(path, i);
         char *target = *_target;
 
-        if(i > 1)
-            res.penultimate = res.terminating;
-
         if(_strcmp(target, "..")) {
             res.terminating = SLM_ReadParent(fs, res.terminating);
             if(i == path->count - 1)
@@ -201,17 +1049,17 @@ traverse_result TraversePath(Vector *path, FileSystem *fs, file *cwd) {
             continue;
         }
 
-        char next_name[128];
-        SLM_ReadName(fs, res.terminating, next_name, 128);
-        res.terminating = SLM_GetChild(fs, res.terminating, target);
-
-        u32 is_directory = SLM_ReadIsDirectory(fs, res.terminating);
-        if(res.terminating == 0) {
+        SLM_DirectoryEntry entry;
+        if(SLM_FindNamedEntry(fs, res.terminating, target, &entry) == UINT_MAX) {
             res.err = not_found;
             res.str = target;
             break;
         }
-        if(!is_directory) {
+        res.parent = res.terminating;
+        res.entry = entry;
+        res.terminating = entry.base_block;
+
+        if(!entry.is_directory) {
             if(i == path->count - 1)
                 res.err = last_not_directory;
             else
@@ -221,9 +1069,32 @@ traverse_result TraversePath(Vector *path, FileSystem *fs, file *cwd) {
         }
     }
 
+    if(res.err == ends_with_pnemonic) {
+        res.parent = SLM_ReadParent(fs, res.terminating);
+        SLM_FindEntry(fs, res.parent, res.terminating, &res.entry);
+    }
+
     return res;
 }
 
+// looks the frames up again by name, defrag may have moved the directories
+// and a rollback or receive may have removed part of the path
+static void ResolveWorkingDirectory(explorer_state *Explorer) {
+    FileSystem *fs = &Explorer->fs;
+    Explorer->frames[0].block = fs->header.root;
+    SLM_ReadName(fs, fs->header.root, Explorer->frames[0].name, 124);
+
+    u32 depth = 1;
+    for(; depth < Explorer->depth; ++depth) {
+        block_index child = SLM_GetChild(fs, Explorer->frames[depth - 1].block, Explorer->frames[depth].name);
+        if(!child)
+            break;
+        Explorer->frames[depth].block = child;
+    }
+    Explorer->depth = depth;
+    CwdChanged(Explorer);
+}
+
 static char* ExtractFileNameFromPath(char *path) {
     char *res = path;
     while(*path) {
@@ -285,7 +1156,25 @@ void delete_folder(const char *folder) {
 }
 
 
-static void ExplorerRun(Arena *arena, int argc, char **argv) {
+// the backing files of an image are named by a list separated by commas,
+// returns 0 when there are too many of them
+static u32 SplitFileNames(char *list, char **names) {
+    u32 count = 0;
+    for(char *name = list;; ++name) {
+        if(count == STRIPES_MAX)
+            return 0;
+        names[count++] = name;
+        while(*name && *name != ',')
+            name++;
+        if(!*name)
+            return count;
+        *name = '\0';
+    }
+}
+
+// persistent holds what lives as long as the explorer, arena is reset after
+// every command
+static void ExplorerRun(Arena *persistent, Arena *arena, int argc, char **argv) {
     if(argc < 3) {
         print("%s", usage_msg);
         print("%s", modes_msg);
@@ -293,31 +1182,104 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
         return;
     }
 
-    if(argc > 3) {
-        print("Unknown argument \"%s\"", argv[3]);
+    u32 stripe_blocks = DEFAULT_STRIPE_BLOCKS;
+    char *mirror_list = 0;
+    u32 flush = 0;
+    for(int i = 3; i < argc; ++i) {
+        if(i + 1 < argc && _strcmp(argv[i], "--stripe-unit") && _strtou(argv[i + 1], &stripe_blocks) && stripe_blocks)
+            ++i;
+        else if(i + 1 < argc && _strcmp(argv[i], "--mirror"))
+            mirror_list = argv[++i];
+        else if(_strcmp(argv[i], "--flush"))
+            flush = 1;
+        else {
+            print("Unknown argument \"%s\"", argv[i]);
+            return;
+        }
+    }
+
+    char *names[STRIPES_MAX], *mirrors[STRIPES_MAX];
+    u32 nstripes = SplitFileNames(argv[2], names);
+    u32 nmirrors = mirror_list ? SplitFileNames(mirror_list, mirrors) : 0;
+    if(!nstripes || (mirror_list && !nmirrors)) {
+        print("An image can span at most %d files\n", STRIPES_MAX);
         return;
     }
+    if(mirror_list && nmirrors != nstripes) {
+        print("Every backing file needs one mirror\n");
+        return;
+    }
+    char **mirror_names = mirror_list ? mirrors : 0;
 
     explorer_state Explorer = { 0 };
     if(_strcmp(argv[1], "m") || _strcmp(argv[1], "mount")) {
-        Explorer = ExplorerBegin(arena, argv[2], 0);
+        SLM_Header header = SLM_ReadImageHeader(names[0]);
+        if(!SLM_IsImage(&header)) {
+            print("\"%s\" is not an image of this version of slim64\n", names[0]);
+            return;
+        }
+        if(header.nstripes != nstripes) {
+            print("\"%s\" is striped over %d files\n", names[0], header.nstripes);
+            return;
+        }
+
+        if(mirror_list) {
+            char *rewritten;
+            u32 res = SLM_ReconcileMirror(names, mirrors, nstripes, &rewritten);
+            if(!res) {
+                print("\"%s\" is not a copy of \"%s\"\n", mirrors[0], names[0]);
+                return;
+            }
+            if(res == UINT_MAX) {
+                print("\"%s\" was behind and could not be brought up to date\n", rewritten);
+                return;
+            }
+            if(rewritten)
+                print("\"%s\" was behind and has been brought up to date\n", rewritten);
+        }
+        Explorer = ExplorerBegin(persistent, arena, names, mirror_names, nstripes, stripe_blocks, 0, 0);
     }
     else if(_strcmp(argv[1], "n") || _strcmp(argv[1], "new")){
-        Explorer = ExplorerBegin(arena, argv[2], 1);
+        Explorer = ExplorerBegin(persistent, arena, names, mirror_names, nstripes, stripe_blocks, 1, 0);
+    }
+    else if(_strcmp(argv[1], "r") || _strcmp(argv[1], "ram")) {
+        if(nstripes != 1 || mirror_list) {
+            print("An image kept in memory is saved to a single file\n");
+            return;
+        }
+
+        // anything that is not an image of a single file is overwritten by
+        // the first save
+        SLM_Header header = SLM_ReadImageHeader(names[0]);
+        u32 load = SLM_IsImage(&header) && header.nstripes == 1;
+        Explorer = ExplorerBegin(persistent, arena, names, 0, 1, stripe_blocks, !load, 1);
+        Explorer.flush = flush;
     }
     else {
         print("Invalid mode \"%s\"\n", argv[1]);
         print("%s", modes_msg);
         return;
     }
+    if(!Explorer.fs.header.block_size) {
+        print("The journal of \"%s\" is damaged, the image cannot be mounted\n", names[0]);
+        return;
+    }
+
+    SLM_BeginTransaction(&Explorer.fs);
+    if(SLM_RebuildStaleNameIndex(&Explorer.fs))
+        print("The index was of an older format and has been built again\n");
+    SLM_EndTransaction(&Explorer.fs);
 
     delete_folder("tmp");
 
     u32 running = 1;
     while(running) {
         print(PATH "%s " RESET, Explorer.path);
+        ArenaMarker scope = ArenaSave(arena);
         ExecutionBlock input = ExplorerProcessInput(arena);
         
+        // every command is one transaction of the journal
+        SLM_BeginTransaction(&Explorer.fs);
         switch(input.command) {
             case c_invalid:
             {
@@ -337,42 +1299,38 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                 }
                 Path *arg = input.arg;
                 Vector path = ParsePath(arena, arg->target);
-                traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
-                if(res.err && res.err != ends_with_pnemonic) {
+                if(!ChangeWorkingDirectory(&Explorer, &path))
                     print("Invalid path\n");
-                    break;
-                }
-
-                block_index cwd_new = res.terminating;
-                ChangeWorkingDirectory(&Explorer, cwd_new);
             } break;
 
             case c_list:
             {
-                DisplayChild(".", 1, 0);
-                DisplayChild("..", 1, 0);
-
-                u32 n_children = SLM_ReadNEntries(&Explorer.fs, Explorer.current_working_directory->base_block);
-                Vector list = VectorBegin(arena, n_children, sizeof(ListItem));
-                
-                for(int i = 0; i < n_children; ++i) {
-                    SLM_DirectoryEntry entry = SLM_ReadEntry(&Explorer.fs, Explorer.current_working_directory->base_block, i);
-
-                    u32 is_directory = SLM_ReadIsDirectory(&Explorer.fs, entry.base_block);
-                    size_t total_size = SLM_ReadUsedSize(&Explorer.fs, entry.base_block);
-                    size_t effective_size = total_size - INIT_USED_SIZE;
-
-                    ListItem item = {effective_size, is_directory};
-                    _strcpy(entry.name, item.name, 128);
-                    VectorPush(&list, &item);
-
+                ListArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
                 }
-                sort(&list, list_item_comp);
 
-                for(int i = 0; i < n_children; ++i) {
-                    ListItem *item = VectorGet(&list, i);
-                    DisplayChild(item->name, item->is_directory, item->size);
+                ListOutput out = { 0 };
+                out.limit = args->limit;
+                out.ext = args->ext;
+                if(args->page) {
+                    if(!out.limit)
+                        out.limit = LIST_PAGE_SIZE;
+                    out.skip = (args->page - 1) * out.limit;
+                }
+                // . and .. are not entries, paged output leaves them out
+                // so that every page holds limit entries
+                if(!out.limit && !out.ext) {
+                    DisplayChild(".", 1, 0);
+                    DisplayChild("..", 1, 0);
                 }
+
+                block_index directory = Explorer.current_working_directory->base_block;
+                if(args->unsorted)
+                    ListUnsorted(&Explorer.fs, directory, &out);
+                else
+                    ListSorted(&Explorer, directory, &out);
             } break;
 
             case c_make_directory:
@@ -436,11 +1394,13 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                     }
                     if(is_valid) 
                         SLM_InsertNewDirectory(&Explorer.fs, final_name, parent);
+                    VectorFree(&levels);
                 }
             } break;
 
             case c_clear:
             {
+                FlushConsole();
                 ClearConsole();
             } break;
 
@@ -468,7 +1428,13 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                 }
 
                 char **old_name = VectorGet(&old_path, old_path.count - 1);
-                SLM_RenameEntry(&Explorer.fs, res.penultimate, *old_name, arg->new_name);
+                SLM_RenameEntry(&Explorer.fs, res.parent, *old_name, arg->new_name);
+
+                u32 frame = res.entry.is_directory ? CwdFind(&Explorer, res.entry.base_block) : UINT_MAX;
+                if(frame != UINT_MAX) {
+                    SLM_ReadName(&Explorer.fs, res.entry.base_block, Explorer.frames[frame].name, 124);
+                    CwdChanged(&Explorer);
+                }
             } break;
 
             case c_copy:
@@ -511,7 +1477,6 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                         print("No such directory \"%s\"\n", res.str);
                         break;
                     }
-                    block_index src_item = res.terminating;
 
                     char **file_name = VectorGet(&src_path, src_path.count - 1);
                     if(SLM_EntryExists(&Explorer.fs, dst_directory, *file_name)) {
@@ -520,9 +1485,14 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                     }
 
                     if(input.command == c_copy)
-                        SLM_Copy(&Explorer.fs, src_item, dst_directory);
+                        SLM_Copy(&Explorer.fs, res.parent, &res.entry, dst_directory);
                     else
-                        SLM_Move(&Explorer.fs, src_item, dst_directory);
+                        SLM_Move(&Explorer.fs, res.parent, &res.entry, dst_directory);
+
+                    // moving a directory on the way to the working directory changes its path
+                    if(res.entry.is_directory && CwdFind(&Explorer, res.entry.base_block) != UINT_MAX)
+                        CwdLoad(&Explorer, Explorer.current_working_directory->base_block);
+                    VectorFree(&src_path);
                 }
             } break;
 
@@ -533,6 +1503,22 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                     print("No files provided\n");
                     break;
                 }      
+
+                if(args->ext) {
+                    block_index root = Explorer.current_working_directory->base_block;
+                    if(args->names.count) {
+                        char **path_str = VectorGet(&args->names, 0);
+                        Vector path = ParsePath(arena, *path_str);
+                        traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
+                        if(res.err && res.err != ends_with_pnemonic) {
+                            print("Invalid path\n");
+                            break;
+                        }
+                        root = res.terminating;
+                    }
+                    print("Deleted %d files\n", DeleteByExtension(&Explorer, root, args->ext));
+                    break;
+                }
                    
                 Vector *arg = &args->names;
                 for(int i = 0; i < arg->count; ++i) {
@@ -541,6 +1527,7 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
 
                     Vector path = ParsePath(arena, path_str);
                     traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
+                    VectorFree(&path);
                     if(res.err) {
                         if(res.err != last_not_directory && res.err != ends_with_pnemonic){
                             print("Invalid path for %dth argument\n", i);
@@ -548,8 +1535,12 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                         }
                     }
 
-                    block_index file_to_delete = res.terminating;
-                    SLM_DeleteFile(&Explorer.fs, file_to_delete);
+                    u32 frame = res.entry.is_directory ? CwdFind(&Explorer, res.entry.base_block) : UINT_MAX;
+                    SLM_DeleteFile(&Explorer.fs, res.parent, &res.entry);
+                    if(frame != UINT_MAX) {
+                        Explorer.depth = MAX(frame, 1);
+                        CwdChanged(&Explorer);
+                    }
                 }
             } break;
 
@@ -572,8 +1563,13 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                 }
                 block_index dst = res.terminating;
 
-                block_index new_file = SLM_InsertNewFile(&Explorer.fs, file_name, dst);
-                SLM_WriteToFileAtOffset(&Explorer.fs, new_file, file.content, file.size, 0);
+                if(file.size <= INLINE_DATA_SIZE) {
+                    SLM_InsertInlineFile(&Explorer.fs, file_name, dst, file.content, file.size);
+                }
+                else {
+                    block_index new_file = SLM_InsertNewFile(&Explorer.fs, file_name, dst);
+                    SLM_WriteToFileAtOffset(&Explorer.fs, new_file, file.content, file.size, 0);
+                }
 
                 FreeFileMemory(file);
             } break;
@@ -583,7 +1579,7 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                 OpenArgs *args = input.arg;
                 char *file_path = args->name;
 
-                Vector path = ParsePath(Explorer.arena, file_path);
+                Vector path = ParsePath(arena, file_path);
                 traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
 
                 if(res.err != last_not_directory) {
@@ -591,9 +1587,13 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                     break;
                 }
 
-                size_t file_size = SLM_ReadUsedSize(&Explorer.fs, res.terminating) - INIT_USED_SIZE;
-                char *buf = PushString(Explorer.arena, file_size);
-                SLM_ReadFromFileAtOffset(&Explorer.fs, res.terminating, buf, file_size, 0);
+                size_t file_size = res.entry.size;
+                char *buf = res.entry.data;
+                if(!res.entry.is_inline) {
+                    file_size = SLM_ReadUsedSize(&Explorer.fs, res.terminating) - INIT_USED_SIZE;
+                    buf = PushString(arena, file_size);
+                    SLM_ReadFromFileAtOffset(&Explorer.fs, res.terminating, buf, file_size, 0);
+                }
 
                 loaded_file file = { 0 };
                 file.content = buf;
@@ -608,6 +1608,252 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
                 RunFile(tmp_file_path);
             } break;
 
+            case c_defrag:
+            {
+                DefragArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                if(Explorer.fs.header.defrag_phase == DEFRAG_IDLE)
+                    SLM_DefragBegin(&Explorer.fs, args->compact);
+                else
+                    print("Resuming the interrupted pass\n");
+
+                u32 more = 1;
+                for(u32 steps = 0; more && (!args->steps || steps < args->steps); ++steps) {
+                    more = SLM_DefragStep(&Explorer.fs, DEFRAG_STEP_BLOCKS);
+                    if(!SLM_EndTransaction(&Explorer.fs)) {
+                        print("%s", undone_msg);
+                        more = 0;
+                    }
+                    SLM_BeginTransaction(&Explorer.fs);
+                }
+
+                if(more)
+                    print("Paused, run defrag again to resume\n");
+                ResolveWorkingDirectory(&Explorer);
+            } break;
+
+            case c_snapshot:
+            {
+                SnapshotArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                SLM_SnapshotTable *table = &Explorer.fs.snapshots.table;
+                if(args->action == s_list) {
+                    for(u32 i = 0; i < table->count; ++i) {
+                        SLM_Snapshot *snapshot = table->snapshots + i;
+                        u32 nblocks = snapshot->ncopies + RoundUpDivision(snapshot->ncopies, SNAPSHOT_COPIES_PER_BLOCK);
+                        print("%d\t", snapshot->header.generation);
+                        DisplayChild(snapshot->name, 0, nblocks * BLOCK_SIZE);
+                    }
+                    break;
+                }
+                if(args->action == s_create) {
+                    if(SLM_IsSendSnapshotName(args->name))
+                        print("\"gen-\" and a number name the snapshots taken by send\n");
+                    else if(!SLM_CreateSnapshot(&Explorer.fs, args->name, 0))
+                        print("\"%s\" already exists or there are too many snapshots\n", args->name);
+                    break;
+                }
+
+                u32 index = SLM_FindSnapshot(&Explorer.fs, args->name);
+                if(index == UINT_MAX) {
+                    print("No such snapshot \"%s\"\n", args->name);
+                    break;
+                }
+                if(args->action == s_rollback) {
+                    SLM_RollbackSnapshot(&Explorer.fs, index);
+                    ResolveWorkingDirectory(&Explorer);
+                }
+                else
+                    SLM_DeleteSnapshot(&Explorer.fs, index);
+            } break;
+
+            case c_send:
+            {
+                SendArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                u32 nblocks = 0;
+                u32 res = SLM_SendStream(&Explorer.fs, args->since, args->name, &nblocks);
+                if(res == STREAM_NO_BASE)
+                    print("No snapshot of generation %d\n", args->since);
+                else if(res == STREAM_NO_SNAPSHOT)
+                    print("Could not take the snapshot, there are too many snapshots\n");
+                else
+                    print("Sent generation %d, %d blocks\n", Explorer.fs.header.generation, nblocks);
+            } break;
+
+            case c_receive:
+            {
+                ReceiveArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                u32 res = SLM_ReceiveStream(&Explorer.fs, args->name);
+                if(res == STREAM_BAD)
+                    print("\"%s\" is not a complete stream\n", args->name);
+                else if(res == STREAM_MISMATCH)
+                    print("The stream is for an image of another layout or this image has snapshots\n");
+                else if(res == STREAM_WRONG_BASE)
+                    print("The image is not at the generation the stream was sent from\n");
+                else if(res == STREAM_FULL)
+                    print("%s", undone_msg);
+                else
+                    print("Received generation %d\n", Explorer.fs.header.generation);
+                ResolveWorkingDirectory(&Explorer);
+            } break;
+
+            case c_archive:
+            {
+                ArchiveArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                Vector path = ParsePath(arena, args->src);
+                traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
+                if(res.err && res.err != ends_with_pnemonic && res.err != last_not_directory) {
+                    print("Invalid path\n");
+                    break;
+                }
+
+                // the root has no entry of its own
+                if(res.terminating == Explorer.fs.header.root) {
+                    res.entry = (SLM_DirectoryEntry){ 0 };
+                    res.entry.base_block = res.terminating;
+                    res.entry.is_directory = 1;
+                    SLM_ReadName(&Explorer.fs, res.terminating, res.entry.name, sizeof(res.entry.name));
+                }
+                SLM_ArchiveSubtree(&Explorer.fs, Explorer.scratch, &res.entry, args->dst);
+            } break;
+
+            case c_unarchive:
+            {
+                ArchiveArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                Vector dst_path = ParsePath(arena, args->dst);
+                traverse_result res = TraversePath(&dst_path, &Explorer.fs, Explorer.current_working_directory);
+                if(res.err && res.err != ends_with_pnemonic) {
+                    print("Invalid destination\n");
+                    break;
+                }
+
+                if(!SLM_UnarchiveSubtree(&Explorer.fs, Explorer.scratch, args->src, res.terminating))
+                    print("\"%s\" is not an archive or is cut short\n", args->src);
+            } break;
+
+            case c_du:
+            {
+                Path *arg = input.arg;
+                if(!arg) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                char *label = ".";
+                block_index target = Explorer.current_working_directory->base_block;
+                if(*arg->target) {
+                    label = ExtractFileNameFromPath(arg->target);
+                    Vector path = ParsePath(arena, arg->target);
+                    traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
+                    if(res.err == last_not_directory) {
+                        print("1 files, ");
+                        DisplayChild(res.entry.name, 0, res.entry.size);
+                        break;
+                    }
+                    if(res.err && res.err != ends_with_pnemonic) {
+                        print("Invalid path\n");
+                        break;
+                    }
+                    target = res.terminating;
+                }
+
+                // the totals kept in the directory, nothing under it is read
+                SLM_File metadata = SLM_ReadFileMetaData(&Explorer.fs, target);
+                print("%d files, ", metadata.subtree_files);
+                DisplayChild(label, 0, metadata.subtree_size);
+            } break;
+
+            case c_find:
+            {
+                FindArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                char *label = ".";
+                block_index root = Explorer.current_working_directory->base_block;
+                if(args->root && *args->root) {
+                    // ParsePath cuts the path it is given into its components
+                    u32 length = _strlen(args->root);
+                    label = PushString(arena, length + 1);
+                    m_copy(args->root, label, length + 1);
+
+                    Vector path = ParsePath(arena, args->root);
+                    traverse_result res = TraversePath(&path, &Explorer.fs, Explorer.current_working_directory);
+                    if(res.err && res.err != ends_with_pnemonic) {
+                        print("Invalid path\n");
+                        break;
+                    }
+                    root = res.terminating;
+                }
+                Find(&Explorer, args, root, label);
+            } break;
+
+            case c_index:
+            {
+                IndexArgs *args = input.arg;
+                if(!args) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+
+                if(args->action == i_create) {
+                    u32 res = SLM_CreateNameIndex(&Explorer.fs);
+                    if(res == NAME_INDEX_EXISTS)
+                        print("The image already has an index\n");
+                    else if(res == NAME_INDEX_NO_SPACE)
+                        print("Not enough space for the index\n");
+                }
+                else if(SLM_DropNameIndex(&Explorer.fs) == NAME_INDEX_MISSING)
+                    print("The image has no index\n");
+            } break;
+
+            case c_save:
+            {
+                Path *arg = input.arg;
+                if(!arg) {
+                    print("Invalid arguments provided\n");
+                    break;
+                }
+                if(!Explorer.fs.file.memory) {
+                    print("Only an image kept in memory can be saved\n");
+                    break;
+                }
+
+                char *name = *arg->target ? arg->target : Explorer.image_name;
+                if(!SLM_SaveImage(&Explorer.fs, name))
+                    print("Could not write \"%s\"\n", name);
+            } break;
+
             case c_help:
             {
                 print("%s\n", help_msg);
@@ -617,5 +1863,15 @@ static void ExplorerRun(Arena *arena, int argc, char **argv) {
 
             } break;
         }
+        if(!SLM_EndTransaction(&Explorer.fs)) {
+            print("%s", undone_msg);
+            ResolveWorkingDirectory(&Explorer);
+        }
+        ArenaRestore(arena, scope);
+        FlushConsole();
     }
+    if(!SLM_Sync(&Explorer.fs))
+        print("%s", undone_msg);
+    if(Explorer.flush && !SLM_SaveImage(&Explorer.fs, Explorer.image_name))
+        print("Could not write \"%s\"\n", Explorer.image_name);
 }
\ No newline at end of file
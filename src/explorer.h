@@ -6,6 +6,7 @@
 #include "string.c"
 
 #define DEFAULT_FS_SIZE GigaBytes(1)
+#define DEFAULT_STRIPE_BLOCKS 64
 
 typedef enum Commands {
     c_invalid,
@@ -22,6 +23,16 @@ typedef enum Commands {
     c_import,
     c_open,
     c_delete,
+    c_defrag,
+    c_snapshot,
+    c_send,
+    c_receive,
+    c_archive,
+    c_unarchive,
+    c_du,
+    c_save,
+    c_find,
+    c_index,
     
     c_total
 } Commands;
@@ -37,7 +48,14 @@ typedef struct ChangeDirectoryArgs {
 // #define MAX_DELETE_ARGS 16
 typedef struct MakeDirectoryArgs {
     Vector names;
-} MakeDirectoryArgs, MakeFileArgs, CopyArgs, MoveArgs, DeleteArgs;
+} MakeDirectoryArgs, MakeFileArgs, CopyArgs, MoveArgs;
+
+// with ext set every file with that extension under the directory in names,
+// or under the working directory if there is none, is deleted
+typedef struct DeleteArgs {
+    Vector names;
+    char *ext;
+} DeleteArgs;
 
 typedef struct RenameFileArgs {
     char *old_name;
@@ -47,18 +65,74 @@ typedef struct RenameFileArgs {
 typedef struct ImportArgs {
     char *src;
     char *dst;
-} ImportArgs;
+} ImportArgs, ArchiveArgs;
 
 typedef struct {
     char *name;
-} SearchArgs, OpenArgs;
+} SearchArgs, OpenArgs, ReceiveArgs;
+
+typedef struct ListArgs {
+    u32 unsorted;
+
+    // entries skipped before the first one shown and the most shown, 0
+    // shows all of them
+    u32 page;
+    u32 limit;
+
+    // extension of the files shown, 0 shows every entry
+    char *ext;
+} ListArgs;
+
+typedef struct DefragArgs {
+    u32 compact;
+
+    // number of steps to run before pausing, 0 runs the pass to the end
+    u32 steps;
+} DefragArgs;
+
+typedef enum SnapshotActions {
+    s_create,
+    s_list,
+    s_rollback,
+    s_delete
+} SnapshotActions;
+
+typedef struct SnapshotArgs {
+    SnapshotActions action;
+    char *name;
+} SnapshotArgs;
+
+typedef struct SendArgs {
+    // generation the stream starts from, 0 sends everything
+    u32 since;
+    char *name;
+} SendArgs;
+
+#define FIND_FILES       1
+#define FIND_DIRECTORIES 2
 
-// #define MAX_FIND_FILES 16
 typedef struct FindArgs {
     char *str_to_search;
-    Vector files;
+    char *root;
+
+    // deepest level below root that is searched, UINT_MAX for all of them,
+    // and FIND_FILES or FIND_DIRECTORIES to report only those, 0 for both
+    u32 max_depth;
+    u32 type;
+
+    // extension the files reported must have, 0 for any
+    char *ext;
 } FindArgs;
 
+typedef enum IndexActions {
+    i_create,
+    i_drop
+} IndexActions;
+
+typedef struct IndexArgs {
+    IndexActions action;
+} IndexArgs;
+
 static char *Command_Strings[c_total] = 
 {       "",
         "quit",
@@ -73,7 +147,17 @@ static char *Command_Strings[c_total] =
         "move",
         "import",
         "open",
-        "del"
+        "del",
+        "defrag",
+        "snapshot",
+        "send",
+        "receive",
+        "archive",
+        "unarchive",
+        "du",
+        "save",
+        "find",
+        "index"
 };
 
 
@@ -88,14 +172,39 @@ typedef struct file {
     void *content;
 } file;
 
+// one directory on the way from the root to the working directory
+typedef struct cwd_frame {
+    block_index block;
+    char name[128];
+} cwd_frame;
+
 typedef struct explorer_state {
     file *current_working_directory;
     u32 isAdmin;
-    char path[256];
+
+    // the working directory as the stack of directories leading to it, root
+    // first. cd pushes and pops frames and path is rebuilt from their names
+    cwd_frame *frames;
+    u32 depth;
+    u32 frames_total;
+    char *path;
+    u32 path_total;
     Vector prev_commands;
 
+    // arena is kept for the whole run, scratch is reset after every command
     Arena *arena;
+    Arena *scratch;
     FileSystem fs;
+
+    // host file an image kept in memory was loaded from and is saved to,
+    // written back on quit when flush is set
+    char *image_name;
+    u32 flush;
+
+    // threads find walks the tree with, started the first time it runs
+    work_pool *find_pool;
+    struct find_walker *walkers;
+    u32 nwalkers;
 } explorer_state;
 
 #define EXPLORER
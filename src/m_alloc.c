@@ -4,46 +4,181 @@
 #include "common.h"
 #include "platform.c"
 
-#define ARENA_ALLOCATION_SIZE 512
+#define ARENA_CHUNK_SIZE MegaBytes(1)
+#define ARENA_HUGE_CHUNK_SIZE MegaBytes(2)
+#define ARENA_ALIGNMENT 16
+
+#define ARENA_HUGE_PAGES 1
+
+// released blocks are kept on a list per size class, class c holds blocks
+// of at least ARENA_MIN_BLOCK << c bytes
+#define ARENA_MIN_BLOCK 16
+#define ARENA_SIZE_CLASSES 40
+
+// memory is taken from the system a chunk at a time as the arena grows.
+// chunks after current were filled once and are handed out again after a
+// restore, chunks larger than chunk_size hold a single big push and are
+// given back instead
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+} arena_chunk;
+
+// pushes start aligned, the chunk header is padded to keep them so
+#define ARENA_CHUNK_HEADER ((sizeof(arena_chunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+typedef struct arena_free_block {
+    struct arena_free_block *next;
+} arena_free_block;
 
 typedef struct memory_arena {
-    u32 is_temp;
-    size_t total_size;
-    size_t used_size;
-    char *mem;
+    u32 flags;
+    size_t chunk_size;
+    arena_chunk *first;
+    arena_chunk *current;
+    arena_free_block *free_blocks[ARENA_SIZE_CLASSES];
 } Arena;
 
-int InitMemArena(Arena *arena, size_t size) {
-    arena->total_size = size;
-    arena->used_size = 0;
-    arena->mem = MemAlloc(size);
-    arena->is_temp = 0;
-    if(!arena->mem)
-        return 0;
+// where an arena was, everything pushed after it is dropped by a restore
+typedef struct arena_marker {
+    arena_chunk *chunk;
+    size_t used;
+} ArenaMarker;
+
+int InitMemArena(Arena *arena, size_t chunk_size, u32 flags) {
+    arena->flags = flags;
+    arena->chunk_size = chunk_size;
+    arena->first = 0;
+    arena->current = 0;
+    for(u32 i = 0; i < ARENA_SIZE_CLASSES; ++i)
+        arena->free_blocks[i] = 0;
     return 1;
 }
 
-int InitTempArena(Arena *arena, size_t size) {
-    int res = InitMemArena(arena, size);
-    if(res) arena->is_temp = 1;
-    return res;
+static arena_chunk* ArenaNewChunk(Arena *arena, size_t size) {
+    size_t total = MAX(arena->chunk_size, size + ARENA_CHUNK_HEADER);
+    arena_chunk *chunk = MemAlloc(total);
+    if(!chunk)
+        return 0;
+    if((arena->flags & ARENA_HUGE_PAGES) && total >= ARENA_HUGE_CHUNK_SIZE)
+        MemAdviseHugePages(chunk, total);
+
+    chunk->next = 0;
+    chunk->size = total - ARENA_CHUNK_HEADER;
+    chunk->used = 0;
+    return chunk;
 }
 
+#define ArenaAlign(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
 void* PushSize(Arena *arena, size_t size) {
-    if(arena->used_size + size >= arena->total_size){
-        if(!arena->is_temp)
-            return 0;
-        if(size > arena->total_size)
-            return 0;
-        else
-            arena->used_size = 0;
+    size = ArenaAlign(size);
+
+    arena_chunk *chunk = arena->current;
+    if(!chunk || chunk->used + size > chunk->size) {
+        arena_chunk *next = chunk ? chunk->next : arena->first;
+        if(next && next->size >= size)
+            next->used = 0;
+        else {
+            arena_chunk *fresh = ArenaNewChunk(arena, size);
+            if(!fresh)
+                return 0;
+            fresh->next = next;
+            if(chunk)
+                chunk->next = fresh;
+            else
+                arena->first = fresh;
+            next = fresh;
+        }
+        chunk = arena->current = next;
     }
 
-    void *res= arena->mem + arena->used_size;
-    arena->used_size += size;
+    void *res = (char*)chunk + ARENA_CHUNK_HEADER + chunk->used;
+    chunk->used += size;
     return res;
 }
 
+ArenaMarker ArenaSave(Arena *arena) {
+    ArenaMarker marker = { arena->current, arena->current ? arena->current->used : 0 };
+    return marker;
+}
+
+// only the chunks filled since the marker are looked at, nothing they hold
+// is touched. released blocks may lie past the marker, the lists start over
+void ArenaRestore(Arena *arena, ArenaMarker marker) {
+    for(u32 i = 0; i < ARENA_SIZE_CLASSES; ++i)
+        arena->free_blocks[i] = 0;
+
+    arena_chunk **link = marker.chunk ? &marker.chunk->next : &arena->first;
+    arena_chunk *after = arena->current ? arena->current->next : 0;
+    while(*link != after) {
+        arena_chunk *chunk = *link;
+        if(chunk->size + ARENA_CHUNK_HEADER > arena->chunk_size) {
+            *link = chunk->next;
+            MemFree(chunk, chunk->size + ARENA_CHUNK_HEADER);
+        }
+        else
+            link = &chunk->next;
+    }
+
+    arena->current = marker.chunk;
+    if(marker.chunk)
+        marker.chunk->used = marker.used;
+}
+
+static inline char* ArenaTop(Arena *arena) {
+    arena_chunk *chunk = arena->current;
+    return chunk ? (char*)chunk + ARENA_CHUNK_HEADER + chunk->used : 0;
+}
+
+// grows the last block pushed without moving it, 0 if it is not the last
+// one or the chunk has no room left
+u32 ArenaExtend(Arena *arena, void *mem, size_t size, size_t new_size) {
+    arena_chunk *chunk = arena->current;
+    if(!mem || (char*)mem + ArenaAlign(size) != ArenaTop(arena))
+        return 0;
+
+    size_t grow = ArenaAlign(new_size) - ArenaAlign(size);
+    if(chunk->used + grow > chunk->size)
+        return 0;
+    chunk->used += grow;
+    return 1;
+}
+
+// a block of at least size bytes, a released one of the right class if
+// there is any
+void* PushBlock(Arena *arena, size_t size) {
+    u32 c = 0;
+    while(c + 1 < ARENA_SIZE_CLASSES && ((size_t)ARENA_MIN_BLOCK << c) < size)
+        c++;
+
+    arena_free_block *block = arena->free_blocks[c];
+    if(block) {
+        arena->free_blocks[c] = block->next;
+        return block;
+    }
+    return PushSize(arena, size);
+}
+
+// the last block pushed is popped off the arena, any other one is kept for
+// PushBlock under the largest class it can serve
+void ReleaseBlock(Arena *arena, void *mem, size_t size) {
+    if(!mem || size < ARENA_MIN_BLOCK)
+        return;
+    if((char*)mem + ArenaAlign(size) == ArenaTop(arena)) {
+        arena->current->used -= ArenaAlign(size);
+        return;
+    }
+
+    u32 c = 0;
+    while(c + 1 < ARENA_SIZE_CLASSES && ((size_t)ARENA_MIN_BLOCK << (c + 1)) <= size)
+        c++;
+    arena_free_block *block = mem;
+    block->next = arena->free_blocks[c];
+    arena->free_blocks[c] = block;
+}
+
 #define PushStruct(arena, type) PushSize(arena, sizeof(type))
 #define PushArray(arena, type, count) PushSize(arena, count * sizeof(type))
 #define PushString(arena, length) PushArray(arena, char, length)
@@ -64,38 +199,47 @@ Vector VectorBegin(Arena *arena, u32 init_count, size_t unit_size) {
     vec.unit_size = unit_size;
     vec.total = init_count;
     vec.count = 0;
-    vec.mem = PushSize(arena, unit_size * init_count);
+    vec.mem = PushBlock(arena, unit_size * init_count);
 
     return vec;
 }
 
-static void m_copy(void *src, void *dst, size_t size) {
-    if(!(size & 0x03)) {            //multiple of 4
-        u32 *_src = src, *_dst = dst;
-        u32 _size = size >> 2;
-        for(int i = 0; i < _size; ++i) {
-            _dst[i] = _src[i];
-        }
-    }
-    else {
-        char *_src = src, *_dst = dst;
-        for(int i = 0; i < size; ++i) {
-            _dst[i] = _src[i];
-        }
-    }
+static inline void m_copy(void *src, void *dst, size_t size) {
+    MemCopy(dst, src, size);
 }
 
-void VectorPush(Vector *vec, void *val) {
-    if(vec->count >= vec->total) {
-        void *new = PushSize(vec->arena, 2 * vec->total * vec->unit_size);
-        m_copy(vec->mem, new, vec->total * vec->unit_size);
-        vec->total *= 2;
+static void VectorReserve(Vector *vec, u32 count) {
+    if(count <= vec->total)
+        return;
+
+    u32 total = vec->total ? 2 * vec->total : 2;
+    while(total < count)
+        total *= 2;
+    size_t size = vec->total * vec->unit_size;
+    if(!ArenaExtend(vec->arena, vec->mem, size, total * vec->unit_size)) {
+        void *new = PushBlock(vec->arena, total * vec->unit_size);
+        m_copy(vec->mem, new, size);
+        ReleaseBlock(vec->arena, vec->mem, size);
+        vec->mem = new;
     }
+    vec->total = total;
+}
 
+void VectorPush(Vector *vec, void *val) {
+    VectorReserve(vec, vec->count + 1);
     m_copy(val, (char*)vec->mem + vec->unit_size * vec->count++, vec->unit_size);
 }
 
+// pushes count units at once
+void VectorAppend(Vector *vec, void *vals, u32 count) {
+    VectorReserve(vec, vec->count + count);
+    m_copy(vals, (char*)vec->mem + vec->unit_size * vec->count, count * vec->unit_size);
+    vec->count += count;
+}
+
 void VectorFree(Vector *vec) {
+    ReleaseBlock(vec->arena, vec->mem, vec->total * vec->unit_size);
+    vec->mem = 0;
     vec->total = 0;
     vec->count = 0;
 }
@@ -6,9 +6,13 @@
 
 
 int main(int argc, char **argv) {
-    Arena a;
-    InitTempArena(&a, MegaBytes(512));
-    ExplorerRun(&a, argc, argv);
+    InitMemoryKernels();
+
+    Arena persistent, scratch;
+    InitMemArena(&persistent, ARENA_CHUNK_SIZE, 0);
+    InitMemArena(&scratch, ARENA_CHUNK_SIZE, ARENA_HUGE_PAGES);
+    ExplorerRun(&persistent, &scratch, argc, argv);
+    FlushConsole();
 
     return 0;
 }
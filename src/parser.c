@@ -154,15 +154,34 @@ void* ExtractOpenArgs(Arena *arena, char **str) {
     return args;
 }
 
+// an extension is given with or without its dot
+char* GetExtension(char **str) {
+    char *ext = GetString(str);
+    if(*ext == '.')
+        ext++;
+    u32 length = _strlen(ext);
+    if(!length || length > EXTENSION_SIZE)
+        return 0;
+    return ext;
+}
+
 void* ExtractDeleteArgs(Arena *arena, char **str) {
     DeleteArgs *args = PushStruct(arena, DeleteArgs);
     args->names = VectorBegin(arena, 2, sizeof(char*));
+    args->ext = 0;
 
     while(**str != 0) {
         char *name = GetString(str);
-        VectorPush(&args->names, &name);
+        if(_strcmp(name, "--ext")) {
+            if(args->ext || !(args->ext = GetExtension(str)))
+                return 0;
+        }
+        else
+            VectorPush(&args->names, &name);
     }
-    if(!args->names.count) {
+    if(args->ext && args->names.count > 1)
+        return 0;
+    if(!args->names.count && !args->ext) {
         VectorFree(&args->names);
         args = 0;
     }
@@ -170,13 +189,190 @@ void* ExtractDeleteArgs(Arena *arena, char **str) {
     return args;
 }
 
+void* ExtractListArgs(Arena *arena, char **str) {
+    ListArgs *args = PushStruct(arena, ListArgs);
+    args->unsorted = 0;
+    args->page = 0;
+    args->limit = 0;
+    args->ext = 0;
+
+    while(**str != 0) {
+        char *arg = GetString(str);
+        if(_strcmp(arg, "--unsorted"))
+            args->unsorted = 1;
+        else if(_strcmp(arg, "--ext")) {
+            if(!(args->ext = GetExtension(str)))
+                return 0;
+        }
+        else if(_strcmp(arg, "--limit")) {
+            if(!_strtou(GetString(str), &args->limit) || !args->limit)
+                return 0;
+        }
+        else if(_strcmp(arg, "--page")) {
+            if(!_strtou(GetString(str), &args->page) || !args->page)
+                return 0;
+        }
+        else
+            return 0;
+    }
+
+    return args;
+}
+
+void* ExtractFindArgs(Arena *arena, char **str) {
+    FindArgs *args = PushStruct(arena, FindArgs);
+    args->str_to_search = 0;
+    args->root = 0;
+    args->max_depth = UINT_MAX;
+    args->type = 0;
+    args->ext = 0;
+
+    while(**str != 0) {
+        char *arg = GetString(str);
+        if(_strcmp(arg, "--depth")) {
+            if(!_strtou(GetString(str), &args->max_depth) || !args->max_depth)
+                return 0;
+        }
+        else if(_strcmp(arg, "--type")) {
+            char *type = GetString(str);
+            if(_strcmp(type, "f"))
+                args->type = FIND_FILES;
+            else if(_strcmp(type, "d"))
+                args->type = FIND_DIRECTORIES;
+            else
+                return 0;
+        }
+        else if(_strcmp(arg, "--ext")) {
+            if(!(args->ext = GetExtension(str)))
+                return 0;
+        }
+        else if(!args->str_to_search)
+            args->str_to_search = arg;
+        else if(!args->root)
+            args->root = arg;
+        else
+            return 0;
+    }
+
+    // only the extension may be given, every file with it is shown
+    if(!args->str_to_search && args->ext)
+        args->str_to_search = "";
+    if(!args->str_to_search || (!*args->str_to_search && !args->ext))
+        return 0;
+    return args;
+}
+
+void* ExtractDefragArgs(Arena *arena, char **str) {
+    DefragArgs *args = PushStruct(arena, DefragArgs);
+    args->compact = 0;
+    args->steps = 0;
+
+    while(**str != 0) {
+        char *arg = GetString(str);
+        if(_strcmp(arg, "--compact"))
+            args->compact = 1;
+        else if(_strcmp(arg, "--steps")) {
+            if(!_strtou(GetString(str), &args->steps) || !args->steps)
+                return 0;
+        }
+        else
+            return 0;
+    }
+
+    return args;
+}
+
+void* ExtractSnapshotArgs(Arena *arena, char **str) {
+    SnapshotArgs *args = PushStruct(arena, SnapshotArgs);
+    args->name = 0;
+
+    char *action = GetString(str);
+    if(_strcmp(action, "create"))
+        args->action = s_create;
+    else if(_strcmp(action, "list"))
+        args->action = s_list;
+    else if(_strcmp(action, "rollback"))
+        args->action = s_rollback;
+    else if(_strcmp(action, "delete"))
+        args->action = s_delete;
+    else
+        return 0;
+
+    if(args->action != s_list) {
+        args->name = GetString(str);
+        if(!*args->name || _strlen(args->name) >= SNAPSHOT_NAME_SIZE)
+            return 0;
+    }
+    if(**str != 0)
+        return 0;
+
+    return args;
+}
+
+void* ExtractSendArgs(Arena *arena, char **str) {
+    SendArgs *args = PushStruct(arena, SendArgs);
+    args->since = 0;
+    args->name = 0;
+
+    while(**str != 0) {
+        char *arg = GetString(str);
+        if(_strcmp(arg, "--since")) {
+            if(!_strtou(GetString(str), &args->since) || !args->since)
+                return 0;
+        }
+        else if(!args->name)
+            args->name = arg;
+        else
+            return 0;
+    }
+    if(!args->name)
+        return 0;
+
+    return args;
+}
+
+void* ExtractReceiveArgs(Arena *arena, char **str) {
+    ReceiveArgs *args = PushStruct(arena, ReceiveArgs);
+
+    args->name = GetString(str);
+    if(!*args->name || **str != 0)
+        return 0;
+    return args;
+}
+
+void* ExtractIndexArgs(Arena *arena, char **str) {
+    IndexArgs *args = PushStruct(arena, IndexArgs);
+
+    char *action = GetString(str);
+    if(_strcmp(action, "create"))
+        args->action = i_create;
+    else if(_strcmp(action, "drop"))
+        args->action = i_drop;
+    else
+        return 0;
+
+    if(**str != 0)
+        return 0;
+    return args;
+}
+
+void* ExtractArchiveArgs(Arena *arena, char **str) {
+    ArchiveArgs *args = PushStruct(arena, ArchiveArgs);
+
+    args->src = GetString(str);
+    args->dst = GetString(str);
+    if(!*args->src || !*args->dst || **str != 0)
+        return 0;
+    return args;
+}
+
 void* (*argument_extractor[c_total]) (Arena *arena, char **str) = 
 {
     DoNothing,
     DoNothing,
     DoNothing,
     DoNothing,
-    DoNothing,
+    ExtractListArgs,
     ExtractChangeDirectoryArgs,
     DoNothing,
     ExtractMakeDirectoryArgs,
@@ -186,6 +382,16 @@ void* (*argument_extractor[c_total]) (Arena *arena, char **str) =
     ExtractImportArgs,
     ExtractOpenArgs,
     ExtractDeleteArgs,
+    ExtractDefragArgs,
+    ExtractSnapshotArgs,
+    ExtractSendArgs,
+    ExtractReceiveArgs,
+    ExtractArchiveArgs,
+    ExtractArchiveArgs,
+    ExtractChangeDirectoryArgs,
+    ExtractChangeDirectoryArgs,
+    ExtractFindArgs,
+    ExtractIndexArgs,
 };
 
 
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include <stddef.h>
+#include <immintrin.h>
 
 #define FILE_READONLY  0b00000001
 #define FILE_WRITEONLY 0b00000010
@@ -16,6 +17,7 @@
 #if defined _WIN32
 
 #include <Windows.h>
+#include <intrin.h>
 
 typedef HANDLE file_handle;
 
@@ -39,60 +41,140 @@ typedef uint32_t DWORD;
 typedef void* HANDLE;
 typedef i32 file_handle;
 
+// the arguments go in the registers the kernel takes them in and the result
+// comes back in rax
+static inline long _syscall(long number, long a, long b, long c, long d, long e, long f)
+{
+    long res;
+    register long r10 asm("r10") = d;
+    register long r8 asm("r8") = e;
+    register long r9 asm("r9") = f;
+    asm volatile("syscall"
+                 : "=a"(res)
+                 : "a"(number), "D"(a), "S"(b), "d"(c), "r"(r10), "r"(r8), "r"(r9)
+                 : "rcx", "r11", "memory");
+    return res;
+}
+
 int _write(u32 fd, const char *buf, size_t count)
 {
-    asm("mov $1, %rax;"
-        "syscall");
+    return _syscall(1, fd, (long)buf, count, 0, 0, 0);
 }
 
 int _read(u32 fd, char *buf, size_t count)
 {
-    asm("mov $0, %rax;"
-        "syscall");
+    return _syscall(0, fd, (long)buf, count, 0, 0, 0);
 }
 
+// exit_group, the worker threads go down with the process
 void end(int code)
 {
-    asm("mov $60, %rax;"
-        "syscall");
+    _syscall(231, code, 0, 0, 0, 0, 0);
 }
 
 
 typedef u16 umode_t;
 int _open(const char *filename, int flags, umode_t mode)
 {
-    asm("mov $0x02, %rax;"
-        "syscall");    
+    return _syscall(0x02, (long)filename, flags, mode, 0, 0, 0);
 }
 
 int _close(u32 fd) {
-    asm("mov $0x03, %rax;"
-        "syscall");    
+    return _syscall(0x03, fd, 0, 0, 0, 0, 0);
 }
 
 int _lseek(int fd, int offset, int whence)
 {
-    asm("mov $0x08, %rax;"
-        "syscall");
+    return _syscall(0x08, fd, offset, whence, 0, 0, 0);
 }
 
 int _stat(u32 fd, struct stat *statbuf)
 {
-    asm("mov $0x05, %rax;"
-        "syscall");
+    return _syscall(0x05, fd, (long)statbuf, 0, 0, 0, 0);
 }
 
 void *_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-    asm("mov $0x9, %rax;"
-        "mov %rcx, %r10;"
-        "syscall");
+    return (void*)_syscall(0x9, (long)addr, length, prot, flags, fd, offset);
 }
 
 int _munmap(void *addr, size_t length)
 {
-    asm("mov $0x0b, %rax;"
-        "syscall");
+    return _syscall(0x0b, (long)addr, length, 0, 0, 0, 0);
+}
+
+int _madvise(void *addr, size_t length, int advice)
+{
+    return _syscall(0x1c, (long)addr, length, advice, 0, 0, 0);
+}
+
+int _ftruncate(u32 fd, size_t length)
+{
+    return _syscall(0x4d, fd, length, 0, 0, 0, 0);
+}
+
+int _fdatasync(u32 fd)
+{
+    return _syscall(0x4b, fd, 0, 0, 0, 0, 0);
+}
+
+int _pread(u32 fd, char *buf, size_t count, size_t offset)
+{
+    return _syscall(0x11, fd, (long)buf, count, offset, 0, 0);
+}
+
+int _pwrite(u32 fd, const char *buf, size_t count, size_t offset)
+{
+    return _syscall(0x12, fd, (long)buf, count, offset, 0, 0);
+}
+
+int _pwritev(u32 fd, const void *buffers, int count, size_t offset, size_t offset_high)
+{
+    return _syscall(0x128, fd, (long)buffers, count, offset, offset_high, 0);
+}
+
+int _preadv(u32 fd, const void *buffers, int count, size_t offset, size_t offset_high)
+{
+    return _syscall(0x127, fd, (long)buffers, count, offset, offset_high, 0);
+}
+
+#define FUTEX_WAIT_PRIVATE 128
+#define FUTEX_WAKE_PRIVATE 129
+
+int _futex(volatile u32 *addr, int op, u32 value, void *timeout)
+{
+    return _syscall(0xca, (long)addr, op, value, (long)timeout, 0, 0);
+}
+
+int _sched_getaffinity(int pid, size_t size, void *mask)
+{
+    return _syscall(0xcc, pid, size, (long)mask, 0, 0, 0);
+}
+
+// CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD|CLONE_SYSVSEM
+#define CLONE_THREAD_FLAGS 0x50f00
+
+// the new thread starts on stack, which has to be 16 byte aligned, calls
+// proc(data) and exits when it returns
+int _clone_thread(void (*proc)(void*), void *data, void *stack)
+{
+    long res;
+    register void (*thread_proc)(void*) asm("r12") = proc;
+    register void *thread_data asm("r13") = data;
+    asm volatile("syscall;"
+                 "test %%rax, %%rax;"
+                 "jnz 1f;"
+                 "xor %%ebp, %%ebp;"
+                 "mov %%r13, %%rdi;"
+                 "call *%%r12;"
+                 "mov $60, %%eax;"
+                 "xor %%edi, %%edi;"
+                 "syscall;"
+                 "1:"
+                 : "=a"(res)
+                 : "a"(56), "D"(CLONE_THREAD_FLAGS), "S"(stack), "d"(0), "r"(thread_proc), "r"(thread_data)
+                 : "rcx", "r10", "r11", "memory");
+    return res;
 }
 #endif
 
@@ -138,6 +220,12 @@ typedef struct active_file {
     file_offset end;
 } active_file;
 
+// laid out like struct iovec so that it can be passed to pwritev as is
+typedef struct write_buffer {
+    void *base;
+    size_t size;
+} write_buffer;
+
 #if defined(_WIN32) 
 
 
@@ -227,7 +315,9 @@ static int WriteEntireFile(loaded_file file, char *file_name) {
     if(fd < 0)
         return 0;
     
-    _write(fd, file.content, file.size);
+    int res = _write(fd, file.content, file.size);
+    _close(fd);
+    return res == (int)file.size;
 } 
 
 #endif
@@ -312,22 +402,61 @@ int WriteToFile(active_file *file, void *buf, size_t size) {
         return 0;
 #endif
     file->write_offset += bytes_written;
-    file->end += bytes_written;
+    if(file->write_offset > file->end)
+        file->end = file->write_offset;
     return bytes_written;
 }
 
+// writing past the end grows the file, the gap reads back as zeros
 int WriteToFileAtOffset(active_file *file, void *buf, size_t size, file_offset off) {
-    if(off > file->end) 
-        return 0;
-    
+#if defined(_WIN32)
     file_offset prev_offset = file->write_offset;
     file->write_offset = off;
     int res = WriteToFile(file, buf, size);
     file->write_offset = prev_offset;
+#elif defined(__linux__)
+    if(!(file->permissions & (FILE_READWRITE | FILE_WRITEONLY)))
+        return 0;
 
+    int res = _pwrite(file->handle, buf, size, off);
+    if(res < 0)
+        return 0;
+    if(off + res > file->end)
+        file->end = off + res;
+#endif
     return res;
 }
 
+// writes the buffers back to back starting at off, in a single call where
+// the platform has one
+int WriteGatherAtOffset(active_file *file, write_buffer *buffers, u32 count, file_offset off) {
+    size_t written = 0;
+#if defined(__linux__)
+    if(file->permissions & (FILE_READWRITE | FILE_WRITEONLY)) {
+        int res = _pwritev(file->handle, buffers, count, off, 0);
+        if(res > 0)
+            written = res;
+    }
+#endif
+
+    // whatever the single call did not write goes one buffer at a time
+    size_t total = 0;
+    for(u32 i = 0; i < count; ++i) {
+        size_t size = buffers[i].size;
+        if(written >= size)
+            written -= size;
+        else {
+            WriteToFileAtOffset(file, (char*)buffers[i].base + written, size - written, off + total + written);
+            written = 0;
+        }
+        total += size;
+    }
+
+    if(off + total > file->end)
+        file->end = off + total;
+    return total;
+}
+
 int ReadFromFile(active_file *file, void *buf, size_t size) {
     if(!(file->permissions & (FILE_READWRITE | FILE_READONLY)))
         return 0;
@@ -353,15 +482,119 @@ int ReadFromFileAtOffset(active_file *file, void *buf, size_t size, file_offset
     if(off > file->end)
         return 0;
     
+#if defined(_WIN32)
     file_offset prev_offset = file->read_offset;
     file->read_offset = off;
     int res = ReadFromFile(file, buf, size);
     file->read_offset = prev_offset;
+#elif defined(__linux__)
+    if(!(file->permissions & (FILE_READWRITE | FILE_READONLY)))
+        return 0;
+
+    int res = _pread(file->handle, buf, size, off);
+    if(res < 0)
+        return 0;
+#endif
+    return res;
+}
+
+// reads back to back starting at off into the buffers
+int ReadScatterAtOffset(active_file *file, write_buffer *buffers, u32 count, file_offset off) {
+    if(off > file->end)
+        return 0;
+
+    size_t read = 0;
+#if defined(__linux__)
+    if(file->permissions & (FILE_READWRITE | FILE_READONLY)) {
+        int res = _preadv(file->handle, buffers, count, off, 0);
+        if(res > 0)
+            read = res;
+    }
+#endif
+
+    // whatever the single call did not read goes one buffer at a time, a
+    // short read is the end of the file
+    size_t total = 0;
+    for(u32 i = 0; i < count; ++i) {
+        size_t size = buffers[i].size;
+        if(read >= size) {
+            read -= size;
+            total += size;
+            continue;
+        }
 
+        int res = ReadFromFileAtOffset(file, (char*)buffers[i].base + read, size - read, off + total + read);
+        total += read + res;
+        if(read + res < size)
+            break;
+        read = 0;
+    }
+    return total;
+}
+
+
+// leaves the position of file alone, so any number of threads can read it
+// at once
+int ReadSharedFileAtOffset(active_file *file, void *buf, size_t size, file_offset off) {
+    if(off > file->end || !(file->permissions & (FILE_READWRITE | FILE_READONLY)))
+        return 0;
+
+#if defined(_WIN32)
+    OVERLAPPED position = { 0 };
+    position.Offset = (DWORD)off;
+    position.OffsetHigh = (DWORD)(off >> 32);
+
+    DWORD res = 0;
+    if(!ReadFile(file->handle, buf, size, &res, &position))
+        return 0;
+#elif defined(__linux__)
+    int res = _pread(file->handle, buf, size, off);
+    if(res < 0)
+        return 0;
+#endif
+    return res;
+}
+
+// the write counterpart of ReadSharedFileAtOffset, only for writes within
+// the file since its end is left alone too
+int WriteSharedFileAtOffset(active_file *file, void *buf, size_t size, file_offset off) {
+    if(!(file->permissions & (FILE_READWRITE | FILE_WRITEONLY)))
+        return 0;
+
+#if defined(_WIN32)
+    OVERLAPPED position = { 0 };
+    position.Offset = (DWORD)off;
+    position.OffsetHigh = (DWORD)(off >> 32);
+
+    DWORD res = 0;
+    if(!WriteFile(file->handle, buf, size, &res, &position))
+        return 0;
+#elif defined(__linux__)
+    int res = _pwrite(file->handle, buf, size, off);
+    if(res < 0)
+        return 0;
+#endif
     return res;
 }
 
+void TruncateFile(active_file *file, file_offset size) {
+#if defined(_WIN32)
+    SetFilePointer(file->handle, size, 0, FOFFSET_BEGIN);
+    SetEndOfFile(file->handle);
+#elif defined(__linux__)
+    _ftruncate(file->handle, size);
+#endif
+    file->end = size;
+}
 
+// returns once everything written to the file so far is on disk
+void SyncFile(active_file *file) {
+#if defined(_WIN32)
+    FlushFileBuffers(file->handle);
+#elif defined(__linux__)
+    _fdatasync(file->handle);
+#endif
+}
 
 void CloseFile(active_file *file) {
 #if defined(_WIN32)
@@ -408,6 +641,1082 @@ void *MemAlloc(size_t size) {
 #endif
 }
 
+void MemFree(void *mem, size_t size) {
+#if defined(_WIN32)
+    VirtualFree(mem, 0, MEM_RELEASE);
+#elif defined(__linux__)
+    _munmap(mem, size);
+#endif
+}
+
+// asks for memory to be backed by huge pages where the system allows it,
+// large pages need a privilege on Windows so it is left alone there
+void MemAdviseHugePages(void *mem, size_t size) {
+#if defined(__linux__)
+    _madvise(mem, size, MADV_HUGEPAGE);
+#endif
+}
+
+// copy, set and compare come in a scalar, an SSE2, an AVX2 and an AVX-512
+// version, the widest one the processor and the OS support is picked by
+// InitMemoryKernels. a wide kernel hands sizes below its width to the next
+// narrower one, the last partial vector is done by overlapping the one
+// before it. copies go front to back, so dst may overlap src from below
+#if defined(_WIN32)
+#define KERNEL_TARGET(isa)
+#elif defined(__linux__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static void Cpuid(u32 leaf, u32 subleaf, u32 regs[4]) {
+#if defined(_WIN32)
+    __cpuidex((int*)regs, leaf, subleaf);
+#elif defined(__linux__)
+    asm volatile("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(leaf), "c"(subleaf));
+#endif
+}
+
+// register state the OS saves on a context switch
+static u64 EnabledStateMask() {
+#if defined(_WIN32)
+    return _xgetbv(0);
+#elif defined(__linux__)
+    u32 low, high;
+    asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((u64)high << 32) | low;
+#endif
+}
+
+// cycles since reset, only good for telling runs apart
+static u64 ReadTimestamp() {
+#if defined(_WIN32)
+    return __rdtsc();
+#elif defined(__linux__)
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+#endif
+}
+
+static inline u32 LowestSetBit(u64 mask) {
+#if defined(_WIN32)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#elif defined(__linux__)
+    return __builtin_ctzll(mask);
+#endif
+}
+
+static void MemCopyScalar(void *dst, const void *src, size_t size) {
+    u8 *d = dst;
+    const u8 *s = src;
+    size_t i = 0;
+    for(; i + sizeof(u64) <= size; i += sizeof(u64))
+        *(u64*)(d + i) = *(const u64*)(s + i);
+    for(; i < size; ++i)
+        d[i] = s[i];
+}
+
+static void MemSetScalar(void *dst, u8 value, size_t size) {
+    u8 *d = dst;
+    u64 word = value * 0x0101010101010101ull;
+    size_t i = 0;
+    for(; i + sizeof(u64) <= size; i += sizeof(u64))
+        *(u64*)(d + i) = word;
+    for(; i < size; ++i)
+        d[i] = value;
+}
+
+static int MemCompareScalar(const void *a, const void *b, size_t size) {
+    const u8 *x = a, *y = b;
+    for(size_t i = 0; i < size; ++i) {
+        if(x[i] != y[i])
+            return x[i] - y[i];
+    }
+    return 0;
+}
+
+static void MemCopySSE2(void *dst, const void *src, size_t size) {
+    if(size < 16) {
+        MemCopyScalar(dst, src, size);
+        return;
+    }
+
+    u8 *d = dst;
+    const u8 *s = src;
+    __m128i last = _mm_loadu_si128((const __m128i*)(s + size - 16));
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(s + i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(s + i + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i*)(s + i + 48));
+        _mm_storeu_si128((__m128i*)(d + i), v0);
+        _mm_storeu_si128((__m128i*)(d + i + 16), v1);
+        _mm_storeu_si128((__m128i*)(d + i + 32), v2);
+        _mm_storeu_si128((__m128i*)(d + i + 48), v3);
+    }
+    for(; i + 16 <= size; i += 16)
+        _mm_storeu_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(s + i)));
+    _mm_storeu_si128((__m128i*)(d + size - 16), last);
+}
+
+static void MemSetSSE2(void *dst, u8 value, size_t size) {
+    if(size < 16) {
+        MemSetScalar(dst, value, size);
+        return;
+    }
+
+    u8 *d = dst;
+    __m128i v = _mm_set1_epi8(value);
+    size_t i = 0;
+    for(; i + 64 <= size; i += 64) {
+        _mm_storeu_si128((__m128i*)(d + i), v);
+        _mm_storeu_si128((__m128i*)(d + i + 16), v);
+        _mm_storeu_si128((__m128i*)(d + i + 32), v);
+        _mm_storeu_si128((__m128i*)(d + i + 48), v);
+    }
+    for(; i + 16 <= size; i += 16)
+        _mm_storeu_si128((__m128i*)(d + i), v);
+    _mm_storeu_si128((__m128i*)(d + size - 16), v);
+}
+
+static int MemCompareSSE2(const void *a, const void *b, size_t size) {
+    if(size < 16)
+        return MemCompareScalar(a, b, size);
+
+    const u8 *x = a, *y = b;
+    for(size_t i = 0;; i += 16) {
+        // the last vector overlaps the one before it, which compared equal
+        if(i + 16 > size)
+            i = size - 16;
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(x + i)), _mm_loadu_si128((const __m128i*)(y + i)));
+        u32 diff = ~_mm_movemask_epi8(eq) & 0xffff;
+        if(diff) {
+            u32 at = i + LowestSetBit(diff);
+            return x[at] - y[at];
+        }
+        if(i + 16 == size)
+            return 0;
+    }
+}
+
+KERNEL_TARGET("avx2")
+static void MemCopyAVX2(void *dst, const void *src, size_t size) {
+    if(size < 32) {
+        MemCopySSE2(dst, src, size);
+        return;
+    }
+
+    u8 *d = dst;
+    const u8 *s = src;
+    __m256i last = _mm256_loadu_si256((const __m256i*)(s + size - 32));
+    size_t i = 0;
+    for(; i + 128 <= size; i += 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(s + i + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(s + i + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i*)(s + i + 96));
+        _mm256_storeu_si256((__m256i*)(d + i), v0);
+        _mm256_storeu_si256((__m256i*)(d + i + 32), v1);
+        _mm256_storeu_si256((__m256i*)(d + i + 64), v2);
+        _mm256_storeu_si256((__m256i*)(d + i + 96), v3);
+    }
+    for(; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i*)(d + i), _mm256_loadu_si256((const __m256i*)(s + i)));
+    _mm256_storeu_si256((__m256i*)(d + size - 32), last);
+}
+
+KERNEL_TARGET("avx2")
+static void MemSetAVX2(void *dst, u8 value, size_t size) {
+    if(size < 32) {
+        MemSetSSE2(dst, value, size);
+        return;
+    }
+
+    u8 *d = dst;
+    __m256i v = _mm256_set1_epi8(value);
+    size_t i = 0;
+    for(; i + 128 <= size; i += 128) {
+        _mm256_storeu_si256((__m256i*)(d + i), v);
+        _mm256_storeu_si256((__m256i*)(d + i + 32), v);
+        _mm256_storeu_si256((__m256i*)(d + i + 64), v);
+        _mm256_storeu_si256((__m256i*)(d + i + 96), v);
+    }
+    for(; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i*)(d + i), v);
+    _mm256_storeu_si256((__m256i*)(d + size - 32), v);
+}
+
+KERNEL_TARGET("avx2")
+static int MemCompareAVX2(const void *a, const void *b, size_t size) {
+    if(size < 32)
+        return MemCompareSSE2(a, b, size);
+
+    const u8 *x = a, *y = b;
+    for(size_t i = 0;; i += 32) {
+        if(i + 32 > size)
+            i = size - 32;
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(x + i)), _mm256_loadu_si256((const __m256i*)(y + i)));
+        u32 diff = ~(u32)_mm256_movemask_epi8(eq);
+        if(diff) {
+            u32 at = i + LowestSetBit(diff);
+            return x[at] - y[at];
+        }
+        if(i + 32 == size)
+            return 0;
+    }
+}
+
+KERNEL_TARGET("avx512f")
+static void MemCopyAVX512(void *dst, const void *src, size_t size) {
+    if(size < 64) {
+        MemCopyAVX2(dst, src, size);
+        return;
+    }
+
+    u8 *d = dst;
+    const u8 *s = src;
+    __m512i last = _mm512_loadu_si512(s + size - 64);
+    size_t i = 0;
+    for(; i + 256 <= size; i += 256) {
+        __m512i v0 = _mm512_loadu_si512(s + i);
+        __m512i v1 = _mm512_loadu_si512(s + i + 64);
+        __m512i v2 = _mm512_loadu_si512(s + i + 128);
+        __m512i v3 = _mm512_loadu_si512(s + i + 192);
+        _mm512_storeu_si512(d + i, v0);
+        _mm512_storeu_si512(d + i + 64, v1);
+        _mm512_storeu_si512(d + i + 128, v2);
+        _mm512_storeu_si512(d + i + 192, v3);
+    }
+    for(; i + 64 <= size; i += 64)
+        _mm512_storeu_si512(d + i, _mm512_loadu_si512(s + i));
+    _mm512_storeu_si512(d + size - 64, last);
+}
+
+KERNEL_TARGET("avx512f")
+static void MemSetAVX512(void *dst, u8 value, size_t size) {
+    if(size < 64) {
+        MemSetAVX2(dst, value, size);
+        return;
+    }
+
+    u8 *d = dst;
+    __m512i v = _mm512_set1_epi32(value * 0x01010101u);
+    size_t i = 0;
+    for(; i + 256 <= size; i += 256) {
+        _mm512_storeu_si512(d + i, v);
+        _mm512_storeu_si512(d + i + 64, v);
+        _mm512_storeu_si512(d + i + 128, v);
+        _mm512_storeu_si512(d + i + 192, v);
+    }
+    for(; i + 64 <= size; i += 64)
+        _mm512_storeu_si512(d + i, v);
+    _mm512_storeu_si512(d + size - 64, v);
+}
+
+// AVX-512F compares whole dwords, the bytes of the first one that differs
+// are compared one by one
+KERNEL_TARGET("avx512f")
+static int MemCompareAVX512(const void *a, const void *b, size_t size) {
+    if(size < 64)
+        return MemCompareAVX2(a, b, size);
+
+    const u8 *x = a, *y = b;
+    for(size_t i = 0;; i += 64) {
+        if(i + 64 > size)
+            i = size - 64;
+        u32 diff = _mm512_cmpneq_epi32_mask(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+        if(diff) {
+            u32 at = i + 4 * LowestSetBit(diff);
+            return MemCompareScalar(x + at, y + at, 4);
+        }
+        if(i + 64 == size)
+            return 0;
+    }
+}
+
+static void (*MemCopy)(void *dst, const void *src, size_t size) = MemCopyScalar;
+static void (*MemSet)(void *dst, u8 value, size_t size) = MemSetScalar;
+static int (*MemCompare)(const void *a, const void *b, size_t size) = MemCompareScalar;
+
+#define CPUID_OSXSAVE (1 << 27)
+#define CPUID_AVX     (1 << 28)
+#define CPUID_AVX2    (1 << 5)
+#define CPUID_AVX512F (1 << 16)
+
+#define STATE_AVX     0x06
+#define STATE_AVX512  0xe6
+
+// every x64 processor has SSE2
+static void InitMemoryKernels() {
+    MemCopy = MemCopySSE2;
+    MemSet = MemSetSSE2;
+    MemCompare = MemCompareSSE2;
+
+    u32 regs[4];
+    Cpuid(0, 0, regs);
+    u32 max_leaf = regs[0];
+    Cpuid(1, 0, regs);
+    if(max_leaf < 7 || !(regs[2] & CPUID_OSXSAVE) || !(regs[2] & CPUID_AVX))
+        return;
+
+    u64 state = EnabledStateMask();
+    Cpuid(7, 0, regs);
+    if((regs[1] & CPUID_AVX2) && (state & STATE_AVX) == STATE_AVX) {
+        MemCopy = MemCopyAVX2;
+        MemSet = MemSetAVX2;
+        MemCompare = MemCompareAVX2;
+    }
+    if((regs[1] & CPUID_AVX512F) && (state & STATE_AVX512) == STATE_AVX512) {
+        MemCopy = MemCopyAVX512;
+        MemSet = MemSetAVX512;
+        MemCompare = MemCompareAVX512;
+    }
+}
+
+#define WORKERS_MAX 16
+#define WORKER_STACK_SIZE KiloBytes(256)
+
+static u32 ProcessorCount() {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(__linux__)
+    u64 mask[16] = { 0 };
+    if(_sched_getaffinity(0, sizeof(mask), mask) <= 0)
+        return 1;
+
+    u32 count = 0;
+    for(u32 i = 0; i < sizeof(mask) / sizeof(mask[0]); ++i)
+        for(u64 bits = mask[i]; bits; bits &= bits - 1)
+            count++;
+    return count;
+#endif
+}
+
+// returns the value before the increment
+static inline u32 AtomicIncrement(volatile u32 *value) {
+#if defined(_WIN32)
+    return InterlockedIncrement((volatile LONG*)value) - 1;
+#elif defined(__linux__)
+    return __atomic_fetch_add(value, 1, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// returns the value before the decrement
+static inline u32 AtomicDecrement(volatile u32 *value) {
+#if defined(_WIN32)
+    return InterlockedDecrement((volatile LONG*)value) + 1;
+#elif defined(__linux__)
+    return __atomic_fetch_sub(value, 1, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static inline void AtomicOr(volatile u32 *value, u32 bits) {
+#if defined(_WIN32)
+    InterlockedOr((volatile LONG*)value, bits);
+#elif defined(__linux__)
+    __atomic_fetch_or(value, bits, __ATOMIC_ACQ_REL);
+#endif
+}
+
+typedef void (*work_proc)(void *data);
+
+struct work_pool;
+
+typedef struct worker {
+    struct work_pool *pool;
+    void *data;
+#if defined(_WIN32)
+    HANDLE start;
+#elif defined(__linux__)
+    volatile u32 start;
+#endif
+} worker;
+
+// threads that wait for work handed out by RunWorkers. a pool is used by one
+// thread at a time and never moves once started
+typedef struct work_pool {
+    u32 count;
+    work_proc proc;
+    volatile u32 pending;
+    u32 posted;
+    worker workers[WORKERS_MAX];
+#if defined(_WIN32)
+    HANDLE done;
+#endif
+} work_pool;
+
+#if defined(_WIN32)
+static DWORD WINAPI WorkerMain(LPVOID param) {
+    worker *self = param;
+    for(;;) {
+        WaitForSingleObject(self->start, INFINITE);
+        self->pool->proc(self->data);
+        if(!InterlockedDecrement((volatile LONG*)&self->pool->pending))
+            SetEvent(self->pool->done);
+    }
+    return 0;
+}
+#elif defined(__linux__)
+static void WorkerMain(void *param) {
+    worker *self = param;
+    for(;;) {
+        while(!__atomic_load_n(&self->start, __ATOMIC_ACQUIRE))
+            _futex(&self->start, FUTEX_WAIT_PRIVATE, 0, 0);
+        self->start = 0;
+
+        self->pool->proc(self->data);
+        if(!__atomic_sub_fetch(&self->pool->pending, 1, __ATOMIC_ACQ_REL))
+            _futex(&self->pool->pending, FUTEX_WAKE_PRIVATE, 1, 0);
+    }
+}
+#endif
+
+static work_pool* StartWorkers(u32 count) {
+    work_pool *pool = MemAlloc(sizeof(work_pool));
+    pool->count = MIN(count, WORKERS_MAX);
+#if defined(_WIN32)
+    pool->done = CreateEventA(0, FALSE, FALSE, 0);
+#endif
+
+    for(u32 i = 0; i < pool->count; ++i) {
+        worker *w = pool->workers + i;
+        w->pool = pool;
+#if defined(_WIN32)
+        w->start = CreateEventA(0, FALSE, FALSE, 0);
+        CloseHandle(CreateThread(0, WORKER_STACK_SIZE, WorkerMain, w, 0, 0));
+#elif defined(__linux__)
+        char *stack = MemAlloc(WORKER_STACK_SIZE);
+        _clone_thread(WorkerMain, w, stack + WORKER_STACK_SIZE);
+#endif
+    }
+    return pool;
+}
+
+// runs proc once for every element of data and returns when all of them are
+// done. the calling thread takes data[0], the workers the rest
+static void RunWorkers(work_pool *pool, work_proc proc, void **data, u32 count) {
+    u32 nworkers = pool ? MIN(count - 1, pool->count) : 0;
+    for(u32 first = 0; first < count; first += nworkers + 1) {
+        u32 batch = MIN(count - first - 1, nworkers);
+        if(batch) {
+            pool->proc = proc;
+            pool->pending = batch;
+        }
+        for(u32 i = 0; i < batch; ++i) {
+            worker *w = pool->workers + i;
+            w->data = data[first + 1 + i];
+#if defined(_WIN32)
+            SetEvent(w->start);
+#elif defined(__linux__)
+            __atomic_store_n(&w->start, 1, __ATOMIC_RELEASE);
+            _futex(&w->start, FUTEX_WAKE_PRIVATE, 1, 0);
+#endif
+        }
+
+        proc(data[first]);
+        if(!batch)
+            continue;
+#if defined(_WIN32)
+        WaitForSingleObject(pool->done, INFINITE);
+#elif defined(__linux__)
+        u32 pending;
+        while((pending = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)))
+            _futex(&pool->pending, FUTEX_WAIT_PRIVATE, pending, 0);
+#endif
+    }
+}
+
+// hands data to the first worker and returns at once, WaitWork returns once
+// it is done. a pool used this way runs nothing else
+static void PostWork(work_pool *pool, work_proc proc, void *data) {
+    worker *w = pool->workers;
+    pool->proc = proc;
+    pool->pending = 1;
+    pool->posted = 1;
+    w->data = data;
+#if defined(_WIN32)
+    SetEvent(w->start);
+#elif defined(__linux__)
+    __atomic_store_n(&w->start, 1, __ATOMIC_RELEASE);
+    _futex(&w->start, FUTEX_WAKE_PRIVATE, 1, 0);
+#endif
+}
+
+static void WaitWork(work_pool *pool) {
+    if(!pool->posted)
+        return;
+    pool->posted = 0;
+#if defined(_WIN32)
+    WaitForSingleObject(pool->done, INFINITE);
+#elif defined(__linux__)
+    u32 pending;
+    while((pending = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)))
+        _futex(&pool->pending, FUTEX_WAIT_PRIVATE, pending, 0);
+#endif
+}
+
+#define STRIPES_MAX 8
+#define STRIPE_BUFFERS_MAX 1024
+
+#define STRIPE_READ  0
+#define STRIPE_WRITE 1
+#define STRIPE_SYNC  2
+
+// the part of one transfer that falls on one backing file, the buffers
+// follow each other in the file starting at off. a read that comes up short
+// is done again from fallback, the other copy of a mirrored file. a read of
+// a mirrored file counts itself in outstanding while it is in flight
+typedef struct stripe_job {
+    active_file *file;
+    active_file *fallback;
+    volatile u32 *outstanding;
+    u32 op;
+    file_offset off;
+    write_buffer *buffers;
+    u32 count;
+    int res;
+} stripe_job;
+
+// one file spread over count backing files. the first origin bytes are at
+// the start of every backing file, the rest goes round robin in units of
+// unit bytes. a mirrored file keeps a second copy of every backing file in
+// mirrors, writes go to both and reads to the copy with fewer in flight.
+// every backing file and copy has a worker of its own except the first,
+// which is served by the calling thread
+typedef struct striped_file {
+    u32 count;
+    u32 mirrored;
+    file_offset origin;
+    file_offset unit;
+    file_offset end;
+
+    active_file files[STRIPES_MAX];
+    active_file mirrors[STRIPES_MAX];
+
+    // pieces of the transfer in progress, STRIPE_BUFFERS_MAX for every
+    // backing file, and where they start in it
+    write_buffer *pieces;
+    u32 npieces[STRIPES_MAX];
+    file_offset first[STRIPES_MAX];
+
+    // reads in flight on each copy of every backing file, from the calling
+    // thread and from shared readers alike. turn breaks the ties
+    volatile u32 outstanding[2][STRIPES_MAX];
+    volatile u32 turn[STRIPES_MAX];
+
+    stripe_job *jobs;
+    work_pool *pool;
+
+    // a file held in an anonymous mapping of capacity bytes has no backing
+    // files, count is 0
+    char *memory;
+    file_offset capacity;
+} striped_file;
+
+static void StripeLocate(striped_file *file, file_offset off, u32 *index, file_offset *local, file_offset *run) {
+    if(off < file->origin) {
+        *index = 0;
+        *local = off;
+        *run = file->origin - off;
+        return;
+    }
+
+    file_offset unit = (off - file->origin) / file->unit;
+    file_offset in_unit = (off - file->origin) % file->unit;
+    *index = unit % file->count;
+    *local = file->origin + (unit / file->count) * file->unit + in_unit;
+    *run = file->unit - in_unit;
+}
+
+// length of backing file index when the striped file is size bytes long
+static file_offset StripeLength(striped_file *file, u32 index, file_offset size) {
+    if(size <= file->origin)
+        return index ? file->origin : size;
+
+    file_offset units = (size - file->origin) / file->unit;
+    file_offset rest = (size - file->origin) % file->unit;
+    file_offset length = file->origin + (units / file->count) * file->unit;
+    if(index < units % file->count)
+        length += file->unit;
+    else if(index == units % file->count)
+        length += rest;
+    return length;
+}
+
+static void StripeJobRun(void *data) {
+    stripe_job *job = data;
+    if(job->op == STRIPE_READ) {
+        size_t size = 0;
+        for(u32 i = 0; i < job->count; ++i)
+            size += job->buffers[i].size;
+
+        job->res = ReadScatterAtOffset(job->file, job->buffers, job->count, job->off);
+        if(job->outstanding)
+            AtomicDecrement(job->outstanding);
+        if(job->res < (int)size && job->fallback)
+            job->res = ReadScatterAtOffset(job->fallback, job->buffers, job->count, job->off);
+    }
+    else if(job->op == STRIPE_WRITE)
+        job->res = WriteGatherAtOffset(job->file, job->buffers, job->count, job->off);
+    else
+        SyncFile(job->file);
+}
+
+// which copy of backing file index a read goes to, the one with fewer reads
+// in flight or each in turn while they are even
+static u32 StripeChooseCopy(striped_file *file, u32 index) {
+    u32 primary = file->outstanding[0][index], mirror = file->outstanding[1][index];
+    if(primary != mirror)
+        return mirror < primary;
+    return AtomicIncrement(file->turn + index) & 1;
+}
+
+// a read of several pieces is split between the two copies, a single piece
+// goes to the copy StripeChooseCopy picks. returns whether copy is used
+static u32 StripeBalanceRead(striped_file *file, u32 index, stripe_job *job, stripe_job *copy) {
+    if(job->count == 1) {
+        if(StripeChooseCopy(file, index)) {
+            job->file = file->mirrors + index;
+            job->fallback = file->files + index;
+            job->outstanding = file->outstanding[1] + index;
+        }
+        return 0;
+    }
+
+    size_t total = 0;
+    for(u32 i = 0; i < job->count; ++i)
+        total += job->buffers[i].size;
+
+    size_t half = 0;
+    u32 split = 0;
+    while(split < job->count - 1 && 2 * half < total)
+        half += job->buffers[split++].size;
+
+    job->count = split;
+    copy->buffers += split;
+    copy->count -= split;
+    copy->off += half;
+    return 1;
+}
+
+static int StripesRunJobs(striped_file *file, u32 op) {
+    void *data[2 * STRIPES_MAX];
+    u32 count = 0;
+    for(u32 i = 0; i < file->count; ++i) {
+        if(!file->npieces[i] && op != STRIPE_SYNC)
+            continue;
+
+        stripe_job *job = file->jobs + 2 * i;
+        *job = (stripe_job){ 0 };
+        job->file = file->files + i;
+        job->op = op;
+        job->off = file->first[i];
+        job->buffers = file->pieces + i * STRIPE_BUFFERS_MAX;
+        job->count = file->npieces[i];
+        file->npieces[i] = 0;
+        data[count++] = job;
+        if(!file->mirrored)
+            continue;
+
+        stripe_job *copy = job + 1;
+        *copy = *job;
+        copy->file = file->mirrors + i;
+        if(op == STRIPE_READ) {
+            job->fallback = copy->file;
+            copy->fallback = job->file;
+            job->outstanding = file->outstanding[0] + i;
+            copy->outstanding = file->outstanding[1] + i;
+            if(!StripeBalanceRead(file, i, job, copy))
+                continue;
+        }
+        data[count++] = copy;
+    }
+    if(!count)
+        return 0;
+
+    for(u32 i = 0; i < count; ++i) {
+        stripe_job *job = data[i];
+        if(job->outstanding)
+            AtomicIncrement(job->outstanding);
+    }
+
+    RunWorkers(file->pool, StripeJobRun, data, count);
+
+    // a mirrored write has only been done as far as both copies got
+    int res = 0;
+    for(u32 i = 0; i < count; ++i) {
+        stripe_job *job = data[i];
+        if(file->mirrored && op == STRIPE_WRITE) {
+            stripe_job *copy = data[++i];
+            res += MIN(job->res, copy->res);
+        }
+        else
+            res += job->res;
+    }
+    return res;
+}
+
+// splits the buffers along the stripe units and moves every backing file's
+// share in one call, all backing files at once
+static int StripesTransfer(striped_file *file, u32 op, write_buffer *buffers, u32 count, file_offset off) {
+    if(file->memory) {
+        int res = 0;
+        for(u32 i = 0; i < count && off < file->capacity; ++i) {
+            size_t size = MIN(buffers[i].size, file->capacity - off);
+            if(op == STRIPE_WRITE)
+                MemCopy(file->memory + off, buffers[i].base, size);
+            else
+                MemCopy(buffers[i].base, file->memory + off, size);
+            off += size;
+            res += size;
+        }
+        return res;
+    }
+
+    // the pieces of a mirrored read are kept apart, they are what is split
+    // between the copies
+    u32 merge = !file->mirrored || op != STRIPE_READ;
+
+    int res = 0;
+    for(u32 i = 0; i < count; ++i) {
+        char *base = buffers[i].base;
+        size_t size = buffers[i].size;
+        while(size) {
+            u32 index;
+            file_offset local, run;
+            StripeLocate(file, off, &index, &local, &run);
+            size_t chunk = MIN(run, size);
+
+            if(file->npieces[index] == STRIPE_BUFFERS_MAX)
+                res += StripesRunJobs(file, op);
+
+            write_buffer *pieces = file->pieces + index * STRIPE_BUFFERS_MAX;
+            u32 *npieces = file->npieces + index;
+            write_buffer *last = *npieces ? pieces + *npieces - 1 : 0;
+            if(!last)
+                file->first[index] = local;
+            if(last && merge && (char*)last->base + last->size == base)
+                last->size += chunk;
+            else
+                pieces[(*npieces)++] = (write_buffer){ base, chunk };
+
+            base += chunk;
+            off += chunk;
+            size -= chunk;
+        }
+    }
+    return res + StripesRunJobs(file, op);
+}
+
+static void StripesBegin(striped_file *file, u32 count, u32 mirrored, file_offset origin, file_offset unit) {
+    file->count = count;
+    file->mirrored = mirrored;
+    file->origin = origin;
+    file->unit = unit;
+    file->pieces = MemAlloc(count * STRIPE_BUFFERS_MAX * sizeof(write_buffer));
+    file->jobs = MemAlloc(2 * count * sizeof(stripe_job));
+
+    u32 nworkers = (mirrored ? 2 * count : count) - 1;
+    if(nworkers)
+        file->pool = StartWorkers(nworkers);
+}
+
+// mirrors names the second copies, 0 for a file that is not mirrored
+striped_file CreateLargeStripes(char **names, char **mirrors, u32 count, file_offset origin, file_offset unit, size_t size) {
+    striped_file result = { 0 };
+    StripesBegin(&result, count, mirrors != 0, origin, unit);
+    for(u32 i = 0; i < count; ++i) {
+        result.files[i] = CreateLargeFile(names[i], StripeLength(&result, i, size));
+        if(mirrors)
+            result.mirrors[i] = CreateLargeFile(mirrors[i], StripeLength(&result, i, size));
+    }
+    result.end = size;
+
+    return result;
+}
+
+striped_file OpenExistingStripes(char **names, char **mirrors, u32 count, file_offset origin, file_offset unit) {
+    striped_file result = { 0 };
+    StripesBegin(&result, count, mirrors != 0, origin, unit);
+    for(u32 i = 0; i < count; ++i) {
+        result.files[i] = OpenExistingFile(names[i]);
+        if(mirrors)
+            result.mirrors[i] = OpenExistingFile(mirrors[i]);
+
+        // the backing file whose last byte comes last decides where the
+        // striped file ends, a copy cut short does not
+        file_offset length = result.files[i].end;
+        if(mirrors)
+            length = MAX(length, result.mirrors[i].end);
+        if(length > origin) {
+            file_offset last = length - origin - 1;
+            file_offset end = origin + ((last / unit) * count + i) * unit + last % unit + 1;
+            result.end = MAX(result.end, end);
+        }
+        else if(!i)
+            result.end = length;
+    }
+
+    return result;
+}
+
+int WriteToStripesAtOffset(striped_file *file, void *buf, size_t size, file_offset off) {
+    write_buffer buffer = { buf, size };
+    int res = StripesTransfer(file, STRIPE_WRITE, &buffer, 1, off);
+    if(off + res > file->end)
+        file->end = off + res;
+    return res;
+}
+
+int WriteGatherToStripes(striped_file *file, write_buffer *buffers, u32 count, file_offset off) {
+    int res = StripesTransfer(file, STRIPE_WRITE, buffers, count, off);
+    if(off + res > file->end)
+        file->end = off + res;
+    return res;
+}
+
+int ReadFromStripesAtOffset(striped_file *file, void *buf, size_t size, file_offset off) {
+    if(off > file->end)
+        return 0;
+
+    // like a backing file, a file in memory reads nothing past its end
+    if(file->memory)
+        size = MIN(size, file->end - off);
+
+    write_buffer buffer = { buf, size };
+    return StripesTransfer(file, STRIPE_READ, &buffer, 1, off);
+}
+
+// reads without going through the pieces and the workers of file, for
+// threads other than the one doing the rest of its transfers
+int ReadSharedStripesAtOffset(striped_file *file, void *buf, size_t size, file_offset off) {
+    if(off > file->end)
+        return 0;
+
+    if(file->memory) {
+        size = MIN(size, file->end - off);
+        MemCopy(buf, file->memory + off, size);
+        return size;
+    }
+
+    int res = 0;
+    while(size) {
+        u32 index;
+        file_offset local, run;
+        StripeLocate(file, off, &index, &local, &run);
+        size_t chunk = MIN(run, size);
+
+        active_file *copies[2] = { file->files + index, file->mirrors + index };
+        u32 side = file->mirrored ? StripeChooseCopy(file, index) : 0;
+
+        // a failed read returns -1, the comparisons are done as int
+        if(file->mirrored)
+            AtomicIncrement(file->outstanding[side] + index);
+        int read = ReadSharedFileAtOffset(copies[side], buf, chunk, local);
+        if(file->mirrored) {
+            AtomicDecrement(file->outstanding[side] + index);
+            if(read < (int)chunk)
+                read = ReadSharedFileAtOffset(copies[!side], buf, chunk, local);
+        }
+        if(read > 0)
+            res += read;
+        if(read < (int)chunk)
+            break;
+
+        buf = (char*)buf + chunk;
+        off += chunk;
+        size -= chunk;
+    }
+    return res;
+}
+
+// the write counterpart of ReadSharedStripesAtOffset, only for writes
+// within the file. a mirrored write has been done as far as both copies got
+int WriteSharedStripesAtOffset(striped_file *file, void *buf, size_t size, file_offset off) {
+    if(file->memory) {
+        if(off >= file->capacity)
+            return 0;
+        size = MIN(size, file->capacity - off);
+        MemCopy(file->memory + off, buf, size);
+        return size;
+    }
+
+    int res = 0;
+    while(size) {
+        u32 index;
+        file_offset local, run;
+        StripeLocate(file, off, &index, &local, &run);
+        size_t chunk = MIN(run, size);
+
+        int written = WriteSharedFileAtOffset(file->files + index, buf, chunk, local);
+        if(file->mirrored) {
+            int copy = WriteSharedFileAtOffset(file->mirrors + index, buf, chunk, local);
+            written = MIN(written, copy);
+        }
+        if(written > 0)
+            res += written;
+        if(written < (int)chunk)
+            break;
+
+        buf = (char*)buf + chunk;
+        off += chunk;
+        size -= chunk;
+    }
+    return res;
+}
+
+// moves size bytes from or to one copy of a mirrored file only, side 0 is
+// the primary. like the shared transfers it leaves the pieces and the
+// workers of file alone
+static int StripeCopyTransfer(striped_file *file, u32 side, u32 op, void *buf, size_t size, file_offset off) {
+    int res = 0;
+    while(size) {
+        u32 index;
+        file_offset local, run;
+        StripeLocate(file, off, &index, &local, &run);
+        size_t chunk = MIN(run, size);
+
+        active_file *copy = side ? file->mirrors + index : file->files + index;
+        int done;
+        if(op == STRIPE_READ)
+            done = ReadSharedFileAtOffset(copy, buf, chunk, local);
+        else
+            done = WriteSharedFileAtOffset(copy, buf, chunk, local);
+        if(done > 0)
+            res += done;
+        if(done < (int)chunk)
+            break;
+
+        buf = (char*)buf + chunk;
+        off += chunk;
+        size -= chunk;
+    }
+    return res;
+}
+
+int ReadStripeCopyAtOffset(striped_file *file, u32 side, void *buf, size_t size, file_offset off) {
+    return StripeCopyTransfer(file, side, STRIPE_READ, buf, size, off);
+}
+
+int WriteStripeCopyAtOffset(striped_file *file, u32 side, void *buf, size_t size, file_offset off) {
+    return StripeCopyTransfer(file, side, STRIPE_WRITE, buf, size, off);
+}
+
+void TruncateStripes(striped_file *file, file_offset size) {
+    // what is cut off reads back as zeros once the file grows again
+    if(file->memory && size < file->end)
+        MemSet(file->memory + size, 0, MIN(file->end, file->capacity) - size);
+
+    for(u32 i = 0; i < file->count; ++i) {
+        TruncateFile(file->files + i, StripeLength(file, i, size));
+        if(file->mirrored)
+            TruncateFile(file->mirrors + i, StripeLength(file, i, size));
+    }
+    file->end = size;
+}
+
+#define LOAD_CHUNK_SIZE MegaBytes(4)
+#define PAGE_SIZE KiloBytes(4)
+
+// what one write call can take on both platforms
+#define SAVE_CHUNK_SIZE MegaBytes(1024)
+
+static striped_file CreateMemoryStripes(size_t capacity, size_t size) {
+    striped_file result = { 0 };
+    result.memory = MemAlloc(capacity);
+    result.capacity = capacity;
+    result.end = size;
+
+    return result;
+}
+
+static const u8 zero_page[PAGE_SIZE];
+
+// reads the file front to back. pages that are all zeros are not copied so
+// that the untouched parts of the mapping cost no memory
+static striped_file LoadMemoryStripes(char *name, size_t capacity) {
+    active_file file = OpenExistingFile(name);
+    striped_file result = CreateMemoryStripes(MAX(capacity, file.end), file.end);
+
+    char *chunk = MemAlloc(LOAD_CHUNK_SIZE);
+    for(file_offset off = 0; off < file.end; off += LOAD_CHUNK_SIZE) {
+        int size = ReadFromFileAtOffset(&file, chunk, LOAD_CHUNK_SIZE, off);
+        if(size <= 0)
+            break;
+        for(u32 page = 0; page < (u32)size; page += PAGE_SIZE) {
+            u32 length = MIN(PAGE_SIZE, size - page);
+            if(MemCompare(chunk + page, zero_page, length))
+                MemCopy(result.memory + off + page, chunk + page, length);
+        }
+    }
+    MemFree(chunk, LOAD_CHUNK_SIZE);
+    CloseFile(&file);
+
+    return result;
+}
+
+// writes the file front to back in as few calls as it takes, the saved file
+// is laid out like a single backing file
+static u32 SaveMemoryStripes(striped_file *file, char *name) {
+    active_file out = CreateNewFile(name);
+    file_offset written = 0;
+    while(written < file->end) {
+        size_t size = MIN(file->end - written, SAVE_CHUNK_SIZE);
+        int res = WriteToFileAtOffset(&out, file->memory + written, size, written);
+        if(res <= 0)
+            break;
+        written += res;
+    }
+    TruncateFile(&out, file->end);
+    SyncFile(&out);
+    CloseFile(&out);
+    return written == file->end;
+}
+
+// makes dst a copy of src chunk by chunk. chunks that already match are not
+// written, so the holes the two files share stay holes
+static u32 CopyFileOver(char *src, char *dst) {
+    active_file from = OpenExistingFile(src);
+    active_file to = OpenExistingFile(dst);
+    char *chunk = MemAlloc(LOAD_CHUNK_SIZE);
+    char *old = MemAlloc(LOAD_CHUNK_SIZE);
+
+    u32 res = 1;
+    for(file_offset off = 0; off < from.end; off += LOAD_CHUNK_SIZE) {
+        int size = ReadFromFileAtOffset(&from, chunk, LOAD_CHUNK_SIZE, off);
+        if(size <= 0) {
+            res = 0;
+            break;
+        }
+        int have = ReadFromFileAtOffset(&to, old, size, off);
+        if(have == size && !MemCompare(chunk, old, size))
+            continue;
+        if(WriteToFileAtOffset(&to, chunk, size, off) != size) {
+            res = 0;
+            break;
+        }
+    }
+    TruncateFile(&to, from.end);
+    SyncFile(&to);
+
+    MemFree(chunk, LOAD_CHUNK_SIZE);
+    MemFree(old, LOAD_CHUNK_SIZE);
+    CloseFile(&from);
+    CloseFile(&to);
+    return res;
+}
+
+// all backing files and copies are flushed at the same time, a write is
+// durable once both copies are
+void SyncStripes(striped_file *file) {
+    StripesRunJobs(file, STRIPE_SYNC);
+}
+
 static void ClearConsole() {
 #if defined(_WIN32)
     HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -2,24 +2,48 @@
 
 #include "slim64.h"
 #include "string.c"
+#include "m_alloc.c"
 #include <stddef.h>
 
 
 /*
     Block Structure:
     u32 in_use
-    u32 used_before
+    u32 type
     u32 prev_block
     u32 next_block
     data [block_size - 8]
 
     prev_block is 0 for the first block of a file
-    if not in_use (free block) next_block gives the index of the next free block
+
+    Allocation Groups:
+    the blocks are split into groups of BLOCKS_PER_GROUP, the first block of
+    every group is a bitmap with one bit per block of the group (set = in use)
+    the bitmaps are the only record of free space, freeing a block does not
+    touch the block itself
 
     Directory Structure:
     u32 n_entries
     char entry_name[]
     block_index first_block_of_the_entry
+    u32 is_directory
+    size_t size
+    u32 is_inline
+    char data[INLINE_DATA_SIZE]
+
+    is_directory and size mirror the child's SLM_File and are kept in sync
+    whenever the child's used_size changes
+    inline entries have no base_block, their contents live in data
+
+    Tail Block Structure:
+    u32 n_fragments
+    SLM_Fragment fragments[] each followed by its size bytes
+
+    the final partial block of a regular file is moved into a shared tail
+    block once the file is written, the block is freed when its last
+    fragment is released. a rewritten file keeps its fragment while the
+    tail fits, and released fragments of the block being filled are
+    squeezed out before a new block is taken
 */
 
 #define BLOCK_SIZE (512)
@@ -29,693 +53,4080 @@
 
 #define IN_USE(block) GlobalFileOffset(block, 0) - BLOCK_METADATA
 #define BLOCK_BEGIN(block) IN_USE(block)
-#define USED_BEFORE(block) GlobalFileOffset(block, sizeof(u32)) - BLOCK_METADATA
+#define TYPE(block) GlobalFileOffset(block, sizeof(u32)) - BLOCK_METADATA
 #define PREV(block) GlobalFileOffset(block, sizeof(u32) * 2) - BLOCK_METADATA
 #define NEXT(block) GlobalFileOffset(block, sizeof(u32) * 3) - BLOCK_METADATA
 #define CONTENT(block) GlobalFileOffset(block, 0)
 
-#define INIT_USED_SIZE sizeof(SLM_File)
+#define BLOCKS_PER_GROUP (USABLE_BLOCK_SIZE * 8)
 
-static inline file_offset GlobalFileOffset(block_index block, file_offset off) {
-    return block * BLOCK_SIZE + off + sizeof(SLM_Header) + BLOCK_METADATA;
-}
+#define BLOCK_CHAIN  0
+#define BLOCK_TAIL   1
+#define BLOCK_BITMAP 2
+#define BLOCK_SNAPSHOT 3
+#define BLOCK_INDEX 4
 
-static inline void SLM_UpdateHeader(FileSystem *fs) {
-    WriteToFileAtOffset(&fs->file, &fs->header, sizeof(fs->header), 0);
-}
+#define IMAGE_MAGIC 0x34364c53
+#define IMAGE_VERSION 2
 
-block_index SLM_ReserveBlocks(FileSystem *fs, u32 count) {
-    Assert(fs->header.used_size + count * fs->header.block_size < fs->header.total_size);
+#define JOURNAL_BLOCKS 2048
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_GROUP_TRANSACTIONS 8
+#define JOURNAL_LINKS 1024
 
-    block_index res = fs->header.next_free_block;
-    for(int i = 0; i < count; ++i) {        
-        u32 in_use = 1;
-        block_index zero = 0;
-        block_index next_block = fs->header.next_free_block;
+#define SNAPSHOT_TABLE_BLOCKS RoundUpDivision(sizeof(SLM_SnapshotTable), BLOCK_SIZE)
+#define SNAPSHOT_COPIES_PER_BLOCK (USABLE_BLOCK_SIZE / sizeof(SLM_SnapshotCopy))
 
-        WriteToFileAtOffset(&fs->file, &in_use, sizeof(in_use), IN_USE(next_block));
-        if(i == 0)
-            WriteToFileAtOffset(&fs->file, &zero, sizeof(block_index), PREV(next_block));
+#define CHECKSUMS_PER_BLOCK (USABLE_BLOCK_SIZE / sizeof(u32))
+#define CHECKSUM_TABLE_BLOCKS(total_blocks) RoundUpDivision(total_blocks, CHECKSUMS_PER_BLOCK)
+#define CHECKSUM_RUN_BLOCKS 16
 
-        u32 used_before = 0;
-        ReadFromFileAtOffset(&fs->file, &used_before, sizeof(used_before), USED_BEFORE(next_block));
-        if(used_before)
-            ReadFromFileAtOffset(&fs->file, &fs->header.next_free_block, sizeof(block_index), NEXT(fs->header.next_free_block));
-        else
-            fs->header.next_free_block++;
-        
-        used_before = 1;
-        WriteToFileAtOffset(&fs->file, &used_before, sizeof(used_before), USED_BEFORE(next_block));
+#define DEFRAG_IDLE     0
+#define DEFRAG_COMPACT  1
+#define DEFRAG_RELOCATE 2
+#define DEFRAG_TRUNCATE 3
 
-        if(i == count - 1)
-            WriteToFileAtOffset(&fs->file, &zero, sizeof(block_index), NEXT(next_block));
-        else
-            WriteToFileAtOffset(&fs->file, &fs->header.next_free_block, sizeof(block_index), NEXT(next_block));
-    }
+#define DEFRAG_STEP_BLOCKS 1024
 
-    fs->header.used_size += count * fs->header.block_size;
-    fs->header.nfree_blocks -= count;
-    SLM_UpdateHeader(fs);
-    return res;
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 256
+
+#define INIT_USED_SIZE sizeof(SLM_File)
+#define ENTRIES_PER_READ 16
+#define TAIL_PACK_LIMIT (USABLE_BLOCK_SIZE / 2)
+
+static void SLM_UpdateEntrySize(FileSystem *fs, block_index directory, block_index file, size_t size);
+static void SLM_FlushSubtreeDeltas(FileSystem *fs);
+static void SLM_AddSubtreeDelta(FileSystem *fs, block_index directory, i64 size, i32 files);
+static u32 SLM_CommitGroup(FileSystem *fs);
+static void SLM_PreserveRange(FileSystem *fs, file_offset off, size_t size);
+static void SLM_PreserveBitmap(FileSystem *fs, block_index block);
+static void SLM_MarkWritten(FileSystem *fs, file_offset off, size_t size);
+static int SLM_ReadMirrored(FileSystem *fs, char *buf, size_t size, file_offset off, u32 shared);
+static void SLM_InitSnapshots(FileSystem *fs);
+static void SLM_WriteSnapshotTable(FileSystem *fs);
+static void SLM_IndexFlush(FileSystem *fs);
+static void SLM_IndexDiscard(FileSystem *fs);
+static void SLM_CountFreeBlocks(FileSystem *fs);
+static void SLM_LoadSnapshotState(FileSystem *fs);
+
+static inline file_offset GlobalFileOffset(block_index block, file_offset off) {
+    return block * BLOCK_SIZE + off + sizeof(SLM_Header) + BLOCK_METADATA;
 }
 
-void SLM_FreeBlocks(FileSystem *fs, block_index first) {
-    block_index next_block = first;
+static inline file_offset SLM_JournalBegin(FileSystem *fs) {
+    return BLOCK_BEGIN(fs->header.journal_first);
+}
 
-    do {
-        u32 in_use;
-        ReadFromFileAtOffset(&fs->file, &in_use, sizeof(in_use), IN_USE(next_block));
-        Assert(in_use);
+static inline u32 SLM_JournalSize(FileSystem *fs) {
+    return fs->header.journal_blocks * BLOCK_SIZE;
+}
 
-        in_use = 0;
-        WriteToFileAtOffset(&fs->file, &in_use, sizeof(in_use), IN_USE(next_block));
+// the largest group the region holds next to the super block, a larger
+// one is written out to free blocks
+static inline u32 SLM_JournalCapacity(FileSystem *fs) {
+    return SLM_JournalSize(fs) - sizeof(SLM_JournalSuper) - sizeof(SLM_JournalGroup);
+}
 
-        block_index tmp;
-        ReadFromFileAtOffset(&fs->file, &tmp, sizeof(tmp), NEXT(next_block));
+static u32 SLM_JournalChecksum(u32 sequence, char *data, u32 size) {
+    u32 hash = 2166136261u ^ sequence;
+    for(u32 i = 0; i < size; ++i) {
+        hash ^= (u8)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        WriteToFileAtOffset(&fs->file, &fs->header.next_free_block, sizeof(block_index), NEXT(next_block));
-        fs->header.next_free_block = next_block;
+static void SLM_MarkJournaled(FileSystem *fs, file_offset off, size_t size) {
+    if(off + size <= sizeof(SLM_Header))
+        return;
+    if(off < sizeof(SLM_Header)) {
+        size -= sizeof(SLM_Header) - off;
+        off = sizeof(SLM_Header);
+    }
 
-        next_block = tmp;
-    } while(next_block);
+    block_index first = (off - sizeof(SLM_Header)) / BLOCK_SIZE;
+    block_index last = (off + size - 1 - sizeof(SLM_Header)) / BLOCK_SIZE;
+    for(block_index block = first; block <= last; ++block)
+        fs->journal.journaled[block >> 3] |= 1 << (block & 7);
 }
 
-static void SLM_InitBlocks(FileSystem *fs) {
-    WriteToFile(&fs->file, &fs->header, sizeof(fs->header));
+// outside a transaction everything is written in place. inside one only
+// blocks that were free at the last commit and have no records in the
+// current round can be, nothing committed points at them
+static u32 SLM_WritesInPlace(FileSystem *fs, file_offset off, size_t size) {
+    SLM_Journal *journal = &fs->journal;
+    if(!journal->active)
+        return 1;
+    if(off < sizeof(SLM_Header))
+        return 0;
+
+    block_index first = (off - sizeof(SLM_Header)) / BLOCK_SIZE;
+    block_index last = (off + size - 1 - sizeof(SLM_Header)) / BLOCK_SIZE;
+    for(block_index block = first; block <= last; ++block) {
+        u8 bit = 1 << (block & 7);
+        if((journal->committed[block >> 3] & bit) || (journal->journaled[block >> 3] & bit))
+            return 0;
+    }
+    return 1;
+}
 
-    fs->header.used_size += sizeof(fs->header);
-    // MoveFilePointer(&fs->file, sizeof(fs->header), FOFFSET_BEGIN, FPOINTER_WRITE);
-    // block_index i = 0;
-    // for(; i < fs->header.total_blocks - 1; ++i) {
-    //     block_index next = i+1;
-    //     block_index prev = i-1;
-    //     WriteToFileAtOffset(&fs->file, &prev, sizeof(block_index), PREV(i));
-    //     WriteToFileAtOffset(&fs->file, &next, sizeof(block_index), NEXT(i));
-    // }
+// the header is key 0 and block b key b + 1
+static inline u32 SLM_JournalKey(file_offset off) {
+    return off < sizeof(SLM_Header) ? 0 : (off - sizeof(SLM_Header)) / BLOCK_SIZE + 1;
 }
 
-static FileSystem SLM_CreateNewFileSystem(char *name, size_t total_size) {
-    FileSystem result = { 0 };
-    result.file = CreateLargeFile(name, total_size);
+static inline file_offset SLM_JournalKeyEnd(u32 key) {
+    return sizeof(SLM_Header) + (file_offset)key * BLOCK_SIZE;
+}
 
-    // rounding up to nearest multiple of BLOCK_SIZE = 512
-    total_size >>= 9;
-    total_size++;
-    total_size <<= 9;
+static SLM_JournalSlot* SLM_FindJournalSlot(SLM_JournalRecords *records, u32 key) {
+    u32 mask = records->nslots - 1;
+    u32 index = (key * 2654435761u) & mask;
+    while(records->slots[index].first != UINT_MAX && records->slots[index].key != key)
+        index = (index + 1) & mask;
+    return records->slots + index;
+}
 
-    result.header.block_size = BLOCK_SIZE;
-    result.header.total_size = total_size;
-    result.header.total_blocks = total_size / BLOCK_SIZE;
-    result.header.nfree_blocks = result.header.total_blocks;
-    result.header.header_block_size = sizeof(SLM_Header);
+static void SLM_InitRecords(SLM_JournalRecords *records, u32 capacity) {
+    records->capacity = capacity;
+    records->buf = MemAlloc(capacity);
+    records->links_capacity = JOURNAL_LINKS;
+    records->links = MemAlloc(records->links_capacity * sizeof(SLM_JournalLink));
+    records->nslots = 2 * JOURNAL_LINKS;
+    records->slots = MemAlloc(records->nslots * sizeof(SLM_JournalSlot));
+    MemSet(records->slots, 0xff, records->nslots * sizeof(SLM_JournalSlot));
+}
 
-    SLM_InitBlocks(&result);
-    result.header.next_free_block = 0;
+static void SLM_ClearRecords(SLM_JournalRecords *records) {
+    if(records->nkeys)
+        MemSet(records->slots, 0xff, records->nslots * sizeof(SLM_JournalSlot));
+    records->used = 0;
+    records->nlinks = 0;
+    records->nkeys = 0;
+}
 
-    result.header.root = SLM_ReserveBlocks(&result, 1);
+// the records of a transaction are never split over two groups, buf grows
+// to whatever the transaction needs
+static void SLM_ReserveRecords(SLM_JournalRecords *records, u32 size) {
+    if(size <= records->capacity)
+        return;
 
-    SLM_File root = { 0 };
-    root.used_size = sizeof(SLM_File);
-    root.is_directory = 1;
-    _strcpy("room", root.name, 5);
-    root.self = result.header.root;
-    root.nblocks = 1;
-    root.parent = 0;   
-    root.content = GlobalFileOffset(root.self, sizeof(SLM_File));
-    WriteToFileAtOffset(&result.file, &root, sizeof(root), CONTENT(result.header.root));
-    
-    return result;    
+    u32 capacity = records->capacity;
+    while(capacity < size)
+        capacity *= 2;
+    char *buf = MemAlloc(capacity);
+    m_copy(records->buf, buf, records->used);
+    MemFree(records->buf, records->capacity);
+    records->buf = buf;
+    records->capacity = capacity;
 }
 
-static FileSystem SLM_OpenExistingFileSystem(char *name) {
-    FileSystem result = { 0 };
+// keeps the map at most half full
+static void SLM_GrowRecordMap(SLM_JournalRecords *records) {
+    if(records->nlinks == records->links_capacity) {
+        SLM_JournalLink *links = MemAlloc(2 * records->links_capacity * sizeof(SLM_JournalLink));
+        m_copy(records->links, links, records->nlinks * sizeof(SLM_JournalLink));
+        MemFree(records->links, records->links_capacity * sizeof(SLM_JournalLink));
+        records->links = links;
+        records->links_capacity *= 2;
+    }
+    if(2 * (records->nkeys + 1) <= records->nslots)
+        return;
 
-    result.file = OpenExistingFile(name);
-    ReadFromFile(&result.file, &result.header, sizeof(result.header));
+    SLM_JournalSlot *slots = records->slots;
+    u32 nslots = records->nslots;
+    records->nslots = 2 * nslots;
+    records->slots = MemAlloc(records->nslots * sizeof(SLM_JournalSlot));
+    MemSet(records->slots, 0xff, records->nslots * sizeof(SLM_JournalSlot));
+    for(u32 i = 0; i < nslots; ++i) {
+        if(slots[i].first != UINT_MAX)
+            *SLM_FindJournalSlot(records, slots[i].key) = slots[i];
+    }
+    MemFree(slots, nslots * sizeof(SLM_JournalSlot));
+}
 
-    return result;
+// size bytes at off, all of them within the header or one block
+static void SLM_AddRecord(SLM_JournalRecords *records, void *buf, u32 size, file_offset off) {
+    SLM_ReserveRecords(records, records->used + sizeof(SLM_JournalRecord) + size);
+    SLM_GrowRecordMap(records);
+
+    SLM_JournalRecord *record = (SLM_JournalRecord*)(records->buf + records->used);
+    record->offset = off;
+    record->size = size;
+    m_copy(buf, record + 1, size);
+
+    u32 index = records->nlinks++;
+    records->links[index].pos = records->used;
+    records->links[index].next = UINT_MAX;
+    records->used += sizeof(SLM_JournalRecord) + size;
+
+    u32 key = SLM_JournalKey(off);
+    SLM_JournalSlot *slot = SLM_FindJournalSlot(records, key);
+    if(slot->first == UINT_MAX) {
+        slot->key = key;
+        slot->first = index;
+        records->nkeys++;
+    }
+    else
+        records->links[slot->last].next = index;
+    slot->last = index;
 }
 
+// records that are not checkpointed yet are newer than the image, the ones
+// of a block are laid over it in the order they were logged
+static void SLM_ApplyRecordsTo(SLM_JournalRecords *records, void *buf, size_t size, file_offset off) {
+    if(!records->nkeys || !size)
+        return;
 
-static inline void SLM_GetBlock(FileSystem *fs, block_index block, char buf[BLOCK_SIZE]) {
-    ReadFromFileAtOffset(&fs->file, buf, BLOCK_SIZE, BLOCK_BEGIN(block));
+    u32 last = SLM_JournalKey(off + size - 1);
+    for(u32 key = SLM_JournalKey(off); key <= last; ++key) {
+        SLM_JournalSlot *slot = SLM_FindJournalSlot(records, key);
+        for(u32 index = slot->first; index != UINT_MAX; index = records->links[index].next) {
+            SLM_JournalRecord *record = (SLM_JournalRecord*)(records->buf + records->links[index].pos);
+            file_offset begin = record->offset > off ? record->offset : off;
+            file_offset end = record->offset + record->size;
+            if(end > off + size)
+                end = off + size;
+
+            if(begin < end)
+                m_copy((char*)(record + 1) + (begin - record->offset), (char*)buf + (begin - off), end - begin);
+        }
+    }
 }
 
-typedef struct Block {
-    u32 in_use;
-    u32 used_before;
-    u32 prev;
-    u32 next;
-    char *content;
-} Block;
-
-static inline Block ParseBlock(char buf[BLOCK_SIZE]) {
-    Block result = { 0 };
+static void SLM_JournalAppend(FileSystem *fs, void *buf, size_t size, file_offset off) {
+    char *data = buf;
+    while(size) {
+        u32 chunk = MIN(size, SLM_JournalKeyEnd(SLM_JournalKey(off)) - off);
+        SLM_AddRecord(&fs->journal.pending, data, chunk, off);
+        SLM_MarkJournaled(fs, off, chunk);
 
-    u32 *_buf = (u32*)buf;
-    result.in_use = *_buf++;
-    result.used_before = *_buf++;
-    result.prev = *_buf++;
-    result.next = *_buf++;
-    result.content = buf;
+        data += chunk;
+        off += chunk;
+        size -= chunk;
+    }
+}
 
-    return result;
+// runs on the checkpointer. nothing else writes the blocks of the records
+// until it is waited for, and fs does not move meanwhile
+static void SLM_RunCheckpoint(void *data) {
+    FileSystem *fs = data;
+    SLM_JournalRecords *records = &fs->journal.checkpoint;
+    u32 pos = 0;
+    while(pos < records->used) {
+        SLM_JournalRecord *record = (SLM_JournalRecord*)(records->buf + pos);
+        WriteSharedStripesAtOffset(&fs->file, record + 1, record->size, record->offset);
+        pos += sizeof(SLM_JournalRecord) + record->size;
+    }
 }
 
-static SLM_File SLM_ReadFileMetaData(FileSystem *fs, block_index block) {
-    char buf[BLOCK_SIZE];
-    SLM_GetBlock(fs, block, buf);
+static void SLM_WaitCheckpoint(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    if(!journal->checkpoint.used)
+        return;
+    WaitWork(journal->checkpointer);
+    SLM_ClearRecords(&journal->checkpoint);
+}
 
-    Block block_data = ParseBlock(buf);
-    if(!block_data.in_use) {
-        // Invalid block, not in use
-        return (SLM_File){ 0 };
-    }
-    if(block_data.prev) {
-        // The block is not the initial block
-        return (SLM_File){ 0 };
+// outside a transaction a write in place may land on a block the
+// checkpoint in flight has still to write
+static int SLM_Write(FileSystem *fs, void *buf, size_t size, file_offset off) {
+    SLM_PreserveRange(fs, off, size);
+    SLM_MarkWritten(fs, off, size);
+    if(SLM_WritesInPlace(fs, off, size)) {
+        if(!fs->journal.active)
+            SLM_WaitCheckpoint(fs);
+        fs->journal.direct_writes |= fs->journal.active;
+        return WriteToStripesAtOffset(&fs->file, buf, size, off);
     }
 
-    SLM_File *block_contents = (SLM_File*)((char*)buf + BLOCK_METADATA);
-    return *block_contents;
+    SLM_JournalAppend(fs, buf, size, off);
+    return size;
 }
 
-static inline SLM_File SLM_ReadRoot(FileSystem *fs) {
-    return SLM_ReadFileMetaData(fs, fs->header.root);
+// the group being checkpointed is older than the pending records
+static inline void SLM_ApplyJournal(FileSystem *fs, void *buf, size_t size, file_offset off) {
+    SLM_ApplyRecordsTo(&fs->journal.checkpoint, buf, size, off);
+    SLM_ApplyRecordsTo(&fs->journal.pending, buf, size, off);
 }
 
-static inline size_t SLM_ReadUsedSize(FileSystem *fs, block_index file) {
-    size_t res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, used_size)));
+static int SLM_Read(FileSystem *fs, void *buf, size_t size, file_offset off) {
+    int res = SLM_ReadMirrored(fs, buf, size, off, 0);
+    SLM_ApplyJournal(fs, buf, size, off);
     return res;
 }
 
-static inline void SLM_ReadName(FileSystem *fs, block_index file, char *buf, size_t size) {
-    ReadFromFileAtOffset(&fs->file, buf, size, GlobalFileOffset(file, OffsetOf(SLM_File, name)));
+// safe to call from several threads as long as nothing is written meanwhile
+static int SLM_ReadShared(FileSystem *fs, void *buf, size_t size, file_offset off) {
+    int res = SLM_ReadMirrored(fs, buf, size, off, 1);
+    SLM_ApplyJournal(fs, buf, size, off);
+    return res;
 }
 
-static inline void SLM_ReadExt(FileSystem *fs, block_index file, char *buf, size_t size) {
-    ReadFromFileAtOffset(&fs->file, buf, size, GlobalFileOffset(file, OffsetOf(SLM_File, ext)));
+static inline void SLM_WriteHeader(FileSystem *fs) {
+    SLM_Write(fs, &fs->header, sizeof(fs->header), 0);
 }
 
-static inline void SLM_WriteUsedSize(FileSystem *fs, block_index file, size_t used_size) {
-    WriteToFileAtOffset(&fs->file, &used_size, sizeof(used_size), GlobalFileOffset(file, OffsetOf(SLM_File, used_size)));
+// inside a transaction the header is written once, at commit
+static inline void SLM_UpdateHeader(FileSystem *fs) {
+    if(fs->journal.active)
+        fs->journal.header_dirty = 1;
+    else
+        SLM_WriteHeader(fs);
 }
 
-static inline size_t SLM_ReadNBlocks(FileSystem *fs, block_index file) {
-    size_t res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, nblocks)));
-    return res;
+static inline void SLM_InvalidateReadahead(FileSystem *fs) {
+    fs->readahead.file = 0;
+    fs->readahead.count = 0;
 }
 
-static inline void SLM_WriteNBlocks(FileSystem *fs, block_index file, size_t nblocks) {
-    WriteToFileAtOffset(&fs->file, &nblocks, sizeof(nblocks), GlobalFileOffset(file, OffsetOf(SLM_File, nblocks)));
+static inline u32 SLM_BlockInUse(FileSystem *fs, block_index block) {
+    return (fs->bitmap[block >> 3] >> (block & 7)) & 1;
 }
 
-static inline block_index SLM_ReadNextBlockIndex(FileSystem *fs, block_index block) {
-    block_index res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), NEXT(block));
-    return res;
+// the journal, the snapshot table and the checksum table are not part of
+// the file system state
+static inline u32 SLM_IsReservedBlock(FileSystem *fs, block_index block) {
+    SLM_Header *header = &fs->header;
+    if(block >= header->journal_first && block < header->journal_first + header->journal_blocks)
+        return 1;
+    if(block >= header->checksums && block < fs->checksums.end && block % BLOCKS_PER_GROUP)
+        return 1;
+    return block >= header->snapshot_table && block < header->snapshot_table + SNAPSHOT_TABLE_BLOCKS;
 }
 
-static inline u32 SLM_ReadIsDirectory(FileSystem *fs, block_index file) {
-    u32 res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, is_directory)));
-    return res;
+// free blocks whose contents a snapshot still needs are not handed out, and
+// the copies and maps of the snapshots never take a block that a rollback
+// may write back
+static inline u32 SLM_BlockAvailable(FileSystem *fs, block_index block) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    u8 bit = 1 << (block & 7);
+    if(fs->bitmap[block >> 3] & bit)
+        return 0;
+    if(!snapshots->table.count)
+        return 1;
+    if(snapshots->bypass && (snapshots->targets[block >> 3] & bit))
+        return 0;
+    return !(snapshots->frozen[block >> 3] & bit) || (snapshots->saved[block >> 3] & bit);
 }
 
-static inline block_index SLM_ReadParent(FileSystem *fs, block_index file) {
-    block_index res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, parent)));
-    return res;
+static void SLM_MarkBlock(FileSystem *fs, block_index block, u32 in_use) {
+    u32 group = block / BLOCKS_PER_GROUP;
+    if(in_use) {
+        fs->bitmap[block >> 3] |= 1 << (block & 7);
+        fs->group_free[group]--;
+
+        // a truncate pass has seen every block from its cursor on free
+        if(fs->header.defrag_phase == DEFRAG_TRUNCATE && block >= fs->header.defrag_cursor)
+            fs->header.defrag_cursor = block + 1;
+    }
+    else {
+        fs->bitmap[block >> 3] &= ~(1 << (block & 7));
+        fs->group_free[group]++;
+    }
+
+    if(fs->bitmap_dirty_first > fs->bitmap_dirty_last) {
+        fs->bitmap_dirty_first = block;
+        fs->bitmap_dirty_last = block;
+    }
+    else if(block < fs->bitmap_dirty_first)
+        fs->bitmap_dirty_first = block;
+    else if(block > fs->bitmap_dirty_last)
+        fs->bitmap_dirty_last = block;
 }
 
-static inline void SLM_WriteParent(FileSystem *fs, block_index file, block_index parent) {
-    WriteToFileAtOffset(&fs->file, &parent, sizeof(parent), GlobalFileOffset(file, OffsetOf(SLM_File, parent)));
+// the copy a snapshot takes of a group bitmap before it is written claims
+// a block too, its bit is written in another round
+static void SLM_WriteBitmap(FileSystem *fs) {
+    while(fs->bitmap_dirty_first <= fs->bitmap_dirty_last) {
+        block_index dirty_first = fs->bitmap_dirty_first;
+        block_index dirty_last = fs->bitmap_dirty_last;
+        fs->bitmap_dirty_first = 1;
+        fs->bitmap_dirty_last = 0;
+
+        u32 first_group = dirty_first / BLOCKS_PER_GROUP;
+        u32 last_group = dirty_last / BLOCKS_PER_GROUP;
+        for(u32 group = first_group; group <= last_group; ++group) {
+            block_index group_begin = group * BLOCKS_PER_GROUP;
+            block_index first = group == first_group ? dirty_first : group_begin;
+            block_index last = group == last_group ? dirty_last : group_begin + BLOCKS_PER_GROUP - 1;
+
+            u32 first_byte = (first - group_begin) >> 3;
+            u32 last_byte = (last - group_begin) >> 3;
+            SLM_PreserveBitmap(fs, group_begin);
+            SLM_Write(fs, fs->bitmap + (first >> 3), last_byte - first_byte + 1, GlobalFileOffset(group_begin, first_byte));
+        }
+    }
 }
 
-static inline void SLM_WriteSelf(FileSystem *fs, block_index file) {
-    WriteToFileAtOffset(&fs->file, &file, sizeof(file), GlobalFileOffset(file, OffsetOf(SLM_File, self)));
+// inside a transaction the dirty range only grows until commit
+static inline void SLM_FlushBitmap(FileSystem *fs) {
+    if(!fs->journal.active)
+        SLM_WriteBitmap(fs);
 }
 
-static inline void SLM_WriteContentOffset(FileSystem *fs, block_index file) {
-    file_offset off = GlobalFileOffset(file, INIT_USED_SIZE);
-    WriteToFileAtOffset(&fs->file, &off, sizeof(off), GlobalFileOffset(file, OffsetOf(SLM_File, content)));
+// the checksum table was reserved in one run, save for the group bitmaps in
+// its way
+static block_index SLM_ChecksumBlock(FileSystem *fs, u32 index) {
+    block_index first = fs->header.checksums;
+    block_index block = first + index;
+    for(block_index bitmap = (first / BLOCKS_PER_GROUP + 1) * BLOCKS_PER_GROUP; bitmap <= block; bitmap += BLOCKS_PER_GROUP)
+        block++;
+    return block;
 }
 
-static inline size_t SLM_GetAvailableSize(SLM_File file) {
-    return file.nblocks * USABLE_BLOCK_SIZE - file.used_size;
+static inline file_offset SLM_ChecksumOffset(FileSystem *fs, block_index block) {
+    return GlobalFileOffset(SLM_ChecksumBlock(fs, block / CHECKSUMS_PER_BLOCK), (block % CHECKSUMS_PER_BLOCK) * sizeof(u32));
 }
 
-static inline block_index SLM_GetLastBlock(FileSystem *fs, block_index base_block) {
-    block_index next_block = base_block;
-    while(SLM_ReadNextBlockIndex(fs, next_block) != 0) {
-        next_block = SLM_ReadNextBlockIndex(fs, next_block);
-    }
-    return next_block;
+static inline void SLM_LocateChecksums(FileSystem *fs) {
+    if(fs->header.checksums)
+        fs->checksums.end = SLM_ChecksumBlock(fs, CHECKSUM_TABLE_BLOCKS(fs->header.total_blocks) - 1) + 1;
 }
 
-static inline block_index SLM_GetNthBlock(FileSystem *fs, block_index base_block, u32 n) {
-    block_index next_block = base_block;
-    u32 index = 1;
-    while(SLM_ReadNextBlockIndex(fs, next_block) != 0) {
-        if(index == n)
-            break;
-        next_block = SLM_ReadNextBlockIndex(fs, next_block);
-        index++;
+// 0 stands for a block whose checksum is not known
+static u32 SLM_BlockChecksum(char *block) {
+    u32 *words = (u32*)block;
+    u32 hash = 2166136261u;
+    for(u32 i = 0; i < BLOCK_SIZE / sizeof(u32); ++i) {
+        hash ^= words[i];
+        hash *= 16777619u;
     }
-    return next_block;
+    return hash ? hash : 1;
 }
 
-static inline file_offset SLM_GetFileOffset(FileSystem *fs, block_index file) {
-    size_t used_size = SLM_ReadUsedSize(fs, file);
-    used_size += BLOCK_METADATA * SLM_ReadNBlocks(fs, file);
+// a block written is not checked again before its checksum is stored
+static void SLM_MarkWritten(FileSystem *fs, file_offset off, size_t size) {
+    SLM_Checksums *checksums = &fs->checksums;
+    if(!fs->header.checksums || off + size <= sizeof(SLM_Header))
+        return;
+    if(off < sizeof(SLM_Header)) {
+        size -= sizeof(SLM_Header) - off;
+        off = sizeof(SLM_Header);
+    }
 
-    block_index next_block = file;
-    while(used_size >= BLOCK_SIZE) {
-        next_block = SLM_ReadNextBlockIndex(fs, next_block);
-        used_size -= BLOCK_SIZE;
+    block_index first = (off - sizeof(SLM_Header)) / BLOCK_SIZE;
+    block_index last = (off + size - 1 - sizeof(SLM_Header)) / BLOCK_SIZE;
+    last = MIN(last, (block_index)fs->header.total_blocks - 1);
+    if(first > last)
+        return;
+    for(block_index block = first; block <= last; ++block) {
+        if(SLM_IsReservedBlock(fs, block))
+            continue;
+        u8 bit = 1 << (block & 7);
+        checksums->dirty[block >> 3] |= bit;
+        checksums->verified[0][block >> 3] &= ~bit;
+        checksums->verified[1][block >> 3] &= ~bit;
     }
 
-    return GlobalFileOffset(next_block, used_size) - BLOCK_METADATA;
+    if(checksums->dirty_first > checksums->dirty_last) {
+        checksums->dirty_first = first;
+        checksums->dirty_last = last;
+    }
+    else {
+        checksums->dirty_first = MIN(checksums->dirty_first, first);
+        checksums->dirty_last = MAX(checksums->dirty_last, last);
+    }
 }
 
-static void SLM_WriteToFile(FileSystem *fs, block_index base_block, char *data, size_t size) {
-    SLM_File file = SLM_ReadFileMetaData(fs, base_block);
-    size_t available_size = SLM_GetAvailableSize(file);
-
-    block_index next_block;
-    if(available_size < size) {
-        size_t additional_blocks = RoundUpDivision(size - available_size, USABLE_BLOCK_SIZE);
-        file.nblocks += additional_blocks;
-        next_block = SLM_ReserveBlocks(fs, RoundUpDivision(size - available_size, USABLE_BLOCK_SIZE));
-        block_index prev_last_block = SLM_GetLastBlock(fs, base_block);
-        WriteToFileAtOffset(&fs->file, &next_block, sizeof(next_block), NEXT(prev_last_block));
-        WriteToFileAtOffset(&fs->file, &prev_last_block, sizeof(prev_last_block), PREV(next_block));
-    }
+// the checksums of the blocks written since the last commit go into the
+// group being committed, taken over the blocks with its records applied
+static void SLM_StoreChecksums(FileSystem *fs) {
+    SLM_Checksums *checksums = &fs->checksums;
+    char buf[CHECKSUM_RUN_BLOCKS * BLOCK_SIZE];
+    u32 sums[CHECKSUM_RUN_BLOCKS];
+
+    block_index block = checksums->dirty_first;
+    while(block <= checksums->dirty_last) {
+        if(!(block & 7) && !checksums->dirty[block >> 3]) {
+            block += 8;
+            continue;
+        }
+        if(!(checksums->dirty[block >> 3] & (1 << (block & 7)))) {
+            block++;
+            continue;
+        }
 
-    size_t size_to_write = MIN(size, available_size);
-    file_offset write_at = SLM_GetFileOffset(fs, base_block);
-    WriteToFileAtOffset(&fs->file, data, size_to_write, write_at);
-    size_t written_size = size_to_write;
+        // a run of written blocks whose checksums share a block
+        u32 count = 1;
+        while(count < CHECKSUM_RUN_BLOCKS && block + count <= checksums->dirty_last && (block + count) % CHECKSUMS_PER_BLOCK &&
+              (checksums->dirty[(block + count) >> 3] & (1 << ((block + count) & 7))))
+            count++;
 
-    if(size_to_write < size) {
-        while(written_size < size) {
-            write_at = CONTENT(next_block);
-            size_to_write = MIN(size - size_to_write, USABLE_BLOCK_SIZE);
-            WriteToFileAtOffset(&fs->file, data + written_size, size_to_write, write_at);
-            written_size += size_to_write;
-            next_block = SLM_ReadNextBlockIndex(fs, next_block);
+        SLM_Read(fs, buf, count * BLOCK_SIZE, BLOCK_BEGIN(block));
+        for(u32 i = 0; i < count; ++i) {
+            sums[i] = SLM_BlockChecksum(buf + i * BLOCK_SIZE);
+            checksums->dirty[(block + i) >> 3] &= ~(1 << ((block + i) & 7));
         }
+        SLM_Write(fs, sums, count * sizeof(u32), SLM_ChecksumOffset(fs, block));
+        block += count;
     }
 
-    file.used_size += written_size;
-    SLM_WriteUsedSize(fs, base_block, file.used_size);
-    SLM_WriteNBlocks(fs, base_block, file.nblocks);
+    checksums->dirty_first = 1;
+    checksums->dirty_last = 0;
 }
 
-static void SLM_WriteToFileAtOffset(FileSystem *fs, block_index base_block, char *data, size_t size, file_offset off) {
-    SLM_File file = SLM_ReadFileMetaData(fs, base_block);
-    off += INIT_USED_SIZE;
-    if(off > file.used_size)
-        return;
-
-    size_t overflowed_size = (off + size > file.used_size) ? (off + size - file.used_size) : 0;
-
-    u32 block_containing_off = RoundUpDivision(off, USABLE_BLOCK_SIZE);
-    u32 offset_in_block = (off - (USABLE_BLOCK_SIZE * (block_containing_off - 1)));
-    size_t available_size_in_block = USABLE_BLOCK_SIZE - offset_in_block;
-    size_t total_available_size = file.used_size - off;
+static inline u32 SLM_HasRecords(SLM_JournalRecords *records, u32 key) {
+    return records->nkeys && SLM_FindJournalSlot(records, key)->first != UINT_MAX;
+}
 
-    if(total_available_size < size) {
-        size_t additional_blocks = RoundUpDivision(size - total_available_size, USABLE_BLOCK_SIZE);
-        file.nblocks += additional_blocks;
-        block_index next_block = SLM_ReserveBlocks(fs, RoundUpDivision(size - total_available_size, USABLE_BLOCK_SIZE));
-        block_index prev_last_block = SLM_GetLastBlock(fs, base_block);
-        WriteToFileAtOffset(&fs->file, &next_block, sizeof(next_block), NEXT(prev_last_block));
-        WriteToFileAtOffset(&fs->file, &prev_last_block, sizeof(prev_last_block), PREV(next_block));
-    }
+// a block with records in the journal is not on disk as its checksum has
+// it yet
+static u32 SLM_NeedsCheck(FileSystem *fs, block_index block) {
+    u8 bit = 1 << (block & 7);
+    if(block >= fs->header.total_blocks || SLM_IsReservedBlock(fs, block) || !SLM_BlockInUse(fs, block))
+        return 0;
+    if((fs->checksums.dirty[block >> 3] & bit) || (fs->checksums.verified[0][block >> 3] & fs->checksums.verified[1][block >> 3] & bit))
+        return 0;
+    return !SLM_HasRecords(&fs->journal.pending, block + 1) && !SLM_HasRecords(&fs->journal.checkpoint, block + 1);
+}
 
-    size_t size_to_write = MIN(size, available_size_in_block);
-    block_index write_in_block = SLM_GetNthBlock(fs, base_block, block_containing_off);
-    file_offset write_at = GlobalFileOffset(write_in_block, offset_in_block);
-    WriteToFileAtOffset(&fs->file, data, size_to_write, write_at);
-    size_t written_size = size_to_write;
+static inline u32 SLM_NeedsCheckOn(FileSystem *fs, block_index block, u32 side) {
+    return !(fs->checksums.verified[side][block >> 3] & (1 << (block & 7))) && SLM_NeedsCheck(fs, block);
+}
 
-    if(size_to_write < size) {
-        write_in_block = SLM_ReadNextBlockIndex(fs, write_in_block);
-        while(written_size < size) {
-            write_at = CONTENT(write_in_block);
-            size_to_write = MIN(size - written_size, USABLE_BLOCK_SIZE);
-            WriteToFileAtOffset(&fs->file, data + written_size, size_to_write, write_at);
-            written_size += size_to_write;
-            write_in_block = SLM_ReadNextBlockIndex(fs, write_in_block);
-        }
+// the copy a read from first to last goes to so that it checks a copy not
+// checked yet, taking turns by block while neither is. UINT_MAX if both
+// copies of every block it covers are checked
+static u32 SLM_UncheckedSide(FileSystem *fs, block_index first, block_index last) {
+    for(block_index block = first; block <= last; ++block) {
+        if(!SLM_NeedsCheck(fs, block))
+            continue;
+        u8 bit = 1 << (block & 7);
+        if(fs->checksums.verified[0][block >> 3] & bit)
+            return 1;
+        if(fs->checksums.verified[1][block >> 3] & bit)
+            return 0;
+        return block & 1;
     }
+    return UINT_MAX;
+}
 
-    file.used_size += overflowed_size;
-    SLM_WriteUsedSize(fs, base_block, file.used_size);
-    SLM_WriteNBlocks(fs, base_block, file.nblocks);
+// shared readers run side by side, they set the bits as u32 words
+static inline void SLM_MarkVerified(FileSystem *fs, u32 side, block_index block, u32 shared) {
+    if(shared)
+        AtomicOr((volatile u32*)fs->checksums.verified[side] + (block >> 5), 1 << (block & 31));
+    else
+        fs->checksums.verified[side][block >> 3] |= 1 << (block & 7);
 }
 
-static void SLM_ReadFromFileAtOffset(FileSystem *fs, block_index base_block, char *buf, size_t size, file_offset off) {
-    SLM_File file = SLM_ReadFileMetaData(fs, base_block);
-    off += INIT_USED_SIZE;
-    if(off > file.used_size)
+// a block the copy on side does not match is taken from the other copy if
+// that one does, and outside a shared read the bad copy is rewritten with
+// it. a block neither copy matches is left as it was read
+static void SLM_RepairBlock(FileSystem *fs, u32 side, block_index block, u32 sum, char *buf, size_t size, file_offset off, u32 shared) {
+    char data[BLOCK_SIZE];
+    file_offset begin = BLOCK_BEGIN(block);
+    if(ReadStripeCopyAtOffset(&fs->file, !side, data, BLOCK_SIZE, begin) != BLOCK_SIZE || SLM_BlockChecksum(data) != sum) {
+        SLM_MarkVerified(fs, 0, block, shared);
+        SLM_MarkVerified(fs, 1, block, shared);
         return;
+    }
 
-    u32 block_containing_off = RoundUpDivision(off, USABLE_BLOCK_SIZE);
-    u32 offset_in_block = (off - (USABLE_BLOCK_SIZE * (block_containing_off - 1)));
-    size_t available_size_in_block = USABLE_BLOCK_SIZE - offset_in_block;
-    size_t total_available_size = file.used_size - off;
-
-    size_t total_size_to_read = MIN(total_available_size, size);
-    size_t size_to_read = MIN(available_size_in_block, size);
-
-    block_index read_from_block = SLM_GetNthBlock(fs, base_block, block_containing_off);
-    file_offset read_from = GlobalFileOffset(read_from_block, offset_in_block);
-    ReadFromFileAtOffset(&fs->file, buf, size_to_read, read_from);
+    file_offset lo = MAX(begin, off), hi = MIN(begin + BLOCK_SIZE, off + size);
+    MemCopy(buf + (lo - off), data + (lo - begin), hi - lo);
+    SLM_MarkVerified(fs, !side, block, shared);
+    if(!shared) {
+        WriteStripeCopyAtOffset(&fs->file, side, data, BLOCK_SIZE, begin);
+        SLM_MarkVerified(fs, side, block, 0);
+    }
+}
 
-    size_t size_read = size_to_read;
+// checks count blocks read from the copy on side against their checksums,
+// in buf where it holds the whole block and in a read of the block from
+// the same copy where it does not
+static void SLM_VerifyRun(FileSystem *fs, u32 side, block_index first, u32 count, char *buf, size_t size, file_offset off, u32 shared) {
+    u32 sums[CHECKSUM_RUN_BLOCKS];
+    if(shared)
+        SLM_ReadShared(fs, sums, count * sizeof(u32), SLM_ChecksumOffset(fs, first));
+    else
+        SLM_Read(fs, sums, count * sizeof(u32), SLM_ChecksumOffset(fs, first));
+
+    for(u32 i = 0; i < count; ++i) {
+        block_index block = first + i;
+        file_offset begin = BLOCK_BEGIN(block);
+        file_offset lo = MAX(begin, off), hi = MIN(begin + BLOCK_SIZE, off + size);
+        char data[BLOCK_SIZE];
+        char *read = buf + (lo - off);
+        int res = BLOCK_SIZE;
+        if(sums[i] && (lo != begin || hi != begin + BLOCK_SIZE)) {
+            read = data;
+            res = ReadStripeCopyAtOffset(&fs->file, side, data, BLOCK_SIZE, begin);
+        }
 
-    if(size_read < total_size_to_read) {
-        read_from_block = SLM_ReadNextBlockIndex(fs, read_from_block);
-        while(size_read < total_size_to_read) {
-            read_from = CONTENT(read_from_block);
-            size_to_read = MIN(total_size_to_read - size_read, USABLE_BLOCK_SIZE);
-            ReadFromFileAtOffset(&fs->file, buf + size_read, size_to_read, read_from);
+        if(!sums[i] || (res == BLOCK_SIZE && SLM_BlockChecksum(read) == sums[i]))
+            SLM_MarkVerified(fs, side, block, shared);
+        else
+            SLM_RepairBlock(fs, side, block, sums[i], buf, size, off, shared);
+    }
+}
 
-            size_read += size_to_read;
-            read_from_block = SLM_ReadNextBlockIndex(fs, read_from_block);
-        }
+// a mirrored image checks each copy of a block against its checksum the
+// first time it is read after the block was written. a read covering a
+// copy not checked yet goes to that copy alone instead of being balanced,
+// the other copy is only read for a block that does not match
+static int SLM_ReadMirrored(FileSystem *fs, char *buf, size_t size, file_offset off, u32 shared) {
+    u32 side = UINT_MAX;
+    block_index block = 0, last = 0;
+    if(fs->header.checksums && fs->file.mirrored && off + size > sizeof(SLM_Header)) {
+        file_offset begin = MAX(off, sizeof(SLM_Header));
+        block = (begin - sizeof(SLM_Header)) / BLOCK_SIZE;
+        last = (off + size - 1 - sizeof(SLM_Header)) / BLOCK_SIZE;
+        side = SLM_UncheckedSide(fs, block, last);
     }
 
-}
+    // a copy that cannot be read is left to the fallback of a balanced read
+    int res = -1;
+    if(side != UINT_MAX)
+        res = ReadStripeCopyAtOffset(&fs->file, side, buf, size, off);
+    if(res < (int)size)
+        return shared ? ReadSharedStripesAtOffset(&fs->file, buf, size, off) : ReadFromStripesAtOffset(&fs->file, buf, size, off);
+
+    while(block <= last) {
+        if(!SLM_NeedsCheckOn(fs, block, side)) {
+            block++;
+            continue;
+        }
 
-static inline u32 SLM_ReadNEntries(FileSystem *fs, block_index directory) {
-    u32 res;
-    ReadFromFileAtOffset(&fs->file, &res, sizeof(res), GlobalFileOffset(directory, INIT_USED_SIZE));
+        u32 count = 1;
+        while(count < CHECKSUM_RUN_BLOCKS && block + count <= last && (block + count) % CHECKSUMS_PER_BLOCK && SLM_NeedsCheckOn(fs, block + count, side))
+            count++;
+        SLM_VerifyRun(fs, side, block, count, buf, size, off, shared);
+        block += count;
+    }
     return res;
 }
 
-static inline void SLM_WriteNEntries(FileSystem *fs, block_index directory, u32 nentries) {
-    WriteToFileAtOffset(&fs->file, &nentries, sizeof(nentries), GlobalFileOffset(directory, INIT_USED_SIZE));
-}
-
-static inline void SLM_WriteFileName(FileSystem *fs, block_index file, char *name) {
-    WriteToFileAtOffset(&fs->file, name, 128, GlobalFileOffset(file, OffsetOf(SLM_File, name)));
+static void SLM_ApplyRecords(FileSystem *fs, char *records, u32 size) {
+    u32 pos = 0;
+    while(pos < size) {
+        SLM_JournalRecord *record = (SLM_JournalRecord*)(records + pos);
+        WriteToStripesAtOffset(&fs->file, record + 1, record->size, record->offset);
+        pos += sizeof(SLM_JournalRecord) + record->size;
+    }
 }
 
-static inline SLM_DirectoryEntry SLM_ReadEntry(FileSystem *fs, block_index directory, u32 index) {
-    SLM_DirectoryEntry entry;
-    SLM_ReadFromFileAtOffset(fs, directory, (void*)&entry, sizeof(entry), index * sizeof(SLM_DirectoryEntry) + sizeof(u32));
-    return entry;
+// starts a new round at the beginning of the region once everything the
+// previous rounds logged is on disk in place
+static void SLM_WrapJournal(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_WaitCheckpoint(fs);
+    SyncStripes(&fs->file);
+
+    SLM_JournalSuper super = { JOURNAL_MAGIC, journal->sequence, 0 };
+    WriteToStripesAtOffset(&fs->file, &super, sizeof(super), SLM_JournalBegin(fs));
+    SyncStripes(&fs->file);
+    journal->head = 0;
+    journal->direct_writes = 0;
+
+    MemSet(journal->journaled, 0, fs->ngroups * USABLE_BLOCK_SIZE);
+
+    u32 pos = 0;
+    while(pos < journal->pending.used) {
+        SLM_JournalRecord *record = (SLM_JournalRecord*)(journal->pending.buf + pos);
+        SLM_MarkJournaled(fs, record->offset, record->size);
+        pos += sizeof(SLM_JournalRecord) + record->size;
+    }
 }
 
-static block_index SLM_GetChild(FileSystem *fs, block_index directory, char *child_name) {
-    u32 nentries = SLM_ReadNEntries(fs, directory);
-    for(u32 i = 0; i < nentries; ++i) {
-        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, directory, i);
-        if(_strcmp(entry.name, child_name))
-            return entry.base_block;
+// blocks free at the last commit and now that no record points at and no
+// snapshot needs, 0 if there is none left from first on
+static block_index SLM_FindOverflowBlock(FileSystem *fs, block_index first) {
+    SLM_Journal *journal = &fs->journal;
+    for(block_index block = first; block < fs->header.total_blocks; ++block) {
+        u8 bit = 1 << (block & 7);
+        if((journal->committed[block >> 3] & bit) || (journal->journaled[block >> 3] & bit))
+            continue;
+        if(SLM_BlockAvailable(fs, block))
+            return block;
     }
     return 0;
 }
 
-static void SLM_DirectoryAddEntry(FileSystem *fs, block_index directory, SLM_DirectoryEntry *entry) {
-    SLM_File directory_metadata = SLM_ReadFileMetaData(fs, directory);
-    Assert(directory_metadata.is_directory);
+// a group larger than the region goes to a chain of blocks nothing
+// committed uses, named by the super block. the round before it is closed
+// first so that replay starts at this group, and it is checkpointed and the
+// journal wrapped right away, before any of those blocks is handed out.
+// returns 0 without writing anything if the image is too full to hold the
+// chain
+static u32 SLM_CommitOverflow(FileSystem *fs, SLM_JournalGroup *group) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_JournalRecords *pending = &journal->pending;
+    u32 payload = BLOCK_SIZE - sizeof(block_index);
+    u32 total = sizeof(SLM_JournalGroup) + pending->used;
+    SLM_WrapJournal(fs);
+
+    block_index block = 0;
+    for(u32 pos = 0; pos < total; pos += payload) {
+        block = SLM_FindOverflowBlock(fs, block + 1);
+        if(!block)
+            return 0;
+    }
 
-    u32 nentries = SLM_ReadNEntries(fs, directory);
-    if(nentries == 0) {
-        SLM_WriteToFile(fs, directory, (void*)&nentries, sizeof(nentries));
+    SLM_JournalSuper super = { JOURNAL_MAGIC, journal->sequence, SLM_FindOverflowBlock(fs, 1) };
+    block_index next = super.overflow;
+    char data[BLOCK_SIZE];
+    for(u32 pos = 0; pos < total; pos += payload) {
+        block = next;
+        u32 chunk = MIN(payload, total - pos);
+        next = pos + chunk < total ? SLM_FindOverflowBlock(fs, block + 1) : 0;
+
+        // the first block starts with the group, the records follow it
+        u32 head = pos < sizeof(SLM_JournalGroup) ? MIN(chunk, sizeof(SLM_JournalGroup) - pos) : 0;
+        *(block_index*)data = next;
+        m_copy((char*)group + pos, data + sizeof(block_index), head);
+        m_copy(pending->buf + pos + head - sizeof(SLM_JournalGroup), data + sizeof(block_index) + head, chunk - head);
+        WriteToStripesAtOffset(&fs->file, data, sizeof(block_index) + chunk, BLOCK_BEGIN(block));
     }
+    SyncStripes(&fs->file);
 
-    SLM_WriteToFile(fs, directory, (void*)entry, sizeof(*entry));
-    SLM_WriteNEntries(fs, directory, ++nentries);
+    WriteToStripesAtOffset(&fs->file, &super, sizeof(super), SLM_JournalBegin(fs));
+    SyncStripes(&fs->file);
+
+    SLM_ApplyRecords(fs, pending->buf, pending->used);
+    journal->sequence++;
+    SLM_ClearRecords(pending);
+    SLM_WrapJournal(fs);
+    return 1;
 }
 
-static inline void SLM_ReplaceEntry(FileSystem *fs, block_index directory, u32 index, SLM_DirectoryEntry *entry) {
-    SLM_WriteToFileAtOffset(fs, directory, (char*)entry, sizeof(*entry), index * sizeof(SLM_DirectoryEntry) + sizeof(u32));
+// drops the pending records and takes what is kept in memory back to the
+// last commit. blocks the dropped transactions wrote in place were free
+// then and are free again
+static void SLM_DiscardGroup(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_ClearRecords(&journal->pending);
+    journal->header_dirty = 0;
+    SLM_InvalidateReadahead(fs);
+    SLM_IndexDiscard(fs);
+
+    SLM_Read(fs, &fs->header, sizeof(fs->header), 0);
+    m_copy(journal->committed, fs->bitmap, fs->ngroups * USABLE_BLOCK_SIZE);
+    fs->bitmap_dirty_first = 1;
+    fs->bitmap_dirty_last = 0;
+    SLM_CountFreeBlocks(fs);
+
+    SLM_Read(fs, &fs->snapshots.table, sizeof(fs->snapshots.table), BLOCK_BEGIN(fs->header.snapshot_table));
+    SLM_LoadSnapshotState(fs);
 }
 
-static void SLM_DirectoryRemoveEntry(FileSystem *fs, block_index directory, block_index base_block) {
-    u32 is_directory = SLM_ReadIsDirectory(fs, directory);
-    Assert(is_directory);
+// reads the group of the chain at overflow back into buf, returns 0 if it
+// is not the group replay expects next or is torn
+static u32 SLM_ReadOverflow(FileSystem *fs, block_index overflow, SLM_JournalGroup *group) {
+    SLM_Journal *journal = &fs->journal;
+    u32 payload = BLOCK_SIZE - sizeof(block_index);
+    char data[BLOCK_SIZE];
+
+    block_index block = overflow;
+    u32 total = sizeof(SLM_JournalGroup);
+    for(u32 pos = 0; pos < total; pos += payload) {
+        if(!block || block >= fs->header.total_blocks)
+            return 0;
+        ReadFromStripesAtOffset(&fs->file, data, BLOCK_SIZE, BLOCK_BEGIN(block));
+
+        if(!pos) {
+            m_copy(data + sizeof(block_index), group, sizeof(SLM_JournalGroup));
+            if(group->magic != JOURNAL_MAGIC || group->sequence != journal->sequence)
+                return 0;
+            if(group->size / payload >= fs->header.total_blocks)
+                return 0;
+            total += group->size;
+            SLM_ReserveRecords(&journal->pending, group->size);
+        }
 
-    int i;
-    u32 nentries = SLM_ReadNEntries(fs, directory);
-    for(i = 0; i < nentries; ++i) {
-        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, directory, i);
-        if(entry.base_block == base_block)
-            break;
+        u32 chunk = MIN(payload, total - pos);
+        u32 head = pos < sizeof(SLM_JournalGroup) ? MIN(chunk, sizeof(SLM_JournalGroup) - pos) : 0;
+        m_copy(data + sizeof(block_index) + head, journal->pending.buf + pos + head - sizeof(SLM_JournalGroup), chunk - head);
+        block = *(block_index*)data;
     }
+    return SLM_JournalChecksum(group->sequence, journal->pending.buf, group->size) == group->checksum;
+}
 
-    for(; i < nentries - 1; ++i) {
-        SLM_DirectoryEntry next_entry = SLM_ReadEntry(fs, directory, i + 1);
-        SLM_ReplaceEntry(fs, directory, i, &next_entry);
+// writes the pending records as one group, syncs it and hands them to the
+// checkpointer. data written in place by the group's transactions is synced first so a
+// replayed group never points at blocks that did not make it to disk.
+// returns 0 if the group did not fit in the image, its transactions are
+// undone
+static u32 SLM_CommitGroup(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_JournalRecords *pending = &journal->pending;
+    u32 active = journal->active;
+    journal->active = 1;
+    SLM_WriteBitmap(fs);
+    if(journal->header_dirty)
+        SLM_WriteHeader(fs);
+    journal->header_dirty = 0;
+    SLM_StoreChecksums(fs);
+    journal->active = active;
+    journal->ntransactions = 0;
+
+    if(!pending->used)
+        return 1;
+
+    if(journal->direct_writes) {
+        SyncStripes(&fs->file);
+        journal->direct_writes = 0;
     }
+
+    SLM_JournalGroup group;
+    group.magic = JOURNAL_MAGIC;
+    group.sequence = journal->sequence;
+    group.size = pending->used;
+    group.checksum = SLM_JournalChecksum(group.sequence, pending->buf, pending->used);
+    if(pending->used > SLM_JournalCapacity(fs)) {
+        if(!SLM_CommitOverflow(fs, &group)) {
+            SLM_DiscardGroup(fs);
+            return 0;
+        }
+        m_copy(fs->bitmap, journal->committed, fs->ngroups * USABLE_BLOCK_SIZE);
+        return 1;
+    }
+
+    u32 size = sizeof(SLM_JournalGroup) + pending->used;
+    if(sizeof(SLM_JournalSuper) + journal->head + size > SLM_JournalSize(fs))
+        SLM_WrapJournal(fs);
+
+    write_buffer buffers[2] = { { &group, sizeof(group) }, { pending->buf, pending->used } };
+    WriteGatherToStripes(&fs->file, buffers, 2, SLM_JournalBegin(fs) + sizeof(SLM_JournalSuper) + journal->head);
+    SyncStripes(&fs->file);
+
+    // the group stays in the journal until the next wrap, the checkpoint
+    // does not need to reach the disk before then and is written in the
+    // background. the previous one is done by now more often than not
+    SLM_WaitCheckpoint(fs);
+    SLM_JournalRecords records = journal->checkpoint;
+    journal->checkpoint = *pending;
+    *pending = records;
+    PostWork(journal->checkpointer, SLM_RunCheckpoint, fs);
+
+    journal->head += size;
+    journal->sequence++;
+    m_copy(fs->bitmap, journal->committed, fs->ngroups * USABLE_BLOCK_SIZE);
+    return 1;
+}
+
+void SLM_BeginTransaction(FileSystem *fs) {
+    fs->journal.active = 1;
+}
+
+// transactions are committed in groups, so that a burst of small
+// operations pays for one sync. returns 0 if the group was undone
+u32 SLM_EndTransaction(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_FlushSubtreeDeltas(fs);
+    SLM_IndexFlush(fs);
+    journal->active = 0;
+    journal->ntransactions++;
+
+    if(journal->ntransactions >= JOURNAL_GROUP_TRANSACTIONS || journal->pending.used >= SLM_JournalCapacity(fs) / 8)
+        return SLM_CommitGroup(fs);
+    return 1;
+}
+
+// commits whatever is pending and waits for it to be on disk and
+// checkpointed. returns 0 if the group was undone
+u32 SLM_Sync(FileSystem *fs) {
+    u32 res = SLM_CommitGroup(fs);
+    SLM_WaitCheckpoint(fs);
+    if(fs->journal.direct_writes) {
+        SyncStripes(&fs->file);
+        fs->journal.direct_writes = 0;
+    }
+    return res;
+}
+
+static void SLM_InitJournal(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    u32 ngroups = RoundUpDivision(fs->header.total_blocks, BLOCKS_PER_GROUP);
+    SLM_InitRecords(&journal->pending, SLM_JournalCapacity(fs));
+    SLM_InitRecords(&journal->checkpoint, SLM_JournalCapacity(fs));
+    journal->checkpointer = StartWorkers(1);
+    journal->committed = MemAlloc(ngroups * USABLE_BLOCK_SIZE);
+    journal->journaled = MemAlloc(ngroups * USABLE_BLOCK_SIZE);
+}
+
+// applies the groups committed since the last wrap in order, up to the
+// first one that is missing or torn. returns 0 if the region has no super
+// block, the groups it held are lost and the image may be half checkpointed
+static u32 SLM_ReplayJournal(FileSystem *fs) {
+    SLM_Journal *journal = &fs->journal;
+    SLM_JournalSuper super;
+    ReadFromStripesAtOffset(&fs->file, &super, sizeof(super), SLM_JournalBegin(fs));
+    if(super.magic != JOURNAL_MAGIC)
+        return 0;
+    journal->sequence = super.start_sequence;
+
+    SLM_JournalGroup group;
+    if(super.overflow && SLM_ReadOverflow(fs, super.overflow, &group)) {
+        SLM_ApplyRecords(fs, journal->pending.buf, group.size);
+        journal->sequence++;
+    }
+
+    u32 pos = sizeof(SLM_JournalSuper);
+    while(pos + sizeof(group) <= SLM_JournalSize(fs)) {
+        ReadFromStripesAtOffset(&fs->file, &group, sizeof(group), SLM_JournalBegin(fs) + pos);
+        if(group.magic != JOURNAL_MAGIC || group.sequence != journal->sequence)
+            break;
+        if(group.size > SLM_JournalSize(fs) - pos - sizeof(group))
+            break;
+        SLM_ReserveRecords(&journal->pending, group.size);
+
+        ReadFromStripesAtOffset(&fs->file, journal->pending.buf, group.size, SLM_JournalBegin(fs) + pos + sizeof(group));
+        if(SLM_JournalChecksum(group.sequence, journal->pending.buf, group.size) != group.checksum)
+            break;
+
+        SLM_ApplyRecords(fs, journal->pending.buf, group.size);
+        pos += sizeof(group) + group.size;
+        journal->sequence++;
+    }
+
+    SLM_WrapJournal(fs);
+    return 1;
+}
+
+// first free block in [first, end), 0 if there is none
+static block_index SLM_ScanBitmap(FileSystem *fs, block_index first, block_index end) {
+    block_index block = first;
+    while(block < end) {
+        if(!(block & 7) && fs->bitmap[block >> 3] == 0xff) {
+            block += 8;
+            continue;
+        }
+        if(SLM_BlockAvailable(fs, block))
+            return block;
+        block++;
+    }
+    return 0;
+}
+
+// free block closest after goal inside goal's group, then in the following groups
+static block_index SLM_FindFreeBlock(FileSystem *fs, block_index goal) {
+    if(goal >= fs->header.total_blocks)
+        goal = 0;
+
+    u32 goal_group = goal / BLOCKS_PER_GROUP;
+    for(u32 i = 0; i < fs->ngroups; ++i) {
+        u32 group = (goal_group + i) % fs->ngroups;
+        if(!fs->group_free[group])
+            continue;
+
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        block_index group_end = group_begin + BLOCKS_PER_GROUP;
+        block_index first = i == 0 ? goal : group_begin;
+
+        block_index block = SLM_ScanBitmap(fs, first, group_end);
+        if(!block && i == 0)
+            block = SLM_ScanBitmap(fs, group_begin, first);
+        if(block)
+            return block;
+    }
+    return 0;
+}
+
+static inline void SLM_WriteBlockHeader(FileSystem *fs, block_index block, u32 type, block_index prev, block_index next) {
+    u32 header[4] = { 1, type, prev, next };
+    SLM_Write(fs, header, sizeof(header), BLOCK_BEGIN(block));
+}
+
+// takes the free block closest after goal without touching the block
+// itself, the caller writes its header and calls SLM_CommitClaims
+static block_index SLM_ClaimBlock(FileSystem *fs, block_index goal) {
+    Assert(fs->header.nfree_blocks);
+    SLM_InvalidateReadahead(fs);
+
+    block_index block = SLM_FindFreeBlock(fs, goal);
+    Assert(block);
+    SLM_MarkBlock(fs, block, 1);
+
+    fs->header.used_size += fs->header.block_size;
+    fs->header.nfree_blocks--;
+    return block;
+}
+
+static inline void SLM_CommitClaims(FileSystem *fs) {
+    SLM_FlushBitmap(fs);
+    SLM_UpdateHeader(fs);
+}
+
+// reserves a chain of count blocks of the given type placed as close after
+// goal as possible
+static block_index SLM_ReserveChain(FileSystem *fs, u32 count, block_index goal, u32 type) {
+    Assert(count <= fs->header.nfree_blocks);
+
+    block_index res = 0;
+    block_index prev_block = 0, block = 0;
+    for(u32 i = 0; i < count; ++i) {
+        block_index next_block = SLM_ClaimBlock(fs, block ? block + 1 : goal);
+
+        if(block)
+            SLM_WriteBlockHeader(fs, block, type, prev_block, next_block);
+        else
+            res = next_block;
+
+        prev_block = block;
+        block = next_block;
+    }
+    SLM_WriteBlockHeader(fs, block, type, prev_block, 0);
+
+    SLM_CommitClaims(fs);
+    return res;
+}
+
+block_index SLM_ReserveBlocks(FileSystem *fs, u32 count, block_index goal) {
+    return SLM_ReserveChain(fs, count, goal, BLOCK_CHAIN);
+}
+
+void SLM_FreeBlocks(FileSystem *fs, block_index first) {
+    block_index next_block = first;
+    u32 count = 0;
+    SLM_InvalidateReadahead(fs);
+
+    do {
+        Assert(SLM_BlockInUse(fs, next_block));
+        SLM_MarkBlock(fs, next_block, 0);
+        count++;
+
+        SLM_Read(fs, &next_block, sizeof(next_block), NEXT(next_block));
+    } while(next_block);
+
+    fs->header.used_size -= count * fs->header.block_size;
+    fs->header.nfree_blocks += count;
+    SLM_FlushBitmap(fs);
+    SLM_UpdateHeader(fs);
+}
+
+static void SLM_InitGroups(FileSystem *fs) {
+    fs->ngroups = RoundUpDivision(fs->header.total_blocks, BLOCKS_PER_GROUP);
+    fs->bitmap = MemAlloc(fs->ngroups * USABLE_BLOCK_SIZE);
+    fs->group_free = MemAlloc(fs->ngroups * sizeof(u32));
+    fs->bitmap_dirty_first = 1;
+    fs->bitmap_dirty_last = 0;
+
+    fs->checksums.dirty = MemAlloc(fs->ngroups * USABLE_BLOCK_SIZE);
+    fs->checksums.verified[0] = MemAlloc(fs->ngroups * USABLE_BLOCK_SIZE);
+    fs->checksums.verified[1] = MemAlloc(fs->ngroups * USABLE_BLOCK_SIZE);
+    fs->checksums.dirty_first = 1;
+    fs->checksums.dirty_last = 0;
+    SLM_LocateChecksums(fs);
+}
+
+// the bitmap block of every group and the blocks past the end of the
+// last group are always in use
+static void SLM_CountFreeBlocks(FileSystem *fs) {
+    fs->header.nfree_blocks = 0;
+    for(u32 group = 0; group < fs->ngroups; ++group) {
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        fs->bitmap[group_begin >> 3] |= 1;
+
+        u32 nfree = 0;
+        for(block_index block = group_begin; block < group_begin + BLOCKS_PER_GROUP; ++block) {
+            if(block >= fs->header.total_blocks)
+                fs->bitmap[block >> 3] |= 1 << (block & 7);
+            else if(!SLM_BlockInUse(fs, block))
+                nfree++;
+        }
+        fs->group_free[group] = nfree;
+        fs->header.nfree_blocks += nfree;
+    }
+}
+
+static void SLM_InitBlocks(FileSystem *fs) {
+    WriteToStripesAtOffset(&fs->file, &fs->header, sizeof(fs->header), 0);
+    fs->header.used_size += sizeof(fs->header);
+
+    SLM_InitGroups(fs);
+    SLM_CountFreeBlocks(fs);
+    fs->header.used_size += (fs->header.total_blocks - fs->header.nfree_blocks) * fs->header.block_size;
+
+    for(u32 group = 0; group < fs->ngroups; ++group) {
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        SLM_WriteBlockHeader(fs, group_begin, BLOCK_BITMAP, 0, 0);
+        SLM_Write(fs, fs->bitmap + (group_begin >> 3), USABLE_BLOCK_SIZE, CONTENT(group_begin));
+    }
+}
+
+static void SLM_ReadBitmaps(FileSystem *fs) {
+    for(u32 group = 0; group < fs->ngroups; ++group) {
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        SLM_Read(fs, fs->bitmap + (group_begin >> 3), USABLE_BLOCK_SIZE, CONTENT(group_begin));
+    }
+    SLM_CountFreeBlocks(fs);
+}
+
+static void SLM_LoadGroups(FileSystem *fs) {
+    SLM_InitGroups(fs);
+    SLM_ReadBitmaps(fs);
+}
+
+// places the journal in blocks reserved for it and starts its first round.
+// the image is empty yet, the blocks come in one run
+static void SLM_FormatJournal(FileSystem *fs) {
+    fs->header.journal_blocks = MIN(JOURNAL_BLOCKS, fs->header.total_blocks / 8);
+    fs->header.journal_first = SLM_ReserveBlocks(fs, fs->header.journal_blocks, 1);
+    Assert(fs->header.journal_first + fs->header.journal_blocks <= BLOCKS_PER_GROUP);
+    SLM_InitJournal(fs);
+    fs->journal.sequence = 1;
+    SLM_WrapJournal(fs);
+}
+
+// room for every block of an image of total_size bytes when it is kept in
+// memory, the last block may end past total_size
+#define IMAGE_CAPACITY(total_size) ((total_size) + 2 * BLOCK_SIZE + sizeof(SLM_Header))
+
+// mirrors names a second copy of every backing file, 0 for an image that is
+// not mirrored. an image with no names at all is kept in memory
+static FileSystem SLM_CreateNewFileSystem(char **names, char **mirrors, u32 nstripes, u32 stripe_blocks, size_t total_size) {
+    FileSystem result = { 0 };
+    if(names)
+        result.file = CreateLargeStripes(names, mirrors, nstripes, sizeof(SLM_Header), stripe_blocks * BLOCK_SIZE, total_size);
+    else {
+        result.file = CreateMemoryStripes(IMAGE_CAPACITY(total_size), total_size);
+        nstripes = 1;
+    }
+
+    // rounding up to nearest multiple of BLOCK_SIZE = 512
+    total_size >>= 9;
+    total_size++;
+    total_size <<= 9;
+
+    result.header.magic = IMAGE_MAGIC;
+    result.header.version = IMAGE_VERSION;
+    result.header.block_size = BLOCK_SIZE;
+    result.header.total_size = total_size;
+    result.header.total_blocks = total_size / BLOCK_SIZE;
+    result.header.nfree_blocks = result.header.total_blocks;
+    result.header.header_block_size = sizeof(SLM_Header);
+    result.header.nstripes = nstripes;
+    result.header.stripe_blocks = stripe_blocks;
+    u64 timestamp = ReadTimestamp();
+    result.header.image_id = (u32)(timestamp ^ (timestamp >> 32));
+
+    SLM_InitBlocks(&result);
+    result.readahead.buf = MemAlloc(READAHEAD_MAX_BLOCKS * BLOCK_SIZE);
+
+    SLM_FormatJournal(&result);
+
+    result.header.snapshot_table = SLM_ReserveBlocks(&result, SNAPSHOT_TABLE_BLOCKS, 1);
+    Assert(result.header.snapshot_table + SNAPSHOT_TABLE_BLOCKS <= BLOCKS_PER_GROUP);
+    SLM_InitSnapshots(&result);
+    SLM_WriteSnapshotTable(&result);
+
+    // the checksums only serve to pick the good copy of a block
+    if(mirrors) {
+        result.header.checksums = SLM_ReserveBlocks(&result, CHECKSUM_TABLE_BLOCKS(result.header.total_blocks), 1);
+        SLM_LocateChecksums(&result);
+    }
+
+    result.header.root = SLM_ReserveBlocks(&result, 1, 0);
+
+    SLM_File root = { 0 };
+    root.used_size = sizeof(SLM_File);
+    root.is_directory = 1;
+    _strcpy("room", root.name, 5);
+    root.self = result.header.root;
+    root.nblocks = 1;
+    root.parent = root.self;
+    root.content = GlobalFileOffset(root.self, sizeof(SLM_File));
+    WriteToStripesAtOffset(&result.file, &root, sizeof(root), CONTENT(result.header.root));
+
+    u32 nentries = 0;
+    WriteToStripesAtOffset(&result.file, &nentries, sizeof(nentries), root.content);
+
+    m_copy(result.bitmap, result.journal.committed, result.ngroups * USABLE_BLOCK_SIZE);
+    SLM_WriteHeader(&result);
+    SyncStripes(&result.file);
+    return result;    
+}
+
+// the header is always in the first backing file
+static SLM_Header SLM_ReadImageHeader(char *name) {
+    SLM_Header header = { 0 };
+    active_file first = OpenExistingFile(name);
+    ReadFromFileAtOffset(&first, &header, sizeof(header), 0);
+    CloseFile(&first);
+    return header;
+}
+
+static inline u32 SLM_IsImage(SLM_Header *header) {
+    return header->magic == IMAGE_MAGIC && header->version == IMAGE_VERSION && header->block_size == BLOCK_SIZE;
+}
+
+// both copies of a mirrored image are written at once, so a crash can leave
+// their headers apart, and a copy left out of a mount misses every write.
+// when the headers differ the copy with the newer generation, the primary
+// if they are even, is copied over the other one whole. returns 0 if mirrors
+// are not copies of names at all and UINT_MAX if the copy could not be
+// made, rewritten names the first file that was brought up to date or is 0
+static u32 SLM_ReconcileMirror(char **names, char **mirrors, u32 count, char **rewritten) {
+    SLM_Header header = SLM_ReadImageHeader(names[0]);
+    SLM_Header copy = SLM_ReadImageHeader(mirrors[0]);
+    *rewritten = 0;
+
+    // what is fixed when the image is created has to match
+    if(!SLM_IsImage(&header) || !SLM_IsImage(&copy) || header.image_id != copy.image_id || header.block_size != copy.block_size ||
+       header.total_blocks != copy.total_blocks || header.journal_first != copy.journal_first ||
+       header.journal_blocks != copy.journal_blocks || header.snapshot_table != copy.snapshot_table ||
+       header.nstripes != copy.nstripes || header.stripe_blocks != copy.stripe_blocks)
+        return 0;
+    if(!MemCompare(&header, &copy, sizeof(header)))
+        return 1;
+
+    u32 mirror_newer = copy.generation > header.generation;
+    char **from = mirror_newer ? mirrors : names;
+    char **to = mirror_newer ? names : mirrors;
+    *rewritten = to[0];
+    for(u32 i = 0; i < count; ++i) {
+        if(!CopyFileOver(from[i], to[i]))
+            return UINT_MAX;
+    }
+    return 1;
+}
+
+// returns 0 if the journal of the image is damaged
+static u32 SLM_MountImage(FileSystem *fs) {
+    // the location of the journal never changes, the header as it is on
+    // disk is enough to find it
+    ReadFromStripesAtOffset(&fs->file, &fs->header, sizeof(fs->header), 0);
+    SLM_InitJournal(fs);
+    if(!SLM_ReplayJournal(fs))
+        return 0;
+    ReadFromStripesAtOffset(&fs->file, &fs->header, sizeof(fs->header), 0);
+
+    SLM_LoadGroups(fs);
+    m_copy(fs->bitmap, fs->journal.committed, fs->ngroups * USABLE_BLOCK_SIZE);
+    SLM_Read(fs, &fs->snapshots.table, sizeof(fs->snapshots.table), BLOCK_BEGIN(fs->header.snapshot_table));
+    SLM_InitSnapshots(fs);
+    fs->readahead.buf = MemAlloc(READAHEAD_MAX_BLOCKS * BLOCK_SIZE);
+    return 1;
+}
+
+// an image that cannot be mounted comes back with a zero header, the
+// caller tells an unknown image apart with SLM_IsImage beforehand
+static FileSystem SLM_OpenExistingFileSystem(char **names, char **mirrors) {
+    FileSystem result = { 0 };
+    result.header = SLM_ReadImageHeader(names[0]);
+    if(!SLM_IsImage(&result.header))
+        return (FileSystem){ 0 };
+    result.file = OpenExistingStripes(names, mirrors, result.header.nstripes, sizeof(SLM_Header), result.header.stripe_blocks * BLOCK_SIZE);
+    if(!SLM_MountImage(&result))
+        result.header = (SLM_Header){ 0 };
+
+    return result;
+}
+
+// the image in name is read into memory in one pass, nothing is written
+// back to it unless it is saved
+static FileSystem SLM_LoadFileSystem(char *name) {
+    FileSystem result = { 0 };
+    result.header = SLM_ReadImageHeader(name);
+    if(!SLM_IsImage(&result.header))
+        return (FileSystem){ 0 };
+    result.file = LoadMemoryStripes(name, IMAGE_CAPACITY(result.header.total_size));
+    if(!SLM_MountImage(&result))
+        result.header = (SLM_Header){ 0 };
+
+    return result;
+}
+
+// writes an image kept in memory out to name as a single backing file,
+// nothing is written if the last changes could not be committed
+static u32 SLM_SaveImage(FileSystem *fs, char *name) {
+    if(!SLM_Sync(fs))
+        return 0;
+    return SaveMemoryStripes(&fs->file, name);
+}
+
+
+static inline void SLM_GetBlock(FileSystem *fs, block_index block, char buf[BLOCK_SIZE]) {
+    SLM_Read(fs, buf, BLOCK_SIZE, BLOCK_BEGIN(block));
+}
+
+typedef struct Block {
+    u32 in_use;
+    u32 type;
+    u32 prev;
+    u32 next;
+    char *content;
+} Block;
+
+static inline Block ParseBlock(char buf[BLOCK_SIZE]) {
+    Block result = { 0 };
+
+    u32 *_buf = (u32*)buf;
+    result.in_use = *_buf++;
+    result.type = *_buf++;
+    result.prev = *_buf++;
+    result.next = *_buf++;
+    result.content = buf;
+
+    return result;
+}
+
+static SLM_File SLM_ReadFileMetaData(FileSystem *fs, block_index block) {
+    char buf[BLOCK_SIZE];
+    SLM_GetBlock(fs, block, buf);
+
+    Block block_data = ParseBlock(buf);
+    if(!block_data.in_use) {
+        // Invalid block, not in use
+        return (SLM_File){ 0 };
+    }
+    if(block_data.prev) {
+        // The block is not the initial block
+        return (SLM_File){ 0 };
+    }
+
+    SLM_File *block_contents = (SLM_File*)((char*)buf + BLOCK_METADATA);
+    return *block_contents;
+}
+
+static inline SLM_File SLM_ReadRoot(FileSystem *fs) {
+    return SLM_ReadFileMetaData(fs, fs->header.root);
+}
+
+static inline size_t SLM_ReadUsedSize(FileSystem *fs, block_index file) {
+    size_t res;
+    SLM_Read(fs, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, used_size)));
+    return res;
+}
+
+static inline void SLM_ReadName(FileSystem *fs, block_index file, char *buf, size_t size) {
+    SLM_Read(fs, buf, size, GlobalFileOffset(file, OffsetOf(SLM_File, name)));
+}
+
+static inline void SLM_ReadExt(FileSystem *fs, block_index file, char *buf, size_t size) {
+    SLM_Read(fs, buf, size, GlobalFileOffset(file, OffsetOf(SLM_File, ext)));
+}
+
+static inline void SLM_WriteUsedSize(FileSystem *fs, block_index file, size_t used_size) {
+    SLM_Write(fs, &used_size, sizeof(used_size), GlobalFileOffset(file, OffsetOf(SLM_File, used_size)));
+}
+
+static inline size_t SLM_ReadNBlocks(FileSystem *fs, block_index file) {
+    size_t res;
+    SLM_Read(fs, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, nblocks)));
+    return res;
+}
+
+static inline void SLM_WriteNBlocks(FileSystem *fs, block_index file, size_t nblocks) {
+    SLM_Write(fs, &nblocks, sizeof(nblocks), GlobalFileOffset(file, OffsetOf(SLM_File, nblocks)));
+}
+
+static inline block_index SLM_ReadNextBlockIndex(FileSystem *fs, block_index block) {
+    block_index res;
+    SLM_Read(fs, &res, sizeof(res), NEXT(block));
+    return res;
+}
+
+static inline u32 SLM_ReadIsDirectory(FileSystem *fs, block_index file) {
+    u32 res;
+    SLM_Read(fs, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, is_directory)));
+    return res;
+}
+
+static inline block_index SLM_ReadParent(FileSystem *fs, block_index file) {
+    block_index res;
+    SLM_Read(fs, &res, sizeof(res), GlobalFileOffset(file, OffsetOf(SLM_File, parent)));
+    return res;
+}
+
+static inline void SLM_WriteParent(FileSystem *fs, block_index file, block_index parent) {
+    SLM_Write(fs, &parent, sizeof(parent), GlobalFileOffset(file, OffsetOf(SLM_File, parent)));
+}
+
+static inline void SLM_WriteSelf(FileSystem *fs, block_index file) {
+    SLM_Write(fs, &file, sizeof(file), GlobalFileOffset(file, OffsetOf(SLM_File, self)));
+}
+
+static inline void SLM_WriteContentOffset(FileSystem *fs, block_index file) {
+    file_offset off = GlobalFileOffset(file, INIT_USED_SIZE);
+    SLM_Write(fs, &off, sizeof(off), GlobalFileOffset(file, OffsetOf(SLM_File, content)));
+}
+
+static inline size_t SLM_GetAvailableSize(SLM_File file) {
+    return file.nblocks * USABLE_BLOCK_SIZE - file.used_size;
+}
+
+static inline block_index SLM_GetLastBlock(FileSystem *fs, block_index base_block) {
+    block_index next_block = base_block;
+    while(SLM_ReadNextBlockIndex(fs, next_block) != 0) {
+        next_block = SLM_ReadNextBlockIndex(fs, next_block);
+    }
+    return next_block;
+}
+
+static inline block_index SLM_GetNthBlock(FileSystem *fs, block_index base_block, u32 n) {
+    block_index next_block = base_block;
+    u32 index = 1;
+    while(SLM_ReadNextBlockIndex(fs, next_block) != 0) {
+        if(index == n)
+            break;
+        next_block = SLM_ReadNextBlockIndex(fs, next_block);
+        index++;
+    }
+    return next_block;
+}
+
+static inline file_offset SLM_GetFileOffset(FileSystem *fs, block_index file) {
+    size_t used_size = SLM_ReadUsedSize(fs, file);
+    used_size += BLOCK_METADATA * SLM_ReadNBlocks(fs, file);
+
+    block_index next_block = file;
+    while(used_size >= BLOCK_SIZE) {
+        next_block = SLM_ReadNextBlockIndex(fs, next_block);
+        used_size -= BLOCK_SIZE;
+    }
+
+    return GlobalFileOffset(next_block, used_size) - BLOCK_METADATA;
+}
+
+static inline SLM_Fragment SLM_ReadFragment(FileSystem *fs, block_index block, u32 offset) {
+    SLM_Fragment fragment;
+    SLM_Read(fs, &fragment, sizeof(fragment), GlobalFileOffset(block, offset - sizeof(fragment)));
+    return fragment;
+}
+
+// slides the live fragments of the tail block being filled over the
+// released ones and points their owners at the new offsets
+static void SLM_CompactTailBlock(FileSystem *fs) {
+    block_index block = fs->header.tail_block;
+    char buf[USABLE_BLOCK_SIZE], packed[USABLE_BLOCK_SIZE];
+    SLM_Read(fs, buf, fs->header.tail_used, CONTENT(block));
+
+    u32 used = sizeof(u32);
+    for(u32 at = sizeof(u32); at < fs->header.tail_used;) {
+        SLM_Fragment *fragment = (SLM_Fragment*)(buf + at);
+        u32 length = sizeof(SLM_Fragment) + fragment->size;
+        if(fragment->owner) {
+            m_copy(fragment, packed + used, length);
+            if(used != at) {
+                u32 tail_offset = used + sizeof(SLM_Fragment);
+                SLM_Write(fs, &tail_offset, sizeof(tail_offset), GlobalFileOffset(fragment->owner, OffsetOf(SLM_File, tail_offset)));
+            }
+            used += length;
+        }
+        at += length;
+    }
+
+    if(used == fs->header.tail_used)
+        return;
+    SLM_Write(fs, packed + sizeof(u32), used - sizeof(u32), CONTENT(block) + sizeof(u32));
+    fs->header.tail_used = used;
+    SLM_UpdateHeader(fs);
+}
+
+static block_index SLM_AllocateFragment(FileSystem *fs, block_index owner, size_t size, u32 *offset, block_index goal) {
+    size_t length = sizeof(SLM_Fragment) + size;
+    if(fs->header.tail_block && fs->header.tail_used + length > USABLE_BLOCK_SIZE)
+        SLM_CompactTailBlock(fs);
+
+    if(!fs->header.tail_block || fs->header.tail_used + length > USABLE_BLOCK_SIZE) {
+        u32 zero = 0;
+        u32 type = BLOCK_TAIL;
+        fs->header.tail_block = SLM_ReserveBlocks(fs, 1, goal);
+        fs->header.tail_used = sizeof(u32);
+        SLM_Write(fs, &type, sizeof(type), TYPE(fs->header.tail_block));
+        SLM_Write(fs, &zero, sizeof(zero), CONTENT(fs->header.tail_block));
+    }
+
+    block_index block = fs->header.tail_block;
+    u32 nfragments;
+    SLM_Read(fs, &nfragments, sizeof(nfragments), CONTENT(block));
+    nfragments++;
+    SLM_Write(fs, &nfragments, sizeof(nfragments), CONTENT(block));
+
+    SLM_Fragment fragment = { owner, size };
+    SLM_Write(fs, &fragment, sizeof(fragment), GlobalFileOffset(block, fs->header.tail_used));
+
+    *offset = fs->header.tail_used + sizeof(fragment);
+    fs->header.tail_used += length;
+    SLM_UpdateHeader(fs);
+
+    return block;
+}
+
+static void SLM_ReleaseFragment(FileSystem *fs, block_index block, u32 offset) {
+    SLM_Fragment fragment = SLM_ReadFragment(fs, block, offset);
+    fragment.owner = 0;
+    SLM_Write(fs, &fragment, sizeof(fragment), GlobalFileOffset(block, offset - sizeof(fragment)));
+
+    u32 nfragments;
+    SLM_Read(fs, &nfragments, sizeof(nfragments), CONTENT(block));
+    nfragments--;
+    SLM_Write(fs, &nfragments, sizeof(nfragments), CONTENT(block));
+
+    if(block == fs->header.tail_block) {
+        // the last fragment of the block being filled gives its space back
+        if(!nfragments || offset + fragment.size == fs->header.tail_used) {
+            fs->header.tail_used = nfragments ? offset - sizeof(fragment) : sizeof(u32);
+            SLM_UpdateHeader(fs);
+        }
+    }
+    else if(!nfragments)
+        SLM_FreeBlocks(fs, block);
+}
+
+static inline void SLM_WriteTail(FileSystem *fs, block_index file, block_index tail, u32 tail_offset) {
+    SLM_Write(fs, &tail, sizeof(tail), GlobalFileOffset(file, OffsetOf(SLM_File, tail)));
+    SLM_Write(fs, &tail_offset, sizeof(tail_offset), GlobalFileOffset(file, OffsetOf(SLM_File, tail_offset)));
+}
+
+// moves a packed tail back into a block of its own at the end of the chain,
+// the fragment stays with the file for SLM_PackTail to reuse or release
+static void SLM_UnpackTail(FileSystem *fs, block_index base_block, SLM_File *file) {
+    if(!file->tail)
+        return;
+
+    char buf[USABLE_BLOCK_SIZE];
+    size_t tail_size = file->used_size - file->nblocks * USABLE_BLOCK_SIZE;
+    SLM_Read(fs, buf, tail_size, GlobalFileOffset(file->tail, file->tail_offset));
+
+    block_index last_block = SLM_GetNthBlock(fs, base_block, file->nblocks);
+    block_index new_block = SLM_ReserveBlocks(fs, 1, last_block + 1);
+    SLM_Write(fs, &new_block, sizeof(new_block), NEXT(last_block));
+    SLM_Write(fs, &last_block, sizeof(last_block), PREV(new_block));
+    SLM_Write(fs, buf, tail_size, CONTENT(new_block));
+
+    file->nblocks++;
+    file->tail = 0;
+    file->tail_offset = 0;
+    SLM_WriteNBlocks(fs, base_block, file->nblocks);
+    SLM_WriteTail(fs, base_block, 0, 0);
+}
+
+// moves a small final block of a regular file into the shared tail block.
+// held is the fragment the file had before the write, it is reused while
+// the tail fits in it and released otherwise
+static void SLM_PackTail(FileSystem *fs, block_index base_block, SLM_File *file, block_index held, u32 held_offset) {
+    size_t tail_size = 0;
+    if(!file->is_directory && !file->tail && file->nblocks >= 2)
+        tail_size = file->used_size - (file->nblocks - 1) * USABLE_BLOCK_SIZE;
+
+    if(held && (!tail_size || tail_size > SLM_ReadFragment(fs, held, held_offset).size)) {
+        SLM_ReleaseFragment(fs, held, held_offset);
+        held = 0;
+    }
+    if(!tail_size || tail_size > TAIL_PACK_LIMIT)
+        return;
+
+    block_index prev_block = SLM_GetNthBlock(fs, base_block, file->nblocks - 1);
+    block_index last_block = SLM_ReadNextBlockIndex(fs, prev_block);
+
+    char buf[USABLE_BLOCK_SIZE];
+    SLM_Read(fs, buf, tail_size, CONTENT(last_block));
+
+    block_index tail = held;
+    u32 tail_offset = held_offset;
+    if(!tail)
+        tail = SLM_AllocateFragment(fs, base_block, tail_size, &tail_offset, last_block);
+    SLM_Write(fs, buf, tail_size, GlobalFileOffset(tail, tail_offset));
+
+    block_index zero = 0;
+    SLM_Write(fs, &zero, sizeof(zero), NEXT(prev_block));
+    SLM_FreeBlocks(fs, last_block);
+
+    file->nblocks--;
+    file->tail = tail;
+    file->tail_offset = tail_offset;
+    SLM_WriteNBlocks(fs, base_block, file->nblocks);
+    SLM_WriteTail(fs, base_block, tail, tail_offset);
+}
+
+#define WRITE_PLAN_MAX_BUFFERS 1024
+
+// writes queued for offsets that follow each other go out in a single
+// gather write. scratch holds block headers until the plan is flushed
+typedef struct SLM_WritePlan {
+    write_buffer buffers[WRITE_PLAN_MAX_BUFFERS];
+    u32 count;
+    file_offset begin;
+    file_offset end;
+
+    u32 scratch[WRITE_PLAN_MAX_BUFFERS][BLOCK_METADATA / sizeof(u32)];
+    u32 nscratch;
+} SLM_WritePlan;
+
+// runs that touch committed blocks go through the journal buffer by buffer
+static void SLM_FlushWritePlan(FileSystem *fs, SLM_WritePlan *plan) {
+    if(!plan->count)
+        return;
+
+    SLM_PreserveRange(fs, plan->begin, plan->end - plan->begin);
+    if(SLM_WritesInPlace(fs, plan->begin, plan->end - plan->begin)) {
+        if(!fs->journal.active)
+            SLM_WaitCheckpoint(fs);
+        fs->journal.direct_writes |= fs->journal.active;
+        SLM_MarkWritten(fs, plan->begin, plan->end - plan->begin);
+        WriteGatherToStripes(&fs->file, plan->buffers, plan->count, plan->begin);
+    }
+    else {
+        file_offset off = plan->begin;
+        for(u32 i = 0; i < plan->count; ++i) {
+            SLM_Write(fs, plan->buffers[i].base, plan->buffers[i].size, off);
+            off += plan->buffers[i].size;
+        }
+    }
+    plan->count = 0;
+}
+
+static void SLM_PlanWrite(FileSystem *fs, SLM_WritePlan *plan, void *data, size_t size, file_offset off) {
+    if(!size)
+        return;
+    if(plan->count && (plan->end != off || plan->count == WRITE_PLAN_MAX_BUFFERS))
+        SLM_FlushWritePlan(fs, plan);
+
+    if(!plan->count) {
+        plan->begin = off;
+        plan->end = off;
+    }
+    plan->buffers[plan->count].base = data;
+    plan->buffers[plan->count].size = size;
+    plan->count++;
+    plan->end += size;
+}
+
+// a block takes at most three buffers, the plan is flushed before they
+// could overflow it so that no pending buffer points at reused scratch
+static u32* SLM_PlanScratch(FileSystem *fs, SLM_WritePlan *plan) {
+    if(plan->nscratch == WRITE_PLAN_MAX_BUFFERS || plan->count + 3 > WRITE_PLAN_MAX_BUFFERS) {
+        SLM_FlushWritePlan(fs, plan);
+        plan->nscratch = 0;
+    }
+    return plan->scratch[plan->nscratch++];
+}
+
+// plans writing size bytes of data at offset_in_block of block and on along
+// its chain. blocks past the end of the chain are claimed as the write
+// reaches them and their headers go out with the data, returns their number
+static u32 SLM_PlanChainWrite(FileSystem *fs, SLM_WritePlan *plan, block_index block, u32 offset_in_block, char *data, size_t size) {
+    u32 *header = SLM_PlanScratch(fs, plan);
+    SLM_Read(fs, header, BLOCK_METADATA, BLOCK_BEGIN(block));
+
+    u32 claimed = 0;
+    size_t written = 0;
+    u32 first_block = 1;
+    while(1) {
+        size_t size_to_write = size - written;
+        if(size_to_write > USABLE_BLOCK_SIZE - offset_in_block)
+            size_to_write = USABLE_BLOCK_SIZE - offset_in_block;
+
+        if(!header[3] && written + size_to_write < size) {
+            header[3] = SLM_ClaimBlock(fs, block + 1);
+            if(first_block)
+                SLM_PlanWrite(fs, plan, &header[3], sizeof(u32), NEXT(block));
+            claimed++;
+        }
+        if(!first_block)
+            SLM_PlanWrite(fs, plan, header, BLOCK_METADATA, BLOCK_BEGIN(block));
+        SLM_PlanWrite(fs, plan, data + written, size_to_write, GlobalFileOffset(block, offset_in_block));
+
+        written += size_to_write;
+        if(written >= size)
+            break;
+
+        block_index prev_block = block;
+        block = header[3];
+        offset_in_block = 0;
+        first_block = 0;
+
+        header = SLM_PlanScratch(fs, plan);
+        if(claimed) {
+            header[0] = 1;
+            header[1] = BLOCK_CHAIN;
+            header[2] = prev_block;
+            header[3] = 0;
+        }
+        else
+            SLM_Read(fs, header, BLOCK_METADATA, BLOCK_BEGIN(block));
+    }
+    return claimed;
+}
+
+static void SLM_WriteToFileAtOffset(FileSystem *fs, block_index base_block, char *data, size_t size, file_offset off) {
+    SLM_InvalidateReadahead(fs);
+    SLM_File file = SLM_ReadFileMetaData(fs, base_block);
+    off += INIT_USED_SIZE;
+    if(off > file.used_size || !size)
+        return;
+
+    block_index held = file.tail;
+    u32 held_offset = file.tail_offset;
+    SLM_UnpackTail(fs, base_block, &file);
+
+    size_t overflowed_size = (off + size > file.used_size) ? (off + size - file.used_size) : 0;
+
+    u32 block_containing_off = RoundUpDivision(off, USABLE_BLOCK_SIZE);
+    u32 offset_in_block = (off - (USABLE_BLOCK_SIZE * (block_containing_off - 1)));
+
+    SLM_WritePlan plan;
+    plan.count = 0;
+    plan.nscratch = 0;
+
+    // a write that starts right after the metadata carries the metadata along
+    u32 with_metadata = off == INIT_USED_SIZE;
+    if(with_metadata)
+        SLM_PlanWrite(fs, &plan, &file, sizeof(file), CONTENT(base_block));
+
+    block_index write_in_block = SLM_GetNthBlock(fs, base_block, block_containing_off);
+    u32 claimed = SLM_PlanChainWrite(fs, &plan, write_in_block, offset_in_block, data, size);
+
+    file.nblocks += claimed;
+    file.used_size += overflowed_size;
+    // unless the metadata is still waiting in the plan it went out stale
+    if(!with_metadata || !plan.count || plan.buffers[0].base != &file)
+        SLM_PlanWrite(fs, &plan, &file, OffsetOf(SLM_File, name), CONTENT(base_block));
+    SLM_FlushWritePlan(fs, &plan);
+    if(claimed)
+        SLM_CommitClaims(fs);
+
+    if(overflowed_size && !file.is_directory) {
+        SLM_UpdateEntrySize(fs, file.parent, base_block, file.used_size - INIT_USED_SIZE);
+        SLM_AddSubtreeDelta(fs, file.parent, overflowed_size, 0);
+    }
+
+    SLM_PackTail(fs, base_block, &file, held, held_offset);
+}
+
+static inline void SLM_WriteToFile(FileSystem *fs, block_index base_block, char *data, size_t size) {
+    SLM_WriteToFileAtOffset(fs, base_block, data, size, SLM_ReadUsedSize(fs, base_block) - INIT_USED_SIZE);
+}
+
+// reads window blocks starting at block, the n-th block of the chain of
+// file, with a single read and keeps those the chain follows in place.
+// returns 0 and drops the readahead if not even the first block could be read
+static u32 SLM_FillReadahead(FileSystem *fs, block_index file, size_t nblocks, u32 n, block_index block) {
+    SLM_Readahead *ra = &fs->readahead;
+
+    u32 count = ra->window;
+    if(count > nblocks - n + 1)
+        count = nblocks - n + 1;
+    // never past the bitmap of the next group
+    if(count > BLOCKS_PER_GROUP - block % BLOCKS_PER_GROUP)
+        count = BLOCKS_PER_GROUP - block % BLOCKS_PER_GROUP;
+
+    int bytes_read = SLM_Read(fs, ra->buf, count * BLOCK_SIZE, BLOCK_BEGIN(block));
+    if(bytes_read < BLOCK_SIZE) {
+        SLM_InvalidateReadahead(fs);
+        return 0;
+    }
+    count = MIN(count, (u32)bytes_read / BLOCK_SIZE);
+
+    u32 valid = 1;
+    while(valid < count) {
+        u32 *prev_header = (u32*)(ra->buf + (valid - 1) * BLOCK_SIZE);
+        if(prev_header[3] != block + valid)
+            break;
+        valid++;
+    }
+
+    ra->file = file;
+    ra->first = n;
+    ra->block = block;
+    ra->count = valid;
+
+    ra->window *= 2;
+    if(ra->window > READAHEAD_MAX_BLOCKS)
+        ra->window = READAHEAD_MAX_BLOCKS;
+    return valid;
+}
+
+// where the n-th block of the chain of file lives if the readahead knows, 0 otherwise
+static block_index SLM_ReadaheadLocate(FileSystem *fs, block_index file, u32 n) {
+    SLM_Readahead *ra = &fs->readahead;
+    if(ra->file != file || n < ra->first || n > ra->first + ra->count)
+        return 0;
+
+    if(n < ra->first + ra->count)
+        return ra->block + (n - ra->first);
+
+    u32 *last_header = (u32*)(ra->buf + (ra->count - 1) * BLOCK_SIZE);
+    return last_header[3];
+}
+
+// raw contents of the n-th block of the chain of file, which lives at block,
+// 0 if the readahead could not be filled
+static char* SLM_ReadaheadGet(FileSystem *fs, block_index file, size_t nblocks, u32 n, block_index block) {
+    SLM_Readahead *ra = &fs->readahead;
+    if(ra->file != file || n < ra->first || n >= ra->first + ra->count) {
+        if(!SLM_FillReadahead(fs, file, nblocks, n, block))
+            return 0;
+    }
+
+    return ra->buf + (n - ra->first) * BLOCK_SIZE;
+}
+
+static void SLM_ReadFromFileAtOffset(FileSystem *fs, block_index base_block, char *buf, size_t size, file_offset off) {
+    SLM_File file = SLM_ReadFileMetaData(fs, base_block);
+    off += INIT_USED_SIZE;
+    if(off > file.used_size)
+        return;
+
+    u32 block_containing_off = RoundUpDivision(off, USABLE_BLOCK_SIZE);
+    u32 offset_in_block = (off - (USABLE_BLOCK_SIZE * (block_containing_off - 1)));
+    size_t available_size_in_block = USABLE_BLOCK_SIZE - offset_in_block;
+    size_t total_available_size = file.used_size - off;
+
+    size_t total_size_to_read = MIN(total_available_size, size);
+    file_offset read_end = off + total_size_to_read;
+
+    // the part of the range past the chain lives in the packed tail
+    size_t tail_size_to_read = 0;
+    file_offset tail_read_from = 0;
+    file_offset chain_end = file.nblocks * USABLE_BLOCK_SIZE;
+    if(file.tail && off + total_size_to_read > chain_end) {
+        file_offset tail_begin = off > chain_end ? off : chain_end;
+        tail_size_to_read = off + total_size_to_read - tail_begin;
+        tail_read_from = GlobalFileOffset(file.tail, file.tail_offset + (tail_begin - chain_end));
+        total_size_to_read -= tail_size_to_read;
+    }
+
+    if(tail_size_to_read)
+        SLM_Read(fs, buf + total_size_to_read, tail_size_to_read, tail_read_from);
+    if(!total_size_to_read)
+        return;
+
+    size_t size_to_read = MIN(available_size_in_block, total_size_to_read);
+
+    // directories are rewritten in place all the time, only regular files
+    // go through the readahead
+    if(!file.is_directory) {
+        SLM_Readahead *ra = &fs->readahead;
+        if(ra->stream != base_block || ra->next_off != off) {
+            ra->stream = base_block;
+            ra->window = READAHEAD_MIN_BLOCKS;
+        }
+        ra->next_off = read_end;
+
+        u32 n = block_containing_off;
+        block_index block = SLM_ReadaheadLocate(fs, base_block, n);
+        if(!block)
+            block = SLM_GetNthBlock(fs, base_block, n);
+
+        size_t size_read = 0;
+        char direct[BLOCK_SIZE];
+        while(1) {
+            char *raw = SLM_ReadaheadGet(fs, base_block, file.nblocks, n, block);
+            if(!raw) {
+                MemSet(direct, 0, BLOCK_SIZE);
+                SLM_Read(fs, direct, BLOCK_SIZE, BLOCK_BEGIN(block));
+                raw = direct;
+            }
+            m_copy(raw + BLOCK_METADATA + offset_in_block, buf + size_read, size_to_read);
+            size_read += size_to_read;
+            if(size_read >= total_size_to_read)
+                break;
+
+            block = ((u32*)raw)[3];
+            n++;
+            offset_in_block = 0;
+            size_to_read = MIN(total_size_to_read - size_read, USABLE_BLOCK_SIZE);
+        }
+        return;
+    }
+
+    block_index read_from_block = SLM_GetNthBlock(fs, base_block, block_containing_off);
+    file_offset read_from = GlobalFileOffset(read_from_block, offset_in_block);
+    SLM_Read(fs, buf, size_to_read, read_from);
+
+    size_t size_read = size_to_read;
+
+    if(size_read < total_size_to_read) {
+        read_from_block = SLM_ReadNextBlockIndex(fs, read_from_block);
+        while(size_read < total_size_to_read) {
+            read_from = CONTENT(read_from_block);
+            size_to_read = MIN(total_size_to_read - size_read, USABLE_BLOCK_SIZE);
+            SLM_Read(fs, buf + size_read, size_to_read, read_from);
+
+            size_read += size_to_read;
+            read_from_block = SLM_ReadNextBlockIndex(fs, read_from_block);
+        }
+    }
+
+}
+
+static inline u32 SLM_ReadNEntries(FileSystem *fs, block_index directory) {
+    u32 res;
+    SLM_Read(fs, &res, sizeof(res), GlobalFileOffset(directory, INIT_USED_SIZE));
+    return res;
+}
+
+static inline void SLM_WriteNEntries(FileSystem *fs, block_index directory, u32 nentries) {
+    SLM_Write(fs, &nentries, sizeof(nentries), GlobalFileOffset(directory, INIT_USED_SIZE));
+}
+
+static inline void SLM_WriteFileName(FileSystem *fs, block_index file, char *name) {
+    SLM_Write(fs, name, 128, GlobalFileOffset(file, OffsetOf(SLM_File, name)));
+}
+
+static inline SLM_DirectoryEntry SLM_ReadEntry(FileSystem *fs, block_index directory, u32 index) {
+    SLM_DirectoryEntry entry;
+    SLM_ReadFromFileAtOffset(fs, directory, (void*)&entry, sizeof(entry), index * sizeof(SLM_DirectoryEntry) + sizeof(u32));
+    return entry;
+}
+
+static inline void SLM_ReadEntries(FileSystem *fs, block_index directory, u32 first, u32 count, SLM_DirectoryEntry *entries) {
+    SLM_ReadFromFileAtOffset(fs, directory, (void*)entries, count * sizeof(SLM_DirectoryEntry), first * sizeof(SLM_DirectoryEntry) + sizeof(u32));
+}
+
+// walks the chain of a directory once from its first block, reading runs of
+// blocks that follow each other on disk in one go. it only reads through
+// SLM_ReadShared, every thread walking the tree has a reader of its own
+#define DIRECTORY_READ_BLOCKS 64
+
+typedef struct SLM_DirectoryReader {
+    FileSystem *fs;
+
+    // next block of the chain and the number of blocks left after it
+    block_index block;
+    u32 left;
+    u32 window;
+
+    char raw[DIRECTORY_READ_BLOCKS * BLOCK_SIZE];
+    u32 count;
+    u32 current;
+    u32 offset;
+
+    u32 nentries;
+} SLM_DirectoryReader;
+
+static u32 SLM_DirectoryReaderFill(SLM_DirectoryReader *reader) {
+    block_index block = reader->block;
+    u32 count = MIN(reader->window, reader->left);
+    if(count > BLOCKS_PER_GROUP - block % BLOCKS_PER_GROUP)
+        count = BLOCKS_PER_GROUP - block % BLOCKS_PER_GROUP;
+    if(!block || !count)
+        return 0;
+
+    int bytes_read = SLM_ReadShared(reader->fs, reader->raw, count * BLOCK_SIZE, BLOCK_BEGIN(block));
+    if(bytes_read < BLOCK_SIZE)
+        return 0;
+    count = MIN(count, (u32)bytes_read / BLOCK_SIZE);
+
+    u32 valid = 1;
+    while(valid < count && ((u32*)(reader->raw + (valid - 1) * BLOCK_SIZE))[3] == block + valid)
+        valid++;
+
+    // a chain that stops following itself goes back to small reads
+    if(valid < count)
+        reader->window = READAHEAD_MIN_BLOCKS;
+    else if(reader->window < DIRECTORY_READ_BLOCKS)
+        reader->window *= 2;
+
+    reader->block = ((u32*)(reader->raw + (valid - 1) * BLOCK_SIZE))[3];
+    reader->left -= valid;
+    reader->count = valid;
+    reader->current = 0;
+    reader->offset = 0;
+    return 1;
+}
+
+// copies the next size bytes of the chain, 0 if it ends first
+static u32 SLM_DirectoryReaderCopy(SLM_DirectoryReader *reader, void *dst, size_t size) {
+    while(size) {
+        if(reader->current == reader->count && !SLM_DirectoryReaderFill(reader))
+            return 0;
+
+        size_t chunk = MIN(USABLE_BLOCK_SIZE - reader->offset, size);
+        m_copy(reader->raw + reader->current * BLOCK_SIZE + BLOCK_METADATA + reader->offset, dst, chunk);
+        dst = (char*)dst + chunk;
+        size -= chunk;
+
+        reader->offset += chunk;
+        if(reader->offset == USABLE_BLOCK_SIZE) {
+            reader->current++;
+            reader->offset = 0;
+        }
+    }
+    return 1;
+}
+
+// returns 0 if directory is not one
+static u32 SLM_DirectoryReaderBegin(SLM_DirectoryReader *reader, FileSystem *fs, block_index directory) {
+    reader->fs = fs;
+    reader->block = directory;
+    reader->left = 1;
+    reader->window = READAHEAD_MIN_BLOCKS;
+    reader->count = 0;
+    reader->current = 0;
+    reader->nentries = 0;
+
+    SLM_File file;
+    u32 nentries;
+    if(!SLM_DirectoryReaderCopy(reader, &file, sizeof(file)) || !file.is_directory)
+        return 0;
+    if(!SLM_DirectoryReaderCopy(reader, &nentries, sizeof(nentries)))
+        return 0;
+
+    size_t used_size = INIT_USED_SIZE + sizeof(u32) + (size_t)nentries * sizeof(SLM_DirectoryEntry);
+    reader->left = RoundUpDivision(used_size, USABLE_BLOCK_SIZE) - 1;
+    reader->nentries = nentries;
+    return 1;
+}
+
+static u32 SLM_DirectoryReaderNext(SLM_DirectoryReader *reader, SLM_DirectoryEntry *entry) {
+    if(!reader->nentries || !SLM_DirectoryReaderCopy(reader, entry, sizeof(*entry)))
+        return 0;
+    reader->nentries--;
+    return 1;
+}
+
+// returns the index of the entry pointing at base_block, UINT_MAX if there is none
+static u32 SLM_FindEntry(FileSystem *fs, block_index directory, block_index base_block, SLM_DirectoryEntry *entry) {
+    SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+
+    for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+        u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+        SLM_ReadEntries(fs, directory, first, count, entries);
+
+        for(u32 i = 0; i < count; ++i) {
+            if(entries[i].base_block == base_block) {
+                if(entry)
+                    *entry = entries[i];
+                return first + i;
+            }
+        }
+    }
+    return UINT_MAX;
+}
+
+// returns the index of the entry called name, UINT_MAX if there is none
+static u32 SLM_FindNamedEntry(FileSystem *fs, block_index directory, char *name, SLM_DirectoryEntry *entry) {
+    SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+
+    for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+        u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+        SLM_ReadEntries(fs, directory, first, count, entries);
+
+        for(u32 i = 0; i < count; ++i) {
+            if(_strcmp(entries[i].name, name)) {
+                if(entry)
+                    *entry = entries[i];
+                return first + i;
+            }
+        }
+    }
+    return UINT_MAX;
+}
+
+static block_index SLM_GetChild(FileSystem *fs, block_index directory, char *child_name) {
+    SLM_DirectoryEntry entry;
+    if(SLM_FindNamedEntry(fs, directory, child_name, &entry) == UINT_MAX)
+        return 0;
+    return entry.base_block;
+}
+
+static void SLM_UpdateEntrySize(FileSystem *fs, block_index directory, block_index file, size_t size) {
+    u32 index = SLM_FindEntry(fs, directory, file, 0);
+    if(index == UINT_MAX)
+        return;
+
+    file_offset off = index * sizeof(SLM_DirectoryEntry) + sizeof(u32) + OffsetOf(SLM_DirectoryEntry, size);
+    SLM_WriteToFileAtOffset(fs, directory, (char*)&size, sizeof(size), off);
+}
+
+static void SLM_ApplySubtreeDelta(FileSystem *fs, block_index directory, i64 size, i32 files) {
+    SLM_File metadata = SLM_ReadFileMetaData(fs, directory);
+    metadata.subtree_size += size;
+    metadata.subtree_files += files;
+    SLM_Write(fs, &metadata.subtree_size, sizeof(metadata.subtree_size) + sizeof(metadata.subtree_files),
+              GlobalFileOffset(directory, OffsetOf(SLM_File, subtree_size)));
+}
+
+// the deltas go up a level at a time in the order they were added, the
+// ones of siblings meet in their parent before it is written
+static void SLM_FlushSubtreeDeltas(FileSystem *fs) {
+    SLM_SubtreeDelta *deltas = fs->subtree_deltas;
+    while(fs->nsubtree_deltas) {
+        SLM_SubtreeDelta delta = deltas[0];
+        fs->nsubtree_deltas--;
+        for(u32 i = 0; i < fs->nsubtree_deltas; ++i)
+            deltas[i] = deltas[i + 1];
+
+        if(!delta.size && !delta.files)
+            continue;
+        SLM_ApplySubtreeDelta(fs, delta.directory, delta.size, delta.files);
+        if(delta.directory == fs->header.root)
+            continue;
+
+        block_index parent = SLM_ReadParent(fs, delta.directory);
+        u32 i = 0;
+        while(i < fs->nsubtree_deltas && deltas[i].directory != parent)
+            i++;
+        if(i == fs->nsubtree_deltas)
+            deltas[fs->nsubtree_deltas++] = (SLM_SubtreeDelta){ parent, 0, 0 };
+        deltas[i].size += delta.size;
+        deltas[i].files += delta.files;
+    }
+}
+
+// outside a transaction, or once the table is full, the ancestors are
+// written right away
+static void SLM_AddSubtreeDelta(FileSystem *fs, block_index directory, i64 size, i32 files) {
+    SLM_SubtreeDelta *deltas = fs->subtree_deltas;
+    u32 i = 0;
+    while(i < fs->nsubtree_deltas && deltas[i].directory != directory)
+        i++;
+
+    if(i == fs->nsubtree_deltas) {
+        if(!fs->journal.active || i == SUBTREE_DELTAS_MAX) {
+            while(1) {
+                SLM_ApplySubtreeDelta(fs, directory, size, files);
+                if(directory == fs->header.root)
+                    break;
+                directory = SLM_ReadParent(fs, directory);
+            }
+            return;
+        }
+        deltas[fs->nsubtree_deltas++] = (SLM_SubtreeDelta){ directory, 0, 0 };
+    }
+    deltas[i].size += size;
+    deltas[i].files += files;
+}
+
+// the name index maps every trigram of a name, and the extension of a file,
+// to the directories holding such a name. a bucket is a BLOCK_INDEX chain
+// starting with the u32 size of its postings, grouped by key as varints: the
+// delta to the previous key and the number of directories, then for each the
+// delta to the previous directory and its count minus one
+#define NAME_INDEX_BUCKET_BITS 14
+#define NAME_INDEX_BUCKETS (1 << NAME_INDEX_BUCKET_BITS)
+#define NAME_INDEX_TABLE_ENTRIES (USABLE_BLOCK_SIZE / sizeof(block_index))
+#define NAME_INDEX_TABLE_BLOCKS RoundUpDivision(NAME_INDEX_BUCKETS, NAME_INDEX_TABLE_ENTRIES)
+#define NAME_TRIGRAMS_MAX 126
+#define NAME_KEYS_MAX (NAME_TRIGRAMS_MAX + 1)
+
+// trigrams take the low 24 bits, extensions are hashed above them and
+// found again by reading the entries
+#define EXTENSION_KEY (1u << 24)
+
+// the largest encoding of one posting and of the key it may start
+#define POSTING_ENCODED_MAX 20
+
+// the format is kept in the table entry after the last bucket, which the
+// last table block has room for. an index from before extension keys has
+// 0 there
+#define NAME_INDEX_VERSION 1
+
+#define NAME_INDEX_OK       0
+#define NAME_INDEX_EXISTS   1
+#define NAME_INDEX_MISSING  2
+#define NAME_INDEX_NO_SPACE 3
+
+static inline u32 SLM_KeyBucket(u32 key) {
+    return (key * 2654435761u) >> (32 - NAME_INDEX_BUCKET_BITS);
+}
+
+// the distinct trigrams of name in ascending order
+static u32 SLM_NameTrigrams(const char *name, u32 *trigrams) {
+    u32 count = 0;
+    for(u32 i = 0; i < NAME_TRIGRAMS_MAX && name[i] && name[i + 1] && name[i + 2]; ++i) {
+        u32 trigram = (u8)name[i] | (u8)name[i + 1] << 8 | (u8)name[i + 2] << 16;
+
+        u32 at = count;
+        while(at && trigrams[at - 1] > trigram)
+            at--;
+        if(at && trigrams[at - 1] == trigram)
+            continue;
+
+        for(u32 j = count; j > at; --j)
+            trigrams[j] = trigrams[j - 1];
+        trigrams[at] = trigram;
+        count++;
+    }
+    return count;
+}
+
+static inline u32 SLM_PutVarint(u8 *out, u32 value) {
+    u32 size = 0;
+    while(value >= 0x80) {
+        out[size++] = (u8)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (u8)value;
+    return size;
+}
+
+static inline u32 SLM_GetVarint(u8 **in, u8 *end) {
+    u32 value = 0;
+    for(u32 shift = 0; *in < end && shift < 32; shift += 7) {
+        u8 byte = *(*in)++;
+        value |= (u32)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            break;
+    }
+    return value;
+}
+
+// the extension ExtractExtension splits off a file name, copied to ext
+// without touching name. returns its length, 0 if there is none
+static u32 SLM_NameExtension(char *name, char ext[EXTENSION_SIZE + 1]) {
+    u32 length = _strlen(name);
+    for(u32 size = 0; size <= EXTENSION_SIZE && size + 1 < length; ++size) {
+        if(name[length - 1 - size] == '.') {
+            if(!size)
+                break;
+            m_copy(name + length - size, ext, size);
+            ext[size] = '\0';
+            return size;
+        }
+    }
+    ext[0] = '\0';
+    return 0;
+}
+
+static inline u32 SLM_ExtensionKey(char *ext) {
+    u32 hash = 2166136261u;
+    for(; *ext; ++ext)
+        hash = (hash ^ (u8)*ext) * 16777619u;
+    return EXTENSION_KEY | (hash >> 8);
+}
+
+// the trigrams of the name of entry and the extension of a file
+static u32 SLM_EntryKeys(SLM_DirectoryEntry *entry, u32 *keys) {
+    u32 count = SLM_NameTrigrams(entry->name, keys);
+    char ext[EXTENSION_SIZE + 1];
+    if(!entry->is_directory && SLM_NameExtension(entry->name, ext))
+        keys[count++] = SLM_ExtensionKey(ext);
+    return count;
+}
+
+// the first posting not ordered before key and directory
+static u32 SLM_FindPosting(SLM_Posting *postings, u32 count, u32 key, block_index directory) {
+    u32 low = 0, high = count;
+    while(low < high) {
+        u32 mid = low + (high - low) / 2;
+        SLM_Posting *posting = postings + mid;
+        if(posting->key < key || (posting->key == key && posting->directory < directory))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static void SLM_IndexDecode(SLM_IndexBucket *bucket, u8 *data, u32 size) {
+    u8 *end = data + size;
+    u32 key = 0;
+    while(data < end) {
+        key += SLM_GetVarint(&data, end);
+        u32 count = SLM_GetVarint(&data, end);
+
+        SLM_Posting posting;
+        posting.key = key;
+        posting.directory = 0;
+        for(u32 i = 0; i < count && data < end; ++i) {
+            posting.directory += SLM_GetVarint(&data, end);
+            posting.count = SLM_GetVarint(&data, end) + 1;
+            VectorPush(&bucket->postings, &posting);
+        }
+    }
+}
+
+static u32 SLM_IndexEncode(SLM_IndexBucket *bucket, u8 *out) {
+    SLM_Posting *postings = bucket->postings.mem;
+    u32 count = bucket->postings.count;
+    u32 size = 0, key = 0;
+
+    for(u32 i = 0; i < count;) {
+        u32 end = i;
+        while(end < count && postings[end].key == postings[i].key)
+            end++;
+        size += SLM_PutVarint(out + size, postings[i].key - key);
+        size += SLM_PutVarint(out + size, end - i);
+        key = postings[i].key;
+
+        block_index directory = 0;
+        for(; i < end; ++i) {
+            size += SLM_PutVarint(out + size, postings[i].directory - directory);
+            size += SLM_PutVarint(out + size, postings[i].count - 1);
+            directory = postings[i].directory;
+        }
+    }
+    return size;
+}
+
+// the bucket table is read once and kept current in memory
+static void SLM_IndexOpen(FileSystem *fs) {
+    SLM_NameIndex *index = &fs->name_index;
+    if(index->open)
+        return;
+
+    if(!index->table) {
+        index->table_blocks = MemAlloc(NAME_INDEX_TABLE_BLOCKS * sizeof(block_index));
+        index->table = MemAlloc(NAME_INDEX_TABLE_BLOCKS * USABLE_BLOCK_SIZE);
+        index->buckets = MemAlloc(NAME_INDEX_BUCKETS * sizeof(SLM_IndexBucket*));
+        index->touched = MemAlloc(NAME_INDEX_BUCKETS * sizeof(u32));
+        InitMemArena(&index->arena, ARENA_CHUNK_SIZE, 0);
+    }
+
+    block_index block = fs->header.name_index;
+    for(u32 i = 0; i < NAME_INDEX_TABLE_BLOCKS; ++i) {
+        index->table_blocks[i] = block;
+        SLM_Read(fs, index->table + i * NAME_INDEX_TABLE_ENTRIES, USABLE_BLOCK_SIZE, CONTENT(block));
+        block = SLM_ReadNextBlockIndex(fs, block);
+    }
+    index->open = 1;
+}
+
+static void SLM_IndexRelease(FileSystem *fs) {
+    SLM_NameIndex *index = &fs->name_index;
+    if(!index->ntouched)
+        return;
+
+    for(u32 i = 0; i < index->ntouched; ++i)
+        index->buckets[index->touched[i]] = 0;
+    index->ntouched = 0;
+
+    ArenaMarker start = { 0 };
+    ArenaRestore(&index->arena, start);
+}
+
+// drops what is known of the index, after the image was changed under it
+static void SLM_IndexDiscard(FileSystem *fs) {
+    SLM_IndexRelease(fs);
+    fs->name_index.open = 0;
+}
+
+static inline block_index SLM_IndexVersion(FileSystem *fs) {
+    SLM_IndexOpen(fs);
+    return fs->name_index.table[NAME_INDEX_BUCKETS];
+}
+
+static SLM_IndexBucket* SLM_IndexLoadBucket(FileSystem *fs, u32 b) {
+    SLM_NameIndex *index = &fs->name_index;
+    SLM_IndexOpen(fs);
+    if(index->buckets[b])
+        return index->buckets[b];
+
+    SLM_IndexBucket *bucket = PushStruct(&index->arena, SLM_IndexBucket);
+    bucket->dirty = 0;
+    bucket->nblocks = 0;
+
+    block_index block = index->table[b];
+    u8 *data = 0;
+    u32 size = 0;
+    if(block) {
+        SLM_Read(fs, &size, sizeof(size), CONTENT(block));
+        bucket->nblocks = RoundUpDivision(sizeof(u32) + size, USABLE_BLOCK_SIZE);
+        data = PushSize(&index->arena, bucket->nblocks * USABLE_BLOCK_SIZE);
+        for(u32 i = 0; i < bucket->nblocks && block; ++i) {
+            SLM_Read(fs, data + i * USABLE_BLOCK_SIZE, USABLE_BLOCK_SIZE, CONTENT(block));
+            block = SLM_ReadNextBlockIndex(fs, block);
+        }
+    }
+
+    bucket->postings = VectorBegin(&index->arena, 16, sizeof(SLM_Posting));
+    if(data)
+        SLM_IndexDecode(bucket, data + sizeof(u32), size);
+
+    index->buckets[b] = bucket;
+    index->touched[index->ntouched++] = b;
+    return bucket;
+}
+
+// a bucket keeping its number of blocks is written over in place
+static void SLM_IndexWriteBucket(FileSystem *fs, u32 b, SLM_IndexBucket *bucket) {
+    SLM_NameIndex *index = &fs->name_index;
+    u8 *data = PushSize(&index->arena, sizeof(u32) + bucket->postings.count * POSTING_ENCODED_MAX);
+    u32 size = SLM_IndexEncode(bucket, data + sizeof(u32));
+    m_copy(&size, data, sizeof(size));
+
+    u32 total = sizeof(u32) + size;
+    u32 nblocks = 0;
+    if(size)
+        nblocks = RoundUpDivision(total, USABLE_BLOCK_SIZE);
+
+    block_index first = index->table[b];
+    if(nblocks != bucket->nblocks) {
+        block_index table_block = index->table_blocks[b / NAME_INDEX_TABLE_ENTRIES];
+        if(first)
+            SLM_FreeBlocks(fs, first);
+        first = nblocks ? SLM_ReserveChain(fs, nblocks, table_block, BLOCK_INDEX) : 0;
+
+        index->table[b] = first;
+        SLM_Write(fs, &first, sizeof(first), GlobalFileOffset(table_block, (b % NAME_INDEX_TABLE_ENTRIES) * sizeof(block_index)));
+        bucket->nblocks = nblocks;
+    }
+
+    u32 done = 0;
+    for(block_index block = first; block && done < total; block = SLM_ReadNextBlockIndex(fs, block)) {
+        u32 part = MIN(total - done, USABLE_BLOCK_SIZE);
+        SLM_Write(fs, data + done, part, CONTENT(block));
+        done += part;
+    }
+    bucket->dirty = 0;
+}
+
+// the buckets changed by the transaction are written at its end
+static void SLM_IndexFlush(FileSystem *fs) {
+    SLM_NameIndex *index = &fs->name_index;
+    for(u32 i = 0; i < index->ntouched; ++i) {
+        SLM_IndexBucket *bucket = index->buckets[index->touched[i]];
+        if(bucket->dirty)
+            SLM_IndexWriteBucket(fs, index->touched[i], bucket);
+    }
+    SLM_IndexRelease(fs);
+}
+
+// counts entry in or out of the postings of directory
+static void SLM_IndexUpdate(FileSystem *fs, block_index directory, SLM_DirectoryEntry *entry, i32 delta) {
+    if(!fs->header.name_index)
+        return;
+
+    u32 keys[NAME_KEYS_MAX];
+    u32 nkeys = SLM_EntryKeys(entry, keys);
+    for(u32 i = 0; i < nkeys; ++i) {
+        SLM_IndexBucket *bucket = SLM_IndexLoadBucket(fs, SLM_KeyBucket(keys[i]));
+        Vector *postings = &bucket->postings;
+        SLM_Posting *posting = postings->mem;
+        u32 at = SLM_FindPosting(posting, postings->count, keys[i], directory);
+
+        if(at < postings->count && posting[at].key == keys[i] && posting[at].directory == directory) {
+            posting[at].count += delta;
+            if(!posting[at].count) {
+                for(u32 j = at + 1; j < postings->count; ++j)
+                    posting[j - 1] = posting[j];
+                postings->count--;
+            }
+        }
+        else if(delta > 0) {
+            VectorReserve(postings, postings->count + 1);
+            posting = postings->mem;
+            for(u32 j = postings->count; j > at; --j)
+                posting[j] = posting[j - 1];
+            posting[at].key = keys[i];
+            posting[at].directory = directory;
+            posting[at].count = delta;
+            postings->count++;
+        }
+        else
+            continue;
+
+        bucket->dirty = 1;
+    }
+}
+
+static void SLM_IndexDirectory(FileSystem *fs, block_index directory) {
+    SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+    for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+        u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+        SLM_ReadEntries(fs, directory, first, count, entries);
+
+        for(u32 i = 0; i < count; ++i) {
+            SLM_IndexUpdate(fs, directory, entries + i, 1);
+            if(entries[i].is_directory && !entries[i].is_inline)
+                SLM_IndexDirectory(fs, entries[i].base_block);
+        }
+    }
+}
+
+// builds the index from every name in the tree, from then on it is kept
+// current by every change to a directory
+u32 SLM_CreateNameIndex(FileSystem *fs) {
+    if(fs->header.name_index)
+        return NAME_INDEX_EXISTS;
+    if(fs->header.nfree_blocks < NAME_INDEX_TABLE_BLOCKS)
+        return NAME_INDEX_NO_SPACE;
+
+    block_index first = SLM_ReserveChain(fs, NAME_INDEX_TABLE_BLOCKS, fs->header.root, BLOCK_INDEX);
+    char zero[USABLE_BLOCK_SIZE];
+    MemSet(zero, 0, sizeof(zero));
+    for(block_index block = first; block; block = SLM_ReadNextBlockIndex(fs, block))
+        SLM_Write(fs, zero, sizeof(zero), CONTENT(block));
+
+    fs->header.name_index = first;
+    SLM_UpdateHeader(fs);
+    SLM_IndexDiscard(fs);
+
+    SLM_NameIndex *index = &fs->name_index;
+    block_index version = NAME_INDEX_VERSION;
+    SLM_IndexOpen(fs);
+    SLM_Write(fs, &version, sizeof(version), GlobalFileOffset(index->table_blocks[NAME_INDEX_BUCKETS / NAME_INDEX_TABLE_ENTRIES], (NAME_INDEX_BUCKETS % NAME_INDEX_TABLE_ENTRIES) * sizeof(block_index)));
+    index->table[NAME_INDEX_BUCKETS] = version;
+
+    SLM_IndexDirectory(fs, fs->header.root);
+    return NAME_INDEX_OK;
+}
+
+u32 SLM_DropNameIndex(FileSystem *fs) {
+    if(!fs->header.name_index)
+        return NAME_INDEX_MISSING;
+
+    SLM_IndexDiscard(fs);
+    SLM_IndexOpen(fs);
+    SLM_NameIndex *index = &fs->name_index;
+    for(u32 b = 0; b < NAME_INDEX_BUCKETS; ++b) {
+        if(index->table[b])
+            SLM_FreeBlocks(fs, index->table[b]);
+    }
+    SLM_FreeBlocks(fs, fs->header.name_index);
+
+    fs->header.name_index = 0;
+    SLM_UpdateHeader(fs);
+    SLM_IndexDiscard(fs);
+    return NAME_INDEX_OK;
+}
+
+// an index of an older format is built again, returns 1 if it was
+u32 SLM_RebuildStaleNameIndex(FileSystem *fs) {
+    if(!fs->header.name_index || SLM_IndexVersion(fs) == NAME_INDEX_VERSION)
+        return 0;
+
+    SLM_DropNameIndex(fs);
+    SLM_CreateNameIndex(fs);
+    return 1;
+}
+
+// fills directories with the sorted blocks of the directories that may hold
+// a name containing pattern, or a file with extension ext, those found under
+// every key of them. either may be 0. returns 0 if there is no index of
+// this format or nothing to look up, a pattern shorter than a trigram has
+// no key
+u32 SLM_IndexLookup(FileSystem *fs, char *pattern, char *ext, Vector *directories) {
+    if(!fs->header.name_index || SLM_IndexVersion(fs) != NAME_INDEX_VERSION)
+        return 0;
+
+    u32 keys[NAME_KEYS_MAX];
+    u32 nkeys = pattern ? SLM_NameTrigrams(pattern, keys) : 0;
+    if(ext)
+        keys[nkeys++] = SLM_ExtensionKey(ext);
+    if(!nkeys)
+        return 0;
+
+    SLM_Posting *lists[NAME_KEYS_MAX];
+    u32 lengths[NAME_KEYS_MAX];
+    u32 shortest = 0;
+    for(u32 i = 0; i < nkeys; ++i) {
+        SLM_IndexBucket *bucket = SLM_IndexLoadBucket(fs, SLM_KeyBucket(keys[i]));
+        SLM_Posting *postings = bucket->postings.mem;
+        u32 first = SLM_FindPosting(postings, bucket->postings.count, keys[i], 0);
+        u32 end = SLM_FindPosting(postings, bucket->postings.count, keys[i] + 1, 0);
+
+        lists[i] = postings + first;
+        lengths[i] = end - first;
+        if(lengths[i] < lengths[shortest])
+            shortest = i;
+    }
+
+    // the shortest list is intersected with the others
+    directories->count = 0;
+    for(u32 k = 0; k < lengths[shortest]; ++k) {
+        block_index directory = lists[shortest][k].directory;
+        u32 everywhere = 1;
+        for(u32 i = 0; i < nkeys && everywhere; ++i) {
+            if(i == shortest)
+                continue;
+            u32 at = SLM_FindPosting(lists[i], lengths[i], keys[i], directory);
+            everywhere = at < lengths[i] && lists[i][at].directory == directory;
+        }
+        if(everywhere)
+            VectorPush(directories, &directory);
+    }
+    return 1;
+}
+
+// a regular file counts with its size, a directory with its totals. those
+// of a directory leaving its parent are made current first
+static void SLM_AddEntryToTotals(FileSystem *fs, block_index directory, SLM_DirectoryEntry *entry, i32 sign) {
+    if(!entry->is_directory) {
+        SLM_AddSubtreeDelta(fs, directory, sign * (i64)entry->size, sign);
+        return;
+    }
+
+    if(sign < 0)
+        SLM_FlushSubtreeDeltas(fs);
+    SLM_File metadata = SLM_ReadFileMetaData(fs, entry->base_block);
+    if(metadata.subtree_files || metadata.subtree_size)
+        SLM_AddSubtreeDelta(fs, directory, sign * (i64)metadata.subtree_size, sign * (i32)metadata.subtree_files);
+}
+
+static void SLM_DirectoryAddEntry(FileSystem *fs, block_index directory, SLM_DirectoryEntry *entry) {
+    SLM_File directory_metadata = SLM_ReadFileMetaData(fs, directory);
+    Assert(directory_metadata.is_directory);
+
+    // a directory that was emptied keeps its count
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+    if(directory_metadata.used_size == INIT_USED_SIZE) {
+        SLM_WriteToFile(fs, directory, (void*)&nentries, sizeof(nentries));
+    }
+
+    SLM_WriteToFile(fs, directory, (void*)entry, sizeof(*entry));
+    SLM_WriteNEntries(fs, directory, ++nentries);
+    SLM_AddEntryToTotals(fs, directory, entry, 1);
+    SLM_IndexUpdate(fs, directory, entry, 1);
+}
+
+static inline void SLM_ReplaceEntry(FileSystem *fs, block_index directory, u32 index, SLM_DirectoryEntry *entry) {
+    SLM_WriteToFileAtOffset(fs, directory, (char*)entry, sizeof(*entry), index * sizeof(SLM_DirectoryEntry) + sizeof(u32));
+}
+
+static void SLM_DirectoryRemoveEntry(FileSystem *fs, block_index directory, SLM_DirectoryEntry *entry) {
+    SLM_File directory_metadata = SLM_ReadFileMetaData(fs, directory);
+    Assert(directory_metadata.is_directory);
+
+    SLM_DirectoryEntry stored;
+    u32 i = entry->is_inline ? SLM_FindNamedEntry(fs, directory, entry->name, &stored) :
+                               SLM_FindEntry(fs, directory, entry->base_block, &stored);
+    if(i == UINT_MAX)
+        return;
+    SLM_AddEntryToTotals(fs, directory, entry, -1);
+    SLM_IndexUpdate(fs, directory, &stored, -1);
+
+    // the last entry takes the place of the removed one
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+    if(i != nentries - 1) {
+        SLM_DirectoryEntry last_entry = SLM_ReadEntry(fs, directory, nentries - 1);
+        SLM_ReplaceEntry(fs, directory, i, &last_entry);
+    }
+    SLM_WriteNEntries(fs, directory, --nentries);
+
+    directory_metadata.used_size -= sizeof(SLM_DirectoryEntry);
+    SLM_WriteUsedSize(fs, directory, directory_metadata.used_size);
+
+    if(directory_metadata.nblocks > 1 && directory_metadata.used_size <= (directory_metadata.nblocks - 1) * USABLE_BLOCK_SIZE) {
+        block_index prev_block = SLM_GetNthBlock(fs, directory, directory_metadata.nblocks - 1);
+        block_index block_to_free = SLM_ReadNextBlockIndex(fs, prev_block);
+        u32 zero = 0;
+        SLM_Write(fs, &zero , sizeof(u32), NEXT(prev_block));
+        SLM_FreeBlocks(fs, block_to_free);
+        SLM_WriteNBlocks(fs, directory, directory_metadata.nblocks - 1);
+    }
+}
+
+static u32 SLM_EntryExists(FileSystem *fs, block_index directory, char *name) {
+    u32 nentries = SLM_ReadNEntries(fs, directory);
+    for(int i = 0; i < nentries; ++i) {
+        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, directory, i);
+        if(_strcmp(name, entry.name))
+            return 1;
+    }
+    return 0;
+ }
+
+static inline SLM_File SLM_CreateEmptyDirectory(FileSystem *fs, char *name, block_index parent) {
+    SLM_File result = { 0 };
+
+    result.is_directory = 1;
+    result.parent = parent;
+    result.used_size = INIT_USED_SIZE;
+    result.nblocks = 1;
+    result.self = SLM_ReserveBlocks(fs, 1, parent);
+    result.content = GlobalFileOffset(result.self, INIT_USED_SIZE);
+    _strcpy(name, result.name, _strlen(name));
+
+    return result;
+}
+
+static inline char* ExtractExtension(char *name, size_t length) {
+    Assert(length >= 5);
+
+    char *res = name + length - 1;
+    int size = 0;
+    while(*res != '.' && size < 4) {
+        res--;
+        size++;
+    }
+
+    if(*res == '.') {
+        *res = '\0';
+        return res + 1;
+    }
+    return 0;
+}
+
+static inline SLM_File SLM_CreateEmptyFile(FileSystem *fs, char *name, block_index parent) {
+    SLM_File file = { 0 };
+    
+    file.is_directory = 0;
+    file.parent = parent;
+    file.nblocks = 1;
+    file.used_size = INIT_USED_SIZE;
+    file.self = SLM_ReserveBlocks(fs, 1, parent);
+    file.content = GlobalFileOffset(file.self, INIT_USED_SIZE);
+
+    char *ext = ExtractExtension(name, _strlen(name));
+    _strcpy(name, file.name, _strlen(name));
+    _strcpy(ext, file.ext, _strlen(ext));
+    
+    return file;
+}
+
+static block_index SLM_InsertNewDirectory(FileSystem *fs, char *name, block_index parent) {
+    SLM_File directory = SLM_CreateEmptyDirectory(fs, name, parent);
+
+    SLM_DirectoryEntry directory_entry = { 0 };
+    directory_entry.base_block = directory.self;
+    directory_entry.is_directory = 1;
+    _strcpy(name, directory_entry.name, _strlen(name));
+
+    SLM_Write(fs, &directory, sizeof(directory), CONTENT(directory.self));
+    SLM_WriteNEntries(fs, directory.self, 0);
+    SLM_DirectoryAddEntry(fs, parent, &directory_entry);
     
-    if(nentries) {
-        nentries--;
-        SLM_WriteNEntries(fs, directory, nentries);
+    return directory.self;
+}
+
+static block_index SLM_InsertNewFile(FileSystem *fs, char *name, block_index parent) {
+    SLM_DirectoryEntry entry = { 0 };
+    _strcpy(name, entry.name, _strlen(name));
+
+    SLM_File file = SLM_CreateEmptyFile(fs, name, parent);
+    entry.base_block = file.self;
+
+    SLM_Write(fs, &file, sizeof(file), CONTENT(file.self));
+    SLM_DirectoryAddEntry(fs, parent, &entry);
+
+    return file.self;
+}
+
+static void SLM_InsertInlineFile(FileSystem *fs, char *name, block_index parent, char *data, size_t size) {
+    Assert(size <= INLINE_DATA_SIZE);
+
+    SLM_DirectoryEntry entry = { 0 };
+    _strcpy(name, entry.name, _strlen(name));
+    entry.is_inline = 1;
+    entry.size = size;
+    m_copy(data, entry.data, size);
+
+    SLM_DirectoryAddEntry(fs, parent, &entry);
+}
+
+
+static void SLM_RenameEntry(FileSystem *fs, block_index parent, char *old_name, char *new_name) {
+    u32 is_directory = SLM_ReadIsDirectory(fs, parent);
+    if(!is_directory)
+        return;
+
+    u32 n_entries = SLM_ReadNEntries(fs, parent);
+    for(int i = 0; i < n_entries; ++i) {
+        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, parent, i);
+        if(_strcmp(entry.name, old_name)) {
+            SLM_IndexUpdate(fs, parent, &entry, -1);
+            u32 char_copied = _strcpy(new_name, entry.name, 127);
+            entry.name[char_copied] = '\0';
+            SLM_IndexUpdate(fs, parent, &entry, 1);
+            
+            SLM_WriteToFileAtOffset(fs, parent, (char*)&entry, sizeof(entry), i * sizeof(entry) + sizeof(u32));
+            if(!entry.is_inline)
+                SLM_WriteFileName(fs, entry.base_block, entry.name);
+            
+            break;
+        }
+    }
+}
+
+static inline void SLM_ReadBlock(FileSystem *fs, block_index block, char buf[USABLE_BLOCK_SIZE]) {
+    SLM_Read(fs, buf, USABLE_BLOCK_SIZE, GlobalFileOffset(block, 0));
+}
+
+static inline void SLM_WriteBlock(FileSystem *fs, block_index block, char buf[USABLE_BLOCK_SIZE]) {
+    SLM_Write(fs, buf, USABLE_BLOCK_SIZE, GlobalFileOffset(block, 0));
+}
+
+
+static void SLM_Copy(FileSystem *fs, block_index parent, SLM_DirectoryEntry *src_entry, block_index dst) {
+    u32 is_directory = SLM_ReadIsDirectory(fs, dst);
+    Assert(is_directory);
+
+    SLM_DirectoryEntry entry = *src_entry;
+    if(SLM_EntryExists(fs, dst, entry.name)) {
+        _strcpy("-copy", entry.name + _strlen(entry.name), 128);
+    }
+
+    if(entry.is_inline) {
+        SLM_DirectoryAddEntry(fs, dst, &entry);
+    }
+
+    else if(entry.is_directory){
+        block_index src = entry.base_block;
+        block_index src_copy = SLM_InsertNewDirectory(fs, entry.name, dst);
+
+        SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+        u32 n_children = SLM_ReadNEntries(fs, src);
+        for(u32 first = 0; first < n_children; first += ENTRIES_PER_READ) {
+            u32 count = MIN(n_children - first, ENTRIES_PER_READ);
+            SLM_ReadEntries(fs, src, first, count, entries);
+
+            for(u32 i = 0; i < count; ++i)
+                SLM_Copy(fs, src, &entries[i], src_copy);
+        }
+    }
+
+    else {
+        block_index src = entry.base_block;
+        SLM_File metadata = SLM_ReadFileMetaData(fs, src);
+        u32 n_blocks = metadata.nblocks;
+        block_index src_copy = SLM_ReserveBlocks(fs, n_blocks, dst);
+        entry.base_block = src_copy;
+        SLM_DirectoryAddEntry(fs, dst, &entry);
+
+        char buf[USABLE_BLOCK_SIZE];
+        for(int i = 0; i < n_blocks; ++i) {
+            SLM_ReadBlock(fs, src, buf);
+            SLM_WriteBlock(fs, src_copy, buf);
+            src = SLM_ReadNextBlockIndex(fs, src);
+            src_copy = SLM_ReadNextBlockIndex(fs, src_copy);
+        }
+
+        if(metadata.tail) {
+            size_t tail_size = metadata.used_size - metadata.nblocks * USABLE_BLOCK_SIZE;
+            SLM_Read(fs, buf, tail_size, GlobalFileOffset(metadata.tail, metadata.tail_offset));
+
+            u32 tail_offset;
+            block_index tail = SLM_AllocateFragment(fs, entry.base_block, tail_size, &tail_offset, entry.base_block);
+            SLM_Write(fs, buf, tail_size, GlobalFileOffset(tail, tail_offset));
+            SLM_WriteTail(fs, entry.base_block, tail, tail_offset);
+        }
+
+        SLM_WriteParent(fs, entry.base_block, dst);
+        SLM_WriteSelf(fs, entry.base_block);
+        SLM_WriteContentOffset(fs, entry.base_block);            
+    }
+
+}
+
+static void SLM_Move(FileSystem *fs, block_index parent, SLM_DirectoryEntry *src_entry, block_index dst) {
+    u32 is_directory = SLM_ReadIsDirectory(fs, dst);
+    Assert(is_directory);
+
+    SLM_DirectoryEntry entry = *src_entry;
+    if(SLM_EntryExists(fs, dst, entry.name)) {
+        _strcpy("-copy", entry.name + _strlen(entry.name), 128);
     }
 
-    u32 n_block = SLM_ReadNBlocks(fs, directory);
-    if(INIT_USED_SIZE + nentries * sizeof(SLM_DirectoryEntry) + sizeof(u32) + USABLE_BLOCK_SIZE - 1 < n_block * USABLE_BLOCK_SIZE) {
-        block_index block_to_free = SLM_GetLastBlock(fs, directory);
-        block_index prev;
-        ReadFromFileAtOffset(&fs->file, &prev, sizeof(prev), PREV(block_to_free));
-        u32 zero = 0;
-        WriteToFileAtOffset(&fs->file, &zero , sizeof(u32), NEXT(prev));
-        SLM_FreeBlocks(fs, SLM_GetLastBlock(fs, directory));
+    SLM_DirectoryRemoveEntry(fs, parent, src_entry);
+    SLM_DirectoryAddEntry(fs, dst, &entry);
+    if(!entry.is_inline) {
+        SLM_WriteParent(fs, entry.base_block, dst);
+        if(!_strcmp(entry.name, src_entry->name))
+            SLM_WriteFileName(fs, entry.base_block, entry.name);
+    }
+}
+
+static void SLM_FreeFile(FileSystem *fs, block_index file) {
+    SLM_File metadata = SLM_ReadFileMetaData(fs, file);
+
+    if(metadata.is_directory) {
+        SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+        u32 nentries = SLM_ReadNEntries(fs, file);
+        for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+            u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+            SLM_ReadEntries(fs, file, first, count, entries);
+
+            for(u32 i = 0; i < count; ++i) {
+                SLM_IndexUpdate(fs, file, entries + i, -1);
+                if(!entries[i].is_inline)
+                    SLM_FreeFile(fs, entries[i].base_block);
+            }
+        }
+    }
+
+    if(metadata.tail)
+        SLM_ReleaseFragment(fs, metadata.tail, metadata.tail_offset);
+    SLM_FreeBlocks(fs, file);
+}
+
+static void SLM_DeleteFile(FileSystem *fs, block_index parent, SLM_DirectoryEntry *entry) {
+    SLM_DirectoryRemoveEntry(fs, parent, entry);
+    if(!entry->is_inline)
+        SLM_FreeFile(fs, entry->base_block);
+}
+
+// block that follows block in a contiguous chain, group bitmaps are stepped over
+static inline block_index SLM_NextContiguousBlock(block_index block) {
+    block++;
+    if(!(block % BLOCKS_PER_GROUP))
+        block++;
+    return block;
+}
 
+static u32 SLM_ChainIsContiguous(FileSystem *fs, block_index first) {
+    block_index block = first;
+    block_index next_block = SLM_ReadNextBlockIndex(fs, block);
+    while(next_block) {
+        if(next_block != SLM_NextContiguousBlock(block))
+            return 0;
+        block = next_block;
+        next_block = SLM_ReadNextBlockIndex(fs, block);
     }
+    return 1;
 }
 
-static u32 SLM_EntryExists(FileSystem *fs, block_index directory, char *name) {
-    u32 nentries = SLM_ReadNEntries(fs, directory);
-    for(int i = 0; i < nentries; ++i) {
-        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, directory, i);
-        if(_strcmp(name, entry.name))
-            return 1;
+// first block of count free blocks in [first, end) separated by nothing but
+// group bitmaps, 0 if there is none
+static block_index SLM_FindFreeRun(FileSystem *fs, u32 count, block_index first, block_index end) {
+    block_index run = 0;
+    u32 length = 0;
+    for(block_index block = first; block < end; ++block) {
+        if(!(block % BLOCKS_PER_GROUP)) {
+            if(!fs->group_free[block / BLOCKS_PER_GROUP]) {
+                block += BLOCKS_PER_GROUP - 1;
+                length = 0;
+            }
+            continue;
+        }
+        if(!SLM_BlockAvailable(fs, block)) {
+            length = 0;
+            continue;
+        }
+
+        if(!length)
+            run = block;
+        if(++length == count)
+            return run;
     }
     return 0;
- }
+}
 
-static inline SLM_File SLM_CreateEmptyDirectory(FileSystem *fs, char *name) {
-    SLM_File result = { 0 };
+// copies the chain of file into the free run starting at run and points
+// the parent entry, the children and the header at the new first block
+static void SLM_RelocateFile(FileSystem *fs, block_index file, u32 nblocks, block_index run) {
+    block_index new_file = SLM_ReserveBlocks(fs, nblocks, run);
+    Assert(new_file == run);
+
+    char buf[USABLE_BLOCK_SIZE];
+    block_index src = file, dst = new_file;
+    for(u32 i = 0; i < nblocks; ++i) {
+        SLM_ReadBlock(fs, src, buf);
+        SLM_WriteBlock(fs, dst, buf);
+        src = SLM_ReadNextBlockIndex(fs, src);
+        dst = SLM_ReadNextBlockIndex(fs, dst);
+    }
+    SLM_WriteSelf(fs, new_file);
+    SLM_WriteContentOffset(fs, new_file);
 
-    result.is_directory = 1;
-    result.parent = 0;
-    result.used_size = INIT_USED_SIZE;
-    result.nblocks = 1;
-    result.self = SLM_ReserveBlocks(fs, 1);
-    result.content = GlobalFileOffset(result.self, INIT_USED_SIZE);
-    _strcpy(name, result.name, _strlen(name));
+    SLM_File metadata = SLM_ReadFileMetaData(fs, new_file);
+    if(metadata.tail) {
+        file_offset owner = GlobalFileOffset(metadata.tail, metadata.tail_offset - sizeof(SLM_Fragment) + OffsetOf(SLM_Fragment, owner));
+        SLM_Write(fs, &new_file, sizeof(new_file), owner);
+    }
+    if(file == fs->header.root) {
+        fs->header.root = new_file;
+        SLM_WriteParent(fs, new_file, new_file);
+        SLM_UpdateHeader(fs);
+    }
+    else {
+        u32 index = SLM_FindEntry(fs, metadata.parent, file, 0);
+        Assert(index != UINT_MAX);
 
-    return result;
+        file_offset off = index * sizeof(SLM_DirectoryEntry) + sizeof(u32) + OffsetOf(SLM_DirectoryEntry, base_block);
+        SLM_WriteToFileAtOffset(fs, metadata.parent, (char*)&new_file, sizeof(new_file), off);
+    }
+
+    if(metadata.is_directory) {
+        SLM_DirectoryEntry entries[ENTRIES_PER_READ];
+        u32 nentries = SLM_ReadNEntries(fs, new_file);
+        for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ) {
+            u32 count = MIN(nentries - first, ENTRIES_PER_READ);
+            SLM_ReadEntries(fs, new_file, first, count, entries);
+
+            for(u32 i = 0; i < count; ++i) {
+                SLM_IndexUpdate(fs, file, entries + i, -1);
+                SLM_IndexUpdate(fs, new_file, entries + i, 1);
+                if(!entries[i].is_inline)
+                    SLM_WriteParent(fs, entries[i].base_block, new_file);
+            }
+        }
+    }
+
+    SLM_FreeBlocks(fs, file);
 }
 
-static inline char* ExtractExtension(char *name, size_t length) {
-    Assert(length >= 5);
+// points the owners of the live fragments in buf, the contents of a tail
+// block, at new_tail. the fragments name their owners, so no tree walk
+static void SLM_RetargetTails(FileSystem *fs, char *buf, block_index new_tail) {
+    u32 nfragments = *(u32*)buf;
+    for(u32 at = sizeof(u32); nfragments && at + sizeof(SLM_Fragment) <= USABLE_BLOCK_SIZE;) {
+        SLM_Fragment *fragment = (SLM_Fragment*)(buf + at);
+        if(fragment->owner) {
+            SLM_Write(fs, &new_tail, sizeof(new_tail), GlobalFileOffset(fragment->owner, OffsetOf(SLM_File, tail)));
+            nfragments--;
+        }
+        at += sizeof(SLM_Fragment) + fragment->size;
+    }
+}
 
-    char *res = name + length - 1;
-    int size = 0;
-    while(*res != '.' && size < 4) {
-        res--;
-        size++;
+static void SLM_RelocateTail(FileSystem *fs, block_index tail, block_index block) {
+    block_index new_tail = SLM_ReserveBlocks(fs, 1, block);
+    Assert(new_tail == block);
+
+    u32 type = BLOCK_TAIL;
+    char buf[USABLE_BLOCK_SIZE];
+    SLM_ReadBlock(fs, tail, buf);
+    SLM_WriteBlock(fs, new_tail, buf);
+    SLM_Write(fs, &type, sizeof(type), TYPE(new_tail));
+
+    SLM_RetargetTails(fs, buf, new_tail);
+    if(fs->header.tail_block == tail) {
+        fs->header.tail_block = new_tail;
+        SLM_UpdateHeader(fs);
     }
 
-    if(*res == '.') {
-        *res = '\0';
-        return res + 1;
+    SLM_FreeBlocks(fs, tail);
+}
+
+// walks down from the cursor for the last block in use or kept for a
+// snapshot, max_blocks blocks a step. once it is found the backing file is
+// cut after it, the bitmaps of the groups past it are cut too and read back
+// as empty. returns 0 once the image is cut
+static u32 SLM_TruncateStep(FileSystem *fs, u32 max_blocks) {
+    block_index end = fs->header.defrag_cursor;
+    u32 found = 0;
+    for(u32 budget = max_blocks; budget && end; --budget) {
+        block_index block = end - 1;
+        if(block % BLOCKS_PER_GROUP && !SLM_BlockAvailable(fs, block)) {
+            found = 1;
+            break;
+        }
+        end = block;
     }
+    fs->header.defrag_cursor = end;
+    SLM_UpdateHeader(fs);
+    if(!found)
+        return 1;
+
+    // blocks freed by the pass may still be in use in the last commit, and
+    // replaying the groups logged so far would write past the new end
+    if(!SLM_Sync(fs))
+        return 1;
+    SLM_WrapJournal(fs);
+    TruncateStripes(&fs->file, BLOCK_BEGIN(end));
     return 0;
 }
 
-static inline SLM_File SLM_CreateEmptyFile(FileSystem *fs, char *name) {
-    SLM_File file = { 0 };
-    
-    file.is_directory = 0;
-    file.parent = 0;
-    file.nblocks = 1;
-    file.used_size = INIT_USED_SIZE;
-    file.self = SLM_ReserveBlocks(fs, 1);
-    file.content = GlobalFileOffset(file.self, INIT_USED_SIZE);
+// a compact pass first moves every chain and tail block to the lowest free
+// run before it, both kinds of pass then make the remaining chains
+// contiguous. a compact pass ends by cutting the image after its last block
+static void SLM_DefragBegin(FileSystem *fs, u32 compact) {
+    fs->header.defrag_phase = compact ? DEFRAG_COMPACT : DEFRAG_RELOCATE;
+    fs->header.defrag_compact = compact;
+    fs->header.defrag_cursor = 1;
+    SLM_UpdateHeader(fs);
+}
 
-    char *ext = ExtractExtension(name, _strlen(name));
-    _strcpy(name, file.name, _strlen(name));
-    _strcpy(ext, file.ext, _strlen(ext));
-    
-    return file;
+// visits or moves about max_blocks blocks of the pass in progress, a chain is
+// always moved whole. returns 0 once the pass is over
+static u32 SLM_DefragStep(FileSystem *fs, u32 max_blocks) {
+    if(fs->header.defrag_phase == DEFRAG_IDLE)
+        return 0;
+    if(fs->header.defrag_phase == DEFRAG_TRUNCATE) {
+        if(!SLM_TruncateStep(fs, max_blocks)) {
+            fs->header.defrag_phase = DEFRAG_IDLE;
+            fs->header.defrag_cursor = 1;
+            SLM_UpdateHeader(fs);
+        }
+        return fs->header.defrag_phase != DEFRAG_IDLE;
+    }
+
+    u32 compacting = fs->header.defrag_phase == DEFRAG_COMPACT;
+    u32 budget = max_blocks;
+    block_index block = fs->header.defrag_cursor;
+    while(budget && block < fs->header.total_blocks) {
+        block_index current = block++;
+        if(!(current % BLOCKS_PER_GROUP) || !SLM_BlockInUse(fs, current))
+            continue;
+        if(SLM_IsReservedBlock(fs, current))
+            continue;
+        budget--;
+
+        u32 header[4];
+        SLM_Read(fs, header, sizeof(header), BLOCK_BEGIN(current));
+        u32 type = header[1], prev = header[2];
+
+        if(type == BLOCK_TAIL) {
+            block_index target = compacting ? SLM_FindFreeRun(fs, 1, 1, current) : 0;
+            if(target)
+                SLM_RelocateTail(fs, current, target);
+            continue;
+        }
+        if(type != BLOCK_CHAIN || prev)
+            continue;
+
+        u32 nblocks = SLM_ReadNBlocks(fs, current);
+        block_index run = 0;
+        if(compacting)
+            run = SLM_FindFreeRun(fs, nblocks, 1, current);
+        else if(!SLM_ChainIsContiguous(fs, current)) {
+            run = SLM_FindFreeRun(fs, nblocks, current, fs->header.total_blocks);
+            if(!run)
+                run = SLM_FindFreeRun(fs, nblocks, 1, current);
+        }
+
+        if(run) {
+            SLM_RelocateFile(fs, current, nblocks, run);
+            budget = nblocks < budget ? budget - nblocks : 0;
+        }
+    }
+
+    fs->header.defrag_cursor = block;
+    if(block >= fs->header.total_blocks) {
+        fs->header.defrag_cursor = 1;
+        if(compacting)
+            fs->header.defrag_phase = DEFRAG_RELOCATE;
+        else if(fs->header.defrag_compact) {
+            fs->header.defrag_phase = DEFRAG_TRUNCATE;
+            fs->header.defrag_cursor = fs->header.total_blocks;
+        }
+        else
+            fs->header.defrag_phase = DEFRAG_IDLE;
+    }
+    SLM_UpdateHeader(fs);
+
+    return fs->header.defrag_phase != DEFRAG_IDLE;
 }
 
-static block_index SLM_InsertNewDirectory(FileSystem *fs, char *name, block_index parent) {
-    SLM_File directory = SLM_CreateEmptyDirectory(fs, name);
-    directory.parent = parent;
+static inline file_offset SLM_SnapshotOffset(FileSystem *fs, u32 index) {
+    return BLOCK_BEGIN(fs->header.snapshot_table) + OffsetOf(SLM_SnapshotTable, snapshots) + index * sizeof(SLM_Snapshot);
+}
 
-    SLM_DirectoryEntry directory_entry = { 0 };
-    directory_entry.base_block = directory.self;
-    _strcpy(name, directory_entry.name, _strlen(name));
+static void SLM_WriteSnapshotTable(FileSystem *fs) {
+    SLM_Write(fs, &fs->snapshots.table, sizeof(fs->snapshots.table), BLOCK_BEGIN(fs->header.snapshot_table));
+}
 
-    WriteToFileAtOffset(&fs->file, &directory, sizeof(directory), CONTENT(directory.self));
-    SLM_DirectoryAddEntry(fs, parent, &directory_entry);
-    
-    return directory.self;
+static inline void SLM_WriteSnapshot(FileSystem *fs, u32 index) {
+    SLM_Write(fs, fs->snapshots.table.snapshots + index, sizeof(SLM_Snapshot), SLM_SnapshotOffset(fs, index));
 }
 
-static block_index SLM_InsertNewFile(FileSystem *fs, char *name, block_index parent) {
-    SLM_DirectoryEntry entry = { 0 };
-    _strcpy(name, entry.name, _strlen(name));
+typedef struct SLM_CopyIterator {
+    block_index block;
+    u32 index;
+    u32 count;
+    SLM_SnapshotCopy copies[SNAPSHOT_COPIES_PER_BLOCK];
+} SLM_CopyIterator;
+
+static inline SLM_CopyIterator SLM_IterateCopies(SLM_Snapshot *snapshot) {
+    SLM_CopyIterator it = { 0 };
+    it.block = snapshot->map;
+    it.count = snapshot->ncopies;
+    return it;
+}
 
-    SLM_File file = SLM_CreateEmptyFile(fs, name);
-    file.parent = parent;
-    entry.base_block = file.self;
+static SLM_SnapshotCopy* SLM_NextCopy(FileSystem *fs, SLM_CopyIterator *it) {
+    if(it->index == it->count)
+        return 0;
 
-    WriteToFileAtOffset(&fs->file, &file, sizeof(file), CONTENT(file.self));
-    SLM_DirectoryAddEntry(fs, parent, &entry);
+    u32 slot = it->index % SNAPSHOT_COPIES_PER_BLOCK;
+    if(!slot) {
+        if(it->index)
+            it->block = SLM_ReadNextBlockIndex(fs, it->block);
+        SLM_Read(fs, it->copies, sizeof(it->copies), CONTENT(it->block));
+    }
+    it->index++;
+    return it->copies + slot;
+}
 
-    return file.self;
+static inline void SLM_SetBit(u8 *bits, block_index block) {
+    bits[block >> 3] |= 1 << (block & 7);
 }
 
+static inline u32 SLM_GetBit(u8 *bits, block_index block) {
+    return (bits[block >> 3] >> (block & 7)) & 1;
+}
+
+static void SLM_ClearBits(FileSystem *fs, u8 *bits) {
+    MemSet(bits, 0, fs->ngroups * USABLE_BLOCK_SIZE);
+}
 
-static int SLM_BuildPath(FileSystem *fs, block_index file, char *res, size_t size) {
-    char names[16][128] = { 0 };
-    u32 depth = 0;
-    block_index current = file;
-    while(current != fs->header.root) {
-        SLM_File current_file = SLM_ReadFileMetaData(fs, current);
-        current = current_file.parent;
-        _strcpy(current_file.name, names[depth++], 128);
+static void SLM_AppendCopy(FileSystem *fs, u32 index, SLM_SnapshotCopy *copy) {
+    SLM_Snapshot *snapshot = fs->snapshots.table.snapshots + index;
+    u32 slot = snapshot->ncopies % SNAPSHOT_COPIES_PER_BLOCK;
+    if(!slot) {
+        block_index block = SLM_ClaimBlock(fs, snapshot->map_last ? snapshot->map_last + 1 : copy->copy);
+        SLM_WriteBlockHeader(fs, block, BLOCK_SNAPSHOT, snapshot->map_last, 0);
+        if(snapshot->map_last)
+            SLM_Write(fs, &block, sizeof(block), NEXT(snapshot->map_last));
+        else
+            snapshot->map = block;
+        snapshot->map_last = block;
     }
-    SLM_File root = SLM_ReadRoot(fs);
-    _strcpy(root.name, names[depth], 128);
 
-    int bytes_written = 0;
-    for(int i = depth; i >= 0; --i) {
-        bytes_written += _strcpy(names[i], res + bytes_written, 128);
-        res[bytes_written++] = '/';
+    SLM_Write(fs, copy, sizeof(*copy), CONTENT(snapshot->map_last) + slot * sizeof(*copy));
+    snapshot->ncopies++;
+    SLM_WriteSnapshot(fs, index);
+    SLM_SetBit(fs->snapshots.targets, copy->block);
+}
+
+// data holds the whole block as the newest snapshot has to keep it
+static block_index SLM_SaveCopy(FileSystem *fs, block_index block, char data[BLOCK_SIZE], block_index goal) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    u32 bypass = snapshots->bypass;
+    snapshots->bypass = 1;
+
+    SLM_SnapshotCopy copy;
+    copy.block = block;
+    copy.copy = SLM_ClaimBlock(fs, goal);
+    m_copy(data, copy.header, BLOCK_METADATA);
+    SLM_WriteBlockHeader(fs, copy.copy, BLOCK_SNAPSHOT, 0, 0);
+    SLM_Write(fs, data + BLOCK_METADATA, USABLE_BLOCK_SIZE, CONTENT(copy.copy));
+
+    SLM_AppendCopy(fs, snapshots->table.count - 1, &copy);
+    SLM_SetBit(snapshots->saved, block);
+    SLM_CommitClaims(fs);
+
+    snapshots->bypass = bypass;
+    return copy.copy;
+}
+
+// copies every block of the range the newest snapshot needs before it is
+// overwritten for the first time
+static void SLM_PreserveRange(FileSystem *fs, file_offset off, size_t size) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    if(!snapshots->table.count || snapshots->bypass || off + size <= sizeof(SLM_Header))
+        return;
+    if(off < sizeof(SLM_Header)) {
+        size -= sizeof(SLM_Header) - off;
+        off = sizeof(SLM_Header);
     }
 
-    return bytes_written - 1;
+    block_index first = (off - sizeof(SLM_Header)) / BLOCK_SIZE;
+    block_index last = (off + size - 1 - sizeof(SLM_Header)) / BLOCK_SIZE;
+    for(block_index block = first; block <= last; ++block) {
+        if(!SLM_GetBit(snapshots->frozen, block) || SLM_GetBit(snapshots->saved, block))
+            continue;
+        if(SLM_IsReservedBlock(fs, block))
+            continue;
+
+        char data[BLOCK_SIZE];
+        SLM_Read(fs, data, BLOCK_SIZE, BLOCK_BEGIN(block));
+        SLM_SaveCopy(fs, block, data, block);
+    }
 }
 
-static void SLM_RenameEntry(FileSystem *fs, block_index parent, char *old_name, char *new_name) {
-    u32 is_directory = SLM_ReadIsDirectory(fs, parent);
-    if(!is_directory)
+// a group bitmap is not copied when a snapshot is taken but before it is
+// written for the first time afterwards, the snapshots' own blocks
+// included. until then the snapshot shares the bitmap on disk
+static void SLM_PreserveBitmap(FileSystem *fs, block_index block) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    if(!snapshots->table.count || !SLM_GetBit(snapshots->frozen, block) || SLM_GetBit(snapshots->saved, block))
         return;
 
-    u32 n_entries = SLM_ReadNEntries(fs, parent);
-    for(int i = 0; i < n_entries; ++i) {
-        SLM_DirectoryEntry entry = SLM_ReadEntry(fs, parent, i);
-        if(_strcmp(entry.name, old_name)) {
-            u32 char_copied = _strcpy(new_name, entry.name, 127);
-            entry.name[char_copied] = '\0';
-            
-            SLM_WriteToFileAtOffset(fs, parent, (char*)&entry, sizeof(entry), i * sizeof(entry) + sizeof(u32));
-            SLM_WriteFileName(fs, entry.base_block, entry.name);
-            
-            break;
+    char data[BLOCK_SIZE];
+    SLM_Read(fs, data, BLOCK_SIZE, BLOCK_BEGIN(block));
+    SLM_SaveCopy(fs, block, data, block);
+}
+
+// the block holding the bitmap of every group as of each snapshot,
+// ngroups entries a snapshot. a snapshot without a copy of a group bitmap
+// has the one of the next newer snapshot, the newest the one of the image
+static block_index* SLM_LocateSnapshotBitmaps(FileSystem *fs) {
+    SLM_SnapshotTable *table = &fs->snapshots.table;
+    block_index *bitmaps = MemAlloc(table->count * fs->ngroups * sizeof(block_index));
+    for(u32 i = 0; i < table->count; ++i) {
+        SLM_CopyIterator it = SLM_IterateCopies(table->snapshots + i);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it))) {
+            if(!(copy->block % BLOCKS_PER_GROUP))
+                bitmaps[i * fs->ngroups + copy->block / BLOCKS_PER_GROUP] = copy->copy;
+        }
+    }
+
+    for(u32 i = table->count; i-- > 0;) {
+        for(u32 group = 0; group < fs->ngroups; ++group) {
+            block_index *bitmap = bitmaps + i * fs->ngroups + group;
+            if(!*bitmap)
+                *bitmap = i + 1 < table->count ? bitmap[fs->ngroups] : group * BLOCKS_PER_GROUP;
         }
     }
+    return bitmaps;
 }
 
-static inline void SLM_ReadBlock(FileSystem *fs, block_index block, char buf[USABLE_BLOCK_SIZE]) {
-    ReadFromFileAtOffset(&fs->file, buf, USABLE_BLOCK_SIZE, GlobalFileOffset(block, 0));
+static inline void SLM_ReleaseSnapshotBitmaps(FileSystem *fs, block_index *bitmaps) {
+    MemFree(bitmaps, fs->snapshots.table.count * fs->ngroups * sizeof(block_index));
 }
 
-static inline void SLM_WriteBlock(FileSystem *fs, block_index block, char buf[USABLE_BLOCK_SIZE]) {
-    WriteToFileAtOffset(&fs->file, buf, USABLE_BLOCK_SIZE, GlobalFileOffset(block, 0));
+// frozen starts as the bitmap of the oldest snapshot, every newer snapshot
+// adds its own and drops the blocks the one before it has copies of
+static void SLM_LoadSnapshotState(FileSystem *fs) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    SLM_SnapshotTable *table = &snapshots->table;
+    SLM_ClearBits(fs, snapshots->frozen);
+    SLM_ClearBits(fs, snapshots->saved);
+    SLM_ClearBits(fs, snapshots->targets);
+    if(!table->count)
+        return;
+
+    block_index *bitmaps = SLM_LocateSnapshotBitmaps(fs);
+    for(u32 i = 0; i < table->count; ++i) {
+        for(u32 byte = 0; byte < fs->ngroups * USABLE_BLOCK_SIZE; ++byte) {
+            snapshots->frozen[byte] &= ~snapshots->saved[byte];
+            snapshots->saved[byte] = 0;
+        }
+
+        SLM_CopyIterator it = SLM_IterateCopies(table->snapshots + i);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it))) {
+            SLM_SetBit(snapshots->saved, copy->block);
+            SLM_SetBit(snapshots->targets, copy->block);
+        }
+
+        for(u32 group = 0; group < fs->ngroups; ++group) {
+            u8 bits[USABLE_BLOCK_SIZE];
+            SLM_Read(fs, bits, USABLE_BLOCK_SIZE, CONTENT(bitmaps[i * fs->ngroups + group]));
+            for(u32 byte = 0; byte < USABLE_BLOCK_SIZE; ++byte)
+                snapshots->frozen[group * USABLE_BLOCK_SIZE + byte] |= bits[byte];
+        }
+    }
+    SLM_ReleaseSnapshotBitmaps(fs, bitmaps);
 }
 
+static void SLM_InitSnapshots(FileSystem *fs) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    u32 size = fs->ngroups * USABLE_BLOCK_SIZE;
+    snapshots->frozen = MemAlloc(size);
+    snapshots->saved = MemAlloc(size);
+    snapshots->targets = MemAlloc(size);
+    snapshots->scratch = MemAlloc(size);
+    SLM_LoadSnapshotState(fs);
+}
 
-static void SLM_Copy(FileSystem *fs, block_index src, block_index dst) {
-    u32 is_directory = SLM_ReadIsDirectory(fs, dst);
-    Assert(is_directory);
+u32 SLM_FindSnapshot(FileSystem *fs, char *name) {
+    SLM_SnapshotTable *table = &fs->snapshots.table;
+    for(u32 i = 0; i < table->count; ++i) {
+        if(_strcmp(table->snapshots[i].name, name))
+            return i;
+    }
+    return UINT_MAX;
+}
 
-    block_index parent = SLM_ReadParent(fs, src);
-    u32 n_children = SLM_ReadNEntries(fs, parent);
+// taking a snapshot copies nothing, every block is copied the first time
+// it is written afterwards, the group bitmaps included. the bitmaps are
+// written first so that the ones on disk are those of the snapshot
+u32 SLM_CreateSnapshot(FileSystem *fs, char *name, u32 flags) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    SLM_SnapshotTable *table = &snapshots->table;
+    if(table->count == SNAPSHOT_MAX || SLM_FindSnapshot(fs, name) != UINT_MAX)
+        return 0;
+
+    SLM_WriteBitmap(fs);
+    u32 size = fs->ngroups * USABLE_BLOCK_SIZE;
+    for(u32 byte = 0; byte < size; ++byte) {
+        if(table->count)
+            snapshots->frozen[byte] &= ~snapshots->saved[byte];
+        snapshots->frozen[byte] |= fs->bitmap[byte];
+        snapshots->saved[byte] = 0;
+    }
 
-    SLM_DirectoryEntry entry = { 0 };
-    for(int i = 0; i < n_children; ++i) {
-        entry = SLM_ReadEntry(fs, parent, i);
-        if(entry.base_block == src)
-            break;
+    fs->header.generation++;
+    SLM_UpdateHeader(fs);
+
+    SLM_Snapshot *snapshot = table->snapshots + table->count;
+    *snapshot = (SLM_Snapshot){ 0 };
+    _strcpy(name, snapshot->name, SNAPSHOT_NAME_SIZE);
+    snapshot->flags = flags;
+    snapshot->header = fs->header;
+    table->count++;
+    SLM_WriteSnapshotTable(fs);
+    return 1;
+}
+
+static void SLM_KeepBlock(FileSystem *fs, block_index block) {
+    if(SLM_BlockInUse(fs, block))
+        return;
+    SLM_MarkBlock(fs, block, 1);
+    fs->header.used_size += fs->header.block_size;
+    fs->header.nfree_blocks--;
+}
+
+// writes the copies back from the newest snapshot down to index, the oldest
+// copy of a block is the one written last. the snapshot is then taken again
+// and the newer ones are dropped
+void SLM_RollbackSnapshot(FileSystem *fs, u32 index) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    SLM_SnapshotTable *table = &snapshots->table;
+    Assert(index < table->count);
+    SLM_InvalidateReadahead(fs);
+
+    // a rollback too large for one group is committed in parts, the bitmap
+    // in memory must have nothing pending that could be written over the
+    // restored one
+    SLM_CommitGroup(fs);
+    SLM_IndexDiscard(fs);
+
+    snapshots->bypass = 1;
+    for(u32 i = table->count; i-- > index;) {
+        SLM_CopyIterator it = SLM_IterateCopies(table->snapshots + i);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it))) {
+            char data[BLOCK_SIZE];
+            m_copy(copy->header, data, BLOCK_METADATA);
+            SLM_Read(fs, data + BLOCK_METADATA, USABLE_BLOCK_SIZE, CONTENT(copy->copy));
+            SLM_Write(fs, data, BLOCK_SIZE, BLOCK_BEGIN(copy->block));
+        }
     }
 
-    if(SLM_EntryExists(fs, dst, entry.name)) {
-        _strcpy("-copy", entry.name + _strlen(entry.name), 128);
+    char name[SNAPSHOT_NAME_SIZE] = { 0 };
+    _strcpy(table->snapshots[index].name, name, SNAPSHOT_NAME_SIZE);
+    u32 flags = table->snapshots[index].flags;
+
+    // generations are never handed out twice, a stream based on one of the
+    // dropped snapshots must not apply to the image rolled back
+    u32 generation = fs->header.generation;
+    fs->header = table->snapshots[index].header;
+    fs->header.generation = generation;
+    fs->bitmap_dirty_first = 1;
+    fs->bitmap_dirty_last = 0;
+    SLM_ReadBitmaps(fs);
+    fs->header.used_size = sizeof(SLM_Header) + (fs->header.total_blocks - fs->header.nfree_blocks) * fs->header.block_size;
+
+    // the maps of the older snapshots may have grown since. the group
+    // bitmaps written for it are copied for the newest one left first
+    table->count = index;
+    SLM_LoadSnapshotState(fs);
+    for(u32 i = 0; i < index; ++i) {
+        SLM_Snapshot *snapshot = table->snapshots + i;
+        for(block_index block = snapshot->map; block; block = SLM_ReadNextBlockIndex(fs, block))
+            SLM_KeepBlock(fs, block);
+
+        SLM_CopyIterator it = SLM_IterateCopies(snapshot);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it)))
+            SLM_KeepBlock(fs, copy->copy);
     }
+    SLM_CommitClaims(fs);
+    snapshots->bypass = 0;
 
-    is_directory = SLM_ReadIsDirectory(fs, src);
-    if(is_directory){
-        block_index src_copy = SLM_InsertNewDirectory(fs, entry.name, dst);
-        u32 n_children = SLM_ReadNEntries(fs, src);
+    SLM_LoadSnapshotState(fs);
+    SLM_CreateSnapshot(fs, name, flags);
+}
+
+// the copies of a snapshot hold what the one before it needs for the blocks
+// that one has no copy of, they move over and the rest are freed
+void SLM_DeleteSnapshot(FileSystem *fs, u32 index) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    SLM_SnapshotTable *table = &snapshots->table;
+    Assert(index < table->count);
+
+    snapshots->bypass = 1;
+    SLM_ClearBits(fs, snapshots->scratch);
+    if(index) {
+        SLM_CopyIterator it = SLM_IterateCopies(table->snapshots + index - 1);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it)))
+            SLM_SetBit(snapshots->scratch, copy->block);
+    }
+
+    // the snapshot leaves the table first, a group bitmap written from here
+    // on is copied for the newest one left
+    SLM_Snapshot snapshot = table->snapshots[index];
+    for(u32 i = index; i + 1 < table->count; ++i)
+        table->snapshots[i] = table->snapshots[i + 1];
+    table->count--;
+    SLM_WriteSnapshotTable(fs);
+    u32 newest = index && index == table->count;
+    if(newest)
+        m_copy(snapshots->scratch, snapshots->saved, fs->ngroups * USABLE_BLOCK_SIZE);
+
+    SLM_CopyIterator it = SLM_IterateCopies(&snapshot);
+    SLM_SnapshotCopy *copy;
+    while((copy = SLM_NextCopy(fs, &it))) {
+        if(!index || SLM_GetBit(snapshots->scratch, copy->block))
+            continue;
+        SLM_AppendCopy(fs, index - 1, copy);
+        if(newest)
+            SLM_SetBit(snapshots->saved, copy->block);
+    }
 
-        for(int i = 0; i < n_children; ++i) {
-            SLM_DirectoryEntry entry = SLM_ReadEntry(fs, src, i);
-            SLM_Copy(fs, entry.base_block, src_copy);
+    u32 size = fs->ngroups * USABLE_BLOCK_SIZE;
+    u8 *freed = MemAlloc(size);
+    it = SLM_IterateCopies(&snapshot);
+    while((copy = SLM_NextCopy(fs, &it))) {
+        if(!index || SLM_GetBit(snapshots->scratch, copy->block)) {
+            SLM_FreeBlocks(fs, copy->copy);
+            SLM_SetBit(freed, copy->copy);
         }
     }
+    for(block_index block = snapshot.map; block; block = SLM_ReadNextBlockIndex(fs, block))
+        SLM_SetBit(freed, block);
+    if(snapshot.map)
+        SLM_FreeBlocks(fs, snapshot.map);
+
+    // the bitmaps the newer snapshots have copies of still have the freed
+    // blocks in use, a rollback to one of them would leak them. the ones
+    // they share with the image are written first, copies taken of them on
+    // the way are cleared with the rest
+    SLM_WriteBitmap(fs);
+    for(u32 i = index; i < table->count; ++i) {
+        it = SLM_IterateCopies(table->snapshots + i);
+        while((copy = SLM_NextCopy(fs, &it))) {
+            if(copy->block % BLOCKS_PER_GROUP)
+                continue;
+
+            u8 bits[USABLE_BLOCK_SIZE];
+            SLM_Read(fs, bits, USABLE_BLOCK_SIZE, CONTENT(copy->copy));
+            for(u32 byte = 0; byte < USABLE_BLOCK_SIZE; ++byte)
+                bits[byte] &= ~freed[(copy->block >> 3) + byte];
+            SLM_Write(fs, bits, USABLE_BLOCK_SIZE, CONTENT(copy->copy));
+        }
+    }
+    MemFree(freed, size);
+    SLM_CommitClaims(fs);
+    snapshots->bypass = 0;
 
-    else {
-        u32 n_blocks = SLM_ReadNBlocks(fs, src);
-        block_index src_copy = SLM_ReserveBlocks(fs, n_blocks);
-        entry.base_block = src_copy;
-        SLM_DirectoryAddEntry(fs, dst, &entry);
+    SLM_LoadSnapshotState(fs);
+}
 
-        char buf[USABLE_BLOCK_SIZE];
-        for(int i = 0; i < n_blocks; ++i) {
-            SLM_ReadBlock(fs, src, buf);
-            SLM_WriteBlock(fs, src_copy, buf);
-            src = SLM_ReadNextBlockIndex(fs, src);
-            src_copy = SLM_ReadNextBlockIndex(fs, src_copy);
+#define STREAM_MAGIC 0x4d525453
+#define STREAM_BATCH_BLOCKS 64
+#define STREAM_RECORD_SIZE (sizeof(SLM_StreamBlock) + BLOCK_SIZE)
+#define STREAM_MASK_SIZE(ngroups) RoundUpDivision(ngroups, 8)
+#define STREAM_COMMIT_BLOCKS (STREAM_BATCH_BLOCKS * 1024)
+
+#define STREAM_OK          0
+#define STREAM_NO_BASE     1
+#define STREAM_NO_SNAPSHOT 2
+#define STREAM_BAD         3
+#define STREAM_MISMATCH    4
+#define STREAM_WRONG_BASE  5
+#define STREAM_FULL        6
+
+u32 SLM_FindGeneration(FileSystem *fs, u32 generation) {
+    SLM_SnapshotTable *table = &fs->snapshots.table;
+    for(u32 i = 0; i < table->count; ++i) {
+        if(table->snapshots[i].header.generation == generation)
+            return i;
+    }
+    return UINT_MAX;
+}
+
+// bits gets the maps of every snapshot and the copies they point to
+static void SLM_MarkSnapshotBlocks(FileSystem *fs, u8 *bits) {
+    SLM_SnapshotTable *table = &fs->snapshots.table;
+    SLM_ClearBits(fs, bits);
+    for(u32 i = 0; i < table->count; ++i) {
+        SLM_Snapshot *snapshot = table->snapshots + i;
+        for(block_index block = snapshot->map; block; block = SLM_ReadNextBlockIndex(fs, block))
+            SLM_SetBit(bits, block);
+
+        SLM_CopyIterator it = SLM_IterateCopies(snapshot);
+        SLM_SnapshotCopy *copy;
+        while((copy = SLM_NextCopy(fs, &it)))
+            SLM_SetBit(bits, copy->copy);
+    }
+}
+
+// a block has not changed since the snapshot at base if it was in use then
+// and no snapshot from base on has a copy of it
+static void SLM_MarkUnchangedBlocks(FileSystem *fs, u32 base, u8 *bits) {
+    SLM_SnapshotTable *table = &fs->snapshots.table;
+    block_index *bitmaps = SLM_LocateSnapshotBitmaps(fs);
+    for(u32 group = 0; group < fs->ngroups; ++group)
+        SLM_Read(fs, bits + group * USABLE_BLOCK_SIZE, USABLE_BLOCK_SIZE, CONTENT(bitmaps[base * fs->ngroups + group]));
+    SLM_ReleaseSnapshotBitmaps(fs, bitmaps);
+
+    SLM_CopyIterator it;
+    SLM_SnapshotCopy *copy;
+    for(u32 i = base; i < table->count; ++i) {
+        it = SLM_IterateCopies(table->snapshots + i);
+        while((copy = SLM_NextCopy(fs, &it)))
+            bits[copy->block >> 3] &= ~(1 << (copy->block & 7));
+    }
+}
+
+// the snapshots a send takes are named after their generation
+static void SLM_SendSnapshotName(u32 generation, char *name) {
+    _strcpy("gen-", name, SNAPSHOT_NAME_SIZE);
+    _utostr(generation, name + 4, SNAPSHOT_NAME_SIZE - 4);
+}
+
+// "gen-" and a number, the names a send gives its snapshots
+u32 SLM_IsSendSnapshotName(char *name) {
+    u32 generation;
+    return name[0] == 'g' && name[1] == 'e' && name[2] == 'n' && name[3] == '-' && _strtou(name + 4, &generation);
+}
+
+// takes a snapshot for the new generation and writes every block in use
+// that changed since the snapshot of generation since, all of them if since
+// is 0. the snapshots' own blocks stay behind, the receiving image has none.
+// only the newest send snapshot is kept as the base of the next send, the
+// ones of earlier sends are dropped once the stream is written
+u32 SLM_SendStream(FileSystem *fs, u32 since, char *name, u32 *nblocks) {
+    SLM_Snapshots *snapshots = &fs->snapshots;
+    u32 base = 0;
+    if(since) {
+        base = SLM_FindGeneration(fs, since);
+        if(base == UINT_MAX)
+            return STREAM_NO_BASE;
+    }
+
+    char snapshot_name[SNAPSHOT_NAME_SIZE];
+    SLM_SendSnapshotName(fs->header.generation + 1, snapshot_name);
+    if(!SLM_CreateSnapshot(fs, snapshot_name, SNAPSHOT_SEND))
+        return STREAM_NO_SNAPSHOT;
+
+    // scratch becomes the bitmap the receiver gets, frozen is borrowed for
+    // the unchanged blocks until it is loaded again
+    u8 *sent = snapshots->scratch;
+    u8 *unchanged = snapshots->frozen;
+    SLM_MarkSnapshotBlocks(fs, sent);
+    for(u32 byte = 0; byte < fs->ngroups * USABLE_BLOCK_SIZE; ++byte)
+        sent[byte] = fs->bitmap[byte] & ~sent[byte];
+    if(since)
+        SLM_MarkUnchangedBlocks(fs, base, unchanged);
+    else
+        SLM_ClearBits(fs, unchanged);
+
+    active_file file = CreateNewFile(name);
+    SLM_StreamHeader stream = { 0 };
+    stream.magic = STREAM_MAGIC;
+    stream.base = since;
+    stream.header = fs->header;
+
+    // a group bitmap written since the base has a copy in a snapshot, so
+    // its bit is clear in unchanged
+    u32 mask_size = STREAM_MASK_SIZE(fs->ngroups);
+    u8 *mask = MemAlloc(mask_size);
+    file_offset off = sizeof(stream) + mask_size;
+    for(u32 group = 0; group < fs->ngroups; ++group) {
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        if(SLM_GetBit(unchanged, group_begin))
+            continue;
+
+        SLM_SetBit(mask, group);
+        WriteToFileAtOffset(&file, sent + (group_begin >> 3), USABLE_BLOCK_SIZE, off);
+        off += USABLE_BLOCK_SIZE;
+        stream.nbitmaps++;
+    }
+    WriteToFileAtOffset(&file, mask, mask_size, sizeof(stream));
+    MemFree(mask, mask_size);
+
+    char batch[STREAM_BATCH_BLOCKS * STREAM_RECORD_SIZE];
+    u32 count = 0;
+    for(block_index block = 1; block < fs->header.total_blocks; ++block) {
+        if(!SLM_GetBit(sent, block) || SLM_GetBit(unchanged, block))
+            continue;
+        if(block % BLOCKS_PER_GROUP == 0 || SLM_IsReservedBlock(fs, block))
+            continue;
+
+        char *record = batch + count * STREAM_RECORD_SIZE;
+        ((SLM_StreamBlock*)record)->block = block;
+        SLM_Read(fs, record + sizeof(SLM_StreamBlock), BLOCK_SIZE, BLOCK_BEGIN(block));
+        stream.nblocks++;
+        if(++count == STREAM_BATCH_BLOCKS) {
+            WriteToFileAtOffset(&file, batch, count * STREAM_RECORD_SIZE, off);
+            off += count * STREAM_RECORD_SIZE;
+            count = 0;
         }
+    }
+    WriteToFileAtOffset(&file, batch, count * STREAM_RECORD_SIZE, off);
+    off += count * STREAM_RECORD_SIZE;
 
-        SLM_WriteParent(fs, entry.base_block, dst);
-        SLM_WriteSelf(fs, entry.base_block);
-        SLM_WriteContentOffset(fs, entry.base_block);            
+    WriteToFileAtOffset(&file, &stream, sizeof(stream), 0);
+    TruncateFile(&file, off);
+    SyncFile(&file);
+    CloseFile(&file);
+
+    SLM_LoadSnapshotState(fs);
+
+    SLM_SnapshotTable *table = &snapshots->table;
+    for(u32 i = table->count - 1; i--;) {
+        if(table->snapshots[i].flags & SNAPSHOT_SEND)
+            SLM_DeleteSnapshot(fs, i);
     }
 
+    *nblocks = stream.nblocks;
+    return STREAM_OK;
 }
 
-static void SLM_Move(FileSystem *fs, block_index src, block_index dst) {
-    u32 is_directory = SLM_ReadIsDirectory(fs, dst);
-    Assert(is_directory);
+// the blocks go to the same place as on the sender, then the bitmaps and
+// the header are taken over. the generation is 0 until the end so that an
+// interrupted receive only accepts a full stream afterwards
+u32 SLM_ReceiveStream(FileSystem *fs, char *name) {
+    active_file file = OpenExistingFile(name);
+    SLM_StreamHeader stream = { 0 };
+    ReadFromFileAtOffset(&file, &stream, sizeof(stream), 0);
+
+    u32 result = STREAM_OK;
+    u32 mask_size = STREAM_MASK_SIZE(fs->ngroups);
+    file_offset bitmap_size = mask_size + (file_offset)stream.nbitmaps * USABLE_BLOCK_SIZE;
+    SLM_Header *header = &stream.header;
+    if(stream.magic != STREAM_MAGIC)
+        result = STREAM_BAD;
+    else if(!SLM_IsImage(header) || header->total_blocks != fs->header.total_blocks || header->journal_first != fs->header.journal_first ||
+            header->journal_blocks != fs->header.journal_blocks || header->snapshot_table != fs->header.snapshot_table ||
+            header->checksums != fs->header.checksums || fs->snapshots.table.count)
+        result = STREAM_MISMATCH;
+    else if(stream.nbitmaps > fs->ngroups || (!stream.base && stream.nbitmaps != fs->ngroups) ||
+            file.end != sizeof(stream) + bitmap_size + (file_offset)stream.nblocks * STREAM_RECORD_SIZE)
+        result = STREAM_BAD;
+    else if(stream.base && stream.base != fs->header.generation)
+        result = STREAM_WRONG_BASE;
+    if(result != STREAM_OK) {
+        CloseFile(&file);
+        return result;
+    }
 
-    block_index parent = SLM_ReadParent(fs, src);
-    u32 n_children = SLM_ReadNEntries(fs, parent);
+    // generation 0 is on disk before any block is, and the journal is
+    // wrapped so that no record logged before is replayed over them
+    SLM_InvalidateReadahead(fs);
+    SLM_IndexDiscard(fs);
+    fs->header.generation = 0;
+    SLM_UpdateHeader(fs);
+    if(!SLM_Sync(fs)) {
+        CloseFile(&file);
+        return STREAM_FULL;
+    }
+    SLM_WrapJournal(fs);
+
+    // the blocks are written in place, only their checksums go through the
+    // journal and are committed every STREAM_COMMIT_BLOCKS blocks
+    char batch[STREAM_BATCH_BLOCKS * STREAM_RECORD_SIZE];
+    file_offset off = sizeof(stream) + bitmap_size;
+    for(u32 first = 0; first < stream.nblocks; first += STREAM_BATCH_BLOCKS) {
+        u32 count = MIN(STREAM_BATCH_BLOCKS, stream.nblocks - first);
+        ReadFromFileAtOffset(&file, batch, count * STREAM_RECORD_SIZE, off);
+        off += count * STREAM_RECORD_SIZE;
+
+        for(u32 i = 0; i < count; ++i) {
+            char *record = batch + i * STREAM_RECORD_SIZE;
+            block_index block = ((SLM_StreamBlock*)record)->block;
+            if(block >= fs->header.total_blocks || block % BLOCKS_PER_GROUP == 0 || SLM_IsReservedBlock(fs, block))
+                continue;
+            WriteToStripesAtOffset(&fs->file, record + sizeof(SLM_StreamBlock), BLOCK_SIZE, BLOCK_BEGIN(block));
+            SLM_MarkWritten(fs, BLOCK_BEGIN(block), BLOCK_SIZE);
+        }
+        fs->journal.direct_writes = 1;
+        if((first + count) % STREAM_COMMIT_BLOCKS == 0)
+            SLM_CommitGroup(fs);
+    }
 
-    SLM_DirectoryEntry entry = { 0 };
-    for(int i = 0; i < n_children; ++i) {
-        entry = SLM_ReadEntry(fs, parent, i);
-        if(entry.base_block == src)
-            break;
+    // the groups left out have the same bitmap as at the base
+    u8 *mask = MemAlloc(mask_size);
+    ReadFromFileAtOffset(&file, mask, mask_size, sizeof(stream));
+    off = sizeof(stream) + mask_size;
+    for(u32 group = 0, nbitmaps = 0; group < fs->ngroups && nbitmaps < stream.nbitmaps; ++group) {
+        if(!SLM_GetBit(mask, group))
+            continue;
+
+        block_index group_begin = group * BLOCKS_PER_GROUP;
+        u8 bits[USABLE_BLOCK_SIZE];
+        ReadFromFileAtOffset(&file, bits, USABLE_BLOCK_SIZE, off);
+        SLM_Write(fs, bits, USABLE_BLOCK_SIZE, CONTENT(group_begin));
+        off += USABLE_BLOCK_SIZE;
+        nbitmaps++;
     }
+    MemFree(mask, mask_size);
+    CloseFile(&file);
+
+    fs->bitmap_dirty_first = 1;
+    fs->bitmap_dirty_last = 0;
+    SLM_ReadBitmaps(fs);
+
+    // the sender may be striped differently and is another image
+    size_t nfree_blocks = fs->header.nfree_blocks;
+    u32 nstripes = fs->header.nstripes, stripe_blocks = fs->header.stripe_blocks;
+    u32 image_id = fs->header.image_id;
+    fs->header = *header;
+    fs->header.nfree_blocks = nfree_blocks;
+    fs->header.nstripes = nstripes;
+    fs->header.stripe_blocks = stripe_blocks;
+    fs->header.image_id = image_id;
+    fs->header.used_size = sizeof(SLM_Header) + (fs->header.total_blocks - fs->header.nfree_blocks) * fs->header.block_size;
+    SLM_UpdateHeader(fs);
+    return STREAM_OK;
+}
 
-    if(SLM_EntryExists(fs, dst, entry.name)) {
-        _strcpy("-copy", entry.name + _strlen(entry.name), 128);
+#define ARCHIVE_MAGIC 0x41534c53
+#define ARCHIVE_FILE      0
+#define ARCHIVE_DIRECTORY 1
+#define ARCHIVE_END       2
+
+#define ARCHIVE_BUFFER_SIZE (64 * 1024)
+#define ARCHIVE_STAGE_BLOCKS 64
+
+// the host file goes through buf in both directions. off is where the next
+// flush or fill happens, a reader takes bytes from pos up to used. an
+// unarchive stages the blocks of a file in stage and writes them with plan
+typedef struct SLM_ArchiveStream {
+    active_file file;
+    file_offset off;
+    char *buf;
+    u32 used;
+    u32 pos;
+
+    char (*stage)[BLOCK_SIZE];
+    SLM_WritePlan *plan;
+} SLM_ArchiveStream;
+
+static void SLM_ArchiveFlush(SLM_ArchiveStream *stream) {
+    WriteToFileAtOffset(&stream->file, stream->buf, stream->used, stream->off);
+    stream->off += stream->used;
+    stream->used = 0;
+}
+
+static void SLM_ArchivePut(SLM_ArchiveStream *stream, void *data, size_t size) {
+    while(size) {
+        if(stream->used == ARCHIVE_BUFFER_SIZE)
+            SLM_ArchiveFlush(stream);
+
+        size_t count = ARCHIVE_BUFFER_SIZE - stream->used;
+        if(count > size)
+            count = size;
+        m_copy(data, stream->buf + stream->used, count);
+        stream->used += count;
+        data = (char*)data + count;
+        size -= count;
     }
+}
 
-    SLM_DirectoryRemoveEntry(fs, parent, src);
-    SLM_DirectoryAddEntry(fs, dst, &entry);
-    SLM_WriteParent(fs, src, dst);
+// the contents are read straight into the buffer
+static void SLM_ArchiveContents(FileSystem *fs, SLM_ArchiveStream *stream, block_index file, size_t size) {
+    file_offset off = 0;
+    while(off < size) {
+        if(stream->used == ARCHIVE_BUFFER_SIZE)
+            SLM_ArchiveFlush(stream);
+
+        size_t count = ARCHIVE_BUFFER_SIZE - stream->used;
+        if(count > size - off)
+            count = size - off;
+        SLM_ReadFromFileAtOffset(fs, file, stream->buf + stream->used, count, off);
+        stream->used += count;
+        off += count;
+    }
 }
 
-static void SLM_DeleteFile(FileSystem *fs, block_index file) {
-    block_index parent = SLM_ReadParent(fs, file);
-    SLM_DirectoryRemoveEntry(fs, parent, file);
+// bytes of the archive not taken yet
+static inline file_offset SLM_ArchiveLeft(SLM_ArchiveStream *stream) {
+    return stream->file.end - stream->off + (stream->used - stream->pos);
+}
 
-    u32 is_directory = SLM_ReadIsDirectory(fs, file);
-    if(is_directory) {
-        u32 nentries = SLM_ReadNEntries(fs, file);
-        for(u32 i = 0; i < nentries; ++i) {
-            SLM_DirectoryEntry entry = SLM_ReadEntry(fs, file, i);
-            SLM_DeleteFile(fs, entry.base_block);
+// returns 0 if the archive ends first, what is missing reads as zeros
+static u32 SLM_ArchiveGet(SLM_ArchiveStream *stream, void *data, size_t size) {
+    while(size) {
+        if(stream->pos == stream->used) {
+            int res = ReadFromFileAtOffset(&stream->file, stream->buf, ARCHIVE_BUFFER_SIZE, stream->off);
+            stream->used = res > 0 ? res : 0;
+            stream->off += stream->used;
+            stream->pos = 0;
+            if(!stream->used) {
+                MemSet(data, 0, size);
+                return 0;
+            }
         }
+
+        size_t count = stream->used - stream->pos;
+        if(count > size)
+            count = size;
+        m_copy(stream->buf + stream->pos, data, count);
+        stream->pos += count;
+        data = (char*)data + count;
+        size -= count;
     }
-    SLM_FreeBlocks(fs, file);
+    return 1;
+}
+
+// children are taken in the order of their first block. the entries stay
+// where they are, a merge pass goes from order to tmp and back. returns the
+// one of the two that ends up sorted
+static SLM_DirectoryEntry** SLM_SortEntriesByBlock(SLM_DirectoryEntry **order, SLM_DirectoryEntry **tmp, u32 count) {
+    for(u32 width = 1; width < count; width *= 2) {
+        for(u32 left = 0; left < count; left += 2 * width) {
+            u32 mid = MIN(left + width, count);
+            u32 right = MIN(left + 2 * width, count);
+            u32 i = left, j = mid;
+            for(u32 k = left; k < right; ++k) {
+                if(j == right || (i < mid && order[i]->base_block <= order[j]->base_block))
+                    tmp[k] = order[i++];
+                else
+                    tmp[k] = order[j++];
+            }
+        }
+
+        SLM_DirectoryEntry **sorted = tmp;
+        tmp = order;
+        order = sorted;
+    }
+    return order;
+}
+
+// the children of a directory are held in scratch while its subtree is
+// written, the ones of its ancestors stay below them
+static void SLM_ArchiveTree(FileSystem *fs, SLM_ArchiveStream *stream, Arena *scratch, SLM_DirectoryEntry *entry) {
+    SLM_ArchiveEntry header = { 0 };
+    m_copy(entry->name, header.name, sizeof(header.name));
+
+    if(entry->is_directory) {
+        header.type = ARCHIVE_DIRECTORY;
+        SLM_ArchivePut(stream, &header, sizeof(header));
+
+        ArenaMarker marker = ArenaSave(scratch);
+        u32 nentries = SLM_ReadNEntries(fs, entry->base_block);
+        SLM_DirectoryEntry *entries = PushArray(scratch, SLM_DirectoryEntry, nentries);
+        SLM_DirectoryEntry **order = PushArray(scratch, SLM_DirectoryEntry*, nentries);
+        SLM_DirectoryEntry **tmp = PushArray(scratch, SLM_DirectoryEntry*, nentries);
+        for(u32 first = 0; first < nentries; first += ENTRIES_PER_READ)
+            SLM_ReadEntries(fs, entry->base_block, first, MIN(nentries - first, ENTRIES_PER_READ), entries + first);
+        for(u32 i = 0; i < nentries; ++i)
+            order[i] = entries + i;
+
+        order = SLM_SortEntriesByBlock(order, tmp, nentries);
+        for(u32 i = 0; i < nentries; ++i)
+            SLM_ArchiveTree(fs, stream, scratch, order[i]);
+        ArenaRestore(scratch, marker);
+
+        header.type = ARCHIVE_END;
+        SLM_ArchivePut(stream, &header, sizeof(header));
+    }
+    else if(entry->is_inline) {
+        header.type = ARCHIVE_FILE;
+        header.size = entry->size;
+        SLM_ArchivePut(stream, &header, sizeof(header));
+        SLM_ArchivePut(stream, entry->data, entry->size);
+    }
+    else {
+        header.type = ARCHIVE_FILE;
+        header.size = SLM_ReadUsedSize(fs, entry->base_block) - INIT_USED_SIZE;
+        SLM_ArchivePut(stream, &header, sizeof(header));
+        SLM_ArchiveContents(fs, stream, entry->base_block, header.size);
+    }
+}
+
+// writes entry and everything under it to the host file name in one pass,
+// the buffers come from scratch
+void SLM_ArchiveSubtree(FileSystem *fs, Arena *scratch, SLM_DirectoryEntry *entry, char *name) {
+    SLM_ArchiveStream stream = { 0 };
+    stream.file = CreateNewFile(name);
+    stream.buf = PushSize(scratch, ARCHIVE_BUFFER_SIZE);
+
+    u32 magic = ARCHIVE_MAGIC;
+    SLM_ArchivePut(&stream, &magic, sizeof(magic));
+    SLM_ArchiveTree(fs, &stream, scratch, entry);
+    SLM_ArchiveFlush(&stream);
+
+    TruncateFile(&stream.file, stream.off);
+    CloseFile(&stream.file);
+}
+
+// the whole chain is claimed while the contents are staged and goes out in
+// gather writes, the bitmap and the header are written once for the file.
+// the final partial block is packed right away as SLM_PackTail would
+static u32 SLM_UnarchiveFile(FileSystem *fs, SLM_ArchiveStream *stream, char *name, block_index parent, size_t size) {
+    if(size <= INLINE_DATA_SIZE) {
+        char data[INLINE_DATA_SIZE];
+        u32 res = SLM_ArchiveGet(stream, data, size);
+        SLM_InsertInlineFile(fs, name, parent, data, size);
+        return res;
+    }
+
+    // the chain is claimed as it is written, an entry larger than what is
+    // left of the archive or free in the image fails before any of it is.
+    // the tail fragment and the directory may take a block each
+    u32 nblocks = RoundUpDivision(INIT_USED_SIZE + size, USABLE_BLOCK_SIZE);
+    if(size > SLM_ArchiveLeft(stream) || nblocks + 2 > fs->header.nfree_blocks)
+        return 0;
+
+    SLM_DirectoryEntry entry = { 0 };
+    _strcpy(name, entry.name, _strlen(name));
+    entry.size = size;
+
+    SLM_File file = SLM_CreateEmptyFile(fs, name, parent);
+    entry.base_block = file.self;
+    file.used_size = INIT_USED_SIZE + size;
+    file.nblocks = nblocks;
+
+    size_t tail_size = file.used_size - (file.nblocks - 1) * USABLE_BLOCK_SIZE;
+    if(file.nblocks > 1 && tail_size <= TAIL_PACK_LIMIT) {
+        file.nblocks--;
+        file.tail = SLM_AllocateFragment(fs, file.self, tail_size, &file.tail_offset, file.self);
+    }
+    else
+        tail_size = 0;
+
+    char (*stage)[BLOCK_SIZE] = stream->stage;
+    SLM_WritePlan *plan = stream->plan;
+    plan->count = 0;
+    plan->nscratch = 0;
+
+    u32 res = 1;
+    size_t left = size - tail_size;
+    block_index block = file.self, prev_block = 0;
+    for(u32 i = 0; i < file.nblocks; ++i) {
+        if(i % ARCHIVE_STAGE_BLOCKS == 0)
+            SLM_FlushWritePlan(fs, plan);
+
+        char *staged = stage[i % ARCHIVE_STAGE_BLOCKS];
+        u32 *header = (u32*)staged;
+        header[0] = 1;
+        header[1] = BLOCK_CHAIN;
+        header[2] = prev_block;
+        header[3] = i + 1 < file.nblocks ? SLM_ClaimBlock(fs, block + 1) : 0;
+
+        char *content = staged + BLOCK_METADATA;
+        size_t count = USABLE_BLOCK_SIZE;
+        if(!i) {
+            m_copy(&file, content, sizeof(file));
+            content += sizeof(file);
+            count -= sizeof(file);
+        }
+        if(count > left)
+            count = left;
+        res &= SLM_ArchiveGet(stream, content, count);
+        left -= count;
+
+        SLM_PlanWrite(fs, plan, staged, content + count - staged, BLOCK_BEGIN(block));
+        prev_block = block;
+        block = header[3];
+    }
+    SLM_FlushWritePlan(fs, plan);
+    SLM_CommitClaims(fs);
+
+    if(tail_size) {
+        char buf[TAIL_PACK_LIMIT];
+        res &= SLM_ArchiveGet(stream, buf, tail_size);
+        SLM_Write(fs, buf, tail_size, GlobalFileOffset(file.tail, file.tail_offset));
+    }
+
+    SLM_DirectoryAddEntry(fs, parent, &entry);
+    return res;
+}
+
+// reads one entry and creates it in parent, returns its type or UINT_MAX if
+// the archive is cut short
+static u32 SLM_UnarchiveEntry(FileSystem *fs, SLM_ArchiveStream *stream, block_index parent) {
+    SLM_ArchiveEntry header;
+    if(!SLM_ArchiveGet(stream, &header, sizeof(header)))
+        return UINT_MAX;
+    if(header.type == ARCHIVE_END)
+        return ARCHIVE_END;
+
+    // leaves room for the suffix added when the name is taken
+    header.name[sizeof(header.name) - sizeof("-copy")] = '\0';
+    if(!header.name[0])
+        return UINT_MAX;
+    if(SLM_EntryExists(fs, parent, header.name))
+        _strcpy("-copy", header.name + _strlen(header.name), 128);
+
+    if(header.type == ARCHIVE_DIRECTORY) {
+        block_index directory = SLM_InsertNewDirectory(fs, header.name, parent);
+        u32 type;
+        while((type = SLM_UnarchiveEntry(fs, stream, directory)) != ARCHIVE_END) {
+            if(type == UINT_MAX)
+                return UINT_MAX;
+        }
+        return ARCHIVE_DIRECTORY;
+    }
+    if(header.type != ARCHIVE_FILE || !SLM_UnarchiveFile(fs, stream, header.name, parent, header.size))
+        return UINT_MAX;
+    return ARCHIVE_FILE;
+}
+
+// recreates the archived file or directory in parent, returns 0 if name is
+// not an archive or ends early. what was read before that is kept. the
+// buffers come from scratch
+u32 SLM_UnarchiveSubtree(FileSystem *fs, Arena *scratch, char *name, block_index parent) {
+    SLM_ArchiveStream stream = { 0 };
+    stream.file = OpenExistingFile(name);
+    stream.buf = PushSize(scratch, ARCHIVE_BUFFER_SIZE);
+    stream.stage = PushSize(scratch, ARCHIVE_STAGE_BLOCKS * BLOCK_SIZE);
+    stream.plan = PushStruct(scratch, SLM_WritePlan);
+
+    u32 magic = 0;
+    SLM_ArchiveGet(&stream, &magic, sizeof(magic));
+    u32 res = magic == ARCHIVE_MAGIC && SLM_UnarchiveEntry(fs, &stream, parent) != UINT_MAX;
+    CloseFile(&stream.file);
+    return res;
 }
 
 #define SLIM64_C
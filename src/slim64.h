@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "platform.c"
+#include "m_alloc.c"
 
 #pragma pack(push, 1)
 
@@ -17,14 +18,50 @@ typedef struct SLM_File{
     block_index parent;
     block_index self;
     file_offset content;
+
+    // block holding the packed final partial block of the file, 0 if the
+    // whole file lives in its own chain
+    block_index tail;
+    u32 tail_offset;
+
+    // bytes and regular files anywhere under a directory
+    size_t subtree_size;
+    u32 subtree_files;
 } SLM_File;
 
+// every fragment of a tail block starts with the file it belongs to and the
+// bytes it holds, owner is 0 once the fragment is released
+typedef struct SLM_Fragment {
+    block_index owner;
+    u32 size;
+} SLM_Fragment;
+
+// longest extension split off the name of a file, kept in its ext
+#define EXTENSION_SIZE 4
+
+#define INLINE_DATA_SIZE 108
+
 typedef struct SLM_DirectoryEntry {
     char name[128];
     block_index base_block;
+
+    // copies of the child's is_directory and logical size, so that a
+    // directory can be listed without touching its children
+    u32 is_directory;
+    size_t size;
+
+    // files of at most INLINE_DATA_SIZE bytes own no blocks, base_block is 0
+    // and the contents are kept in the entry itself
+    u32 is_inline;
+    char data[INLINE_DATA_SIZE];
 } SLM_DirectoryEntry;
 
 typedef struct {
+    // IMAGE_MAGIC and the IMAGE_VERSION of the layout the image was made
+    // with, an image of any other version is not mounted
+    u32 magic;
+    u32 version;
+
     size_t header_block_size;
     size_t total_size;
     size_t used_size;
@@ -33,19 +70,290 @@ typedef struct {
     size_t total_blocks;
     size_t nfree_blocks;
 
-    block_index next_free_block;
-
     block_index root;
+
+    // tail block currently being filled with packed fragments
+    block_index tail_block;
+    u32 tail_used;
+
+    // state of the defrag pass in progress, kept here so that an
+    // interrupted pass resumes where it stopped
+    u32 defrag_phase;
+    u32 defrag_compact;
+    block_index defrag_cursor;
+
+    // blocks holding the journal and the snapshot table, fixed when the
+    // image is created
+    block_index journal_first;
+    u32 journal_blocks;
+    block_index snapshot_table;
+
+    // bumped by every snapshot taken, an image filled by receive has the
+    // generation of the sender and 0 while a receive is in progress
+    u32 generation;
+
+    // blocks go round robin over nstripes backing files, stripe_blocks at a
+    // time
+    u32 nstripes;
+    u32 stripe_blocks;
+
+    // first block of the bucket table of the name index, 0 if the image has
+    // no index
+    block_index name_index;
+
+    // drawn when the image is created, a mirror carries the same one
+    u32 image_id;
+
+    // first block of the checksum table of a mirrored image, a u32 for
+    // every block. 0 if the image was made without a mirror
+    block_index checksums;
 } SLM_Header;
+
+#define SNAPSHOT_MAX 16
+#define SNAPSHOT_NAME_SIZE 32
+
+#define SNAPSHOT_SEND 1
+
+// header is the state of the image when the snapshot was taken. map is a
+// chain of SLM_SnapshotCopy, one for every block changed before the next
+// snapshot was taken. flags has SNAPSHOT_SEND for the ones taken by a send
+typedef struct SLM_Snapshot {
+    char name[SNAPSHOT_NAME_SIZE];
+    block_index map;
+    block_index map_last;
+    u32 ncopies;
+    u32 flags;
+    SLM_Header header;
+} SLM_Snapshot;
+
+typedef struct SLM_SnapshotTable {
+    u32 count;
+    SLM_Snapshot snapshots[SNAPSHOT_MAX];
+} SLM_SnapshotTable;
+
+// copy holds the usable part of block as it was, header its block header
+typedef struct SLM_SnapshotCopy {
+    block_index block;
+    block_index copy;
+    u32 header[4];
+} SLM_SnapshotCopy;
+
+// the journal region starts with SLM_JournalSuper followed by the groups
+// of the current round, each an SLM_JournalGroup and size bytes of records.
+// replay takes groups in order starting at start_sequence. a group too
+// large for the region is kept in a chain of free blocks starting at
+// overflow, each block a block_index naming the next one and the group's
+// bytes after it, and comes before the groups of the region
+typedef struct SLM_JournalSuper {
+    u32 magic;
+    u32 start_sequence;
+    block_index overflow;
+} SLM_JournalSuper;
+
+typedef struct SLM_JournalGroup {
+    u32 magic;
+    u32 sequence;
+    u32 size;
+    u32 checksum;
+} SLM_JournalGroup;
+
+// followed by size bytes to be written at offset
+typedef struct SLM_JournalRecord {
+    file_offset offset;
+    u32 size;
+} SLM_JournalRecord;
+
+// a send stream is an SLM_StreamHeader, a mask with a bit for every group,
+// the bitmaps of the nbitmaps groups set in it without the blocks of the
+// sender's snapshots and nblocks SLM_StreamBlock. a group is left out when
+// its bitmap did not change since base, the generation the receiving image
+// has to be at, 0 for a full stream
+typedef struct SLM_StreamHeader {
+    u32 magic;
+    u32 base;
+    u32 nblocks;
+    u32 nbitmaps;
+    SLM_Header header;
+} SLM_StreamHeader;
+
+// followed by the whole block, header included
+typedef struct SLM_StreamBlock {
+    block_index block;
+} SLM_StreamBlock;
+
+// an archive is a u32 magic and the entry of the archived file or
+// directory. a regular file is followed by size bytes of contents, a
+// directory by the entries of its children and an entry of type ARCHIVE_END
+typedef struct SLM_ArchiveEntry {
+    u32 type;
+    char name[128];
+    size_t size;
+} SLM_ArchiveEntry;
 #pragma pack(pop)
 
+// raw blocks read ahead from the chain of one regular file. the cached
+// blocks follow each other on disk, window grows while the reads of
+// stream stay sequential
+typedef struct SLM_Readahead {
+    block_index file;
+    u32 first;
+    block_index block;
+    u32 count;
+
+    block_index stream;
+    file_offset next_off;
+    u32 window;
+
+    char *buf;
+} SLM_Readahead;
+
+// the records of one block, or of the header for key 0, as the first and
+// last of a list through links. a slot with no records has first UINT_MAX
+typedef struct SLM_JournalSlot {
+    u32 key;
+    u32 first;
+    u32 last;
+} SLM_JournalSlot;
+
+// where one record starts in buf and the next record of its block
+typedef struct SLM_JournalLink {
+    u32 pos;
+    u32 next;
+} SLM_JournalLink;
+
+// records in the order they were logged, none of them spanning two blocks,
+// and an open addressed map from the blocks to their records so that a
+// read only looks at the records of the blocks it covers
+typedef struct SLM_JournalRecords {
+    char *buf;
+    u32 used;
+    u32 capacity;
+
+    SLM_JournalLink *links;
+    u32 nlinks;
+    u32 links_capacity;
+
+    SLM_JournalSlot *slots;
+    u32 nslots;
+    u32 nkeys;
+} SLM_JournalRecords;
+
+// metadata writes of the transactions not committed yet are kept as
+// pending records and read back over the image until they are
+// checkpointed. the records of the last group committed are checkpoint,
+// written in place by the checkpointer while the next transactions run.
+// committed is the bitmap as of the last commit, journaled marks the blocks
+// that have records in the current round
+typedef struct SLM_Journal {
+    u32 active;
+    u32 ntransactions;
+    u32 header_dirty;
+    u32 direct_writes;
+
+    u32 sequence;
+    u32 head;
+
+    SLM_JournalRecords pending;
+    SLM_JournalRecords checkpoint;
+    work_pool *checkpointer;
+
+    u8 *committed;
+    u8 *journaled;
+} SLM_Journal;
+
+// snapshots are ordered oldest first, writes to blocks are checked against
+// the newest one. frozen marks the blocks whose contents on disk a snapshot
+// still needs, saved the blocks the newest snapshot has a copy of and
+// targets the blocks any snapshot has a copy of
+typedef struct SLM_Snapshots {
+    SLM_SnapshotTable table;
+    u8 *frozen;
+    u8 *saved;
+    u8 *targets;
+    u8 *scratch;
+
+    // set while the snapshots' own blocks are written
+    u32 bypass;
+} SLM_Snapshots;
+
+// change to the totals of a directory and its ancestors not written yet
+typedef struct SLM_SubtreeDelta {
+    block_index directory;
+    i64 size;
+    i32 files;
+} SLM_SubtreeDelta;
+
+#define SUBTREE_DELTAS_MAX 64
+
+// count entries of directory have a name containing the trigram or the
+// extension key stands for
+typedef struct SLM_Posting {
+    u32 key;
+    block_index directory;
+    u32 count;
+} SLM_Posting;
+
+// a bucket of the name index as read in the current transaction, postings
+// are sorted by key then directory
+typedef struct SLM_IndexBucket {
+    u32 dirty;
+    u32 nblocks;
+    Vector postings;
+} SLM_IndexBucket;
+
+// table holds the first block of the chain of every bucket, 0 for an empty
+// one. the buckets touched by a transaction are kept in arena until it ends
+typedef struct SLM_NameIndex {
+    u32 open;
+    block_index *table_blocks;
+    block_index *table;
+
+    SLM_IndexBucket **buckets;
+    u32 *touched;
+    u32 ntouched;
+    Arena arena;
+} SLM_NameIndex;
+
+// the checksums of the blocks written since the last commit are stored
+// with it, dirty marks those blocks between dirty_first and dirty_last.
+// verified marks, for each copy of a mirrored image, the blocks checked
+// against their checksums since they were last written. the table ends
+// before end
+typedef struct SLM_Checksums {
+    block_index end;
+    u8 *dirty;
+    block_index dirty_first;
+    block_index dirty_last;
+    u8 *verified[2];
+} SLM_Checksums;
+
 typedef struct FileSystem{
     SLM_Header header;
-    active_file file;
+    striped_file file;
+    SLM_Readahead readahead;
+    SLM_Journal journal;
+    SLM_Snapshots snapshots;
+    SLM_Checksums checksums;
+
+    // in memory copy of the group bitmaps, the range of blocks whose bits
+    // have not been written back yet and the free block count of every group
+    u8 *bitmap;
+    block_index bitmap_dirty_first;
+    block_index bitmap_dirty_last;
+    u32 *group_free;
+    u32 ngroups;
+
+    // inside a transaction the totals are carried up to the root once, at
+    // its end
+    SLM_SubtreeDelta subtree_deltas[SUBTREE_DELTAS_MAX];
+    u32 nsubtree_deltas;
+
+    SLM_NameIndex name_index;
 } FileSystem;
 
-static FileSystem SLM_CreateNewFileSystem(char *name, size_t total_size);
-static FileSystem SLM_OpenExistingFileSystem(char *name);
+static FileSystem SLM_CreateNewFileSystem(char **names, char **mirrors, u32 nstripes, u32 stripe_blocks, size_t total_size);
+static FileSystem SLM_OpenExistingFileSystem(char **names, char **mirrors);
+static FileSystem SLM_LoadFileSystem(char *name);
 static SLM_File SLM_ReadRoot(FileSystem *fs);
 
 #define SLIM64
@@ -2,33 +2,62 @@
 #if !defined(STRING)
     
 #include "common.h"
+#include "platform.c"
+
+// strings are scanned 16 bytes at a time with SSE2, which every x64
+// processor has. a load never crosses into the next page, so it cannot
+// fault past the terminator: aligned loads are safe as they are, an
+// unaligned one that would cross is replaced by a step of one byte
+#define STRING_PAGE_SIZE 4096
+#define CrossesPage(p) (((uintptr_t)(p) & (STRING_PAGE_SIZE - 1)) > STRING_PAGE_SIZE - 16)
+
+// offset of the first byte where the strings differ or str1 ends
+static size_t FirstDifference(const char *str1, const char *str2) {
+    size_t i = 0;
+    __m128i zero = _mm_setzero_si128();
+    for(;;) {
+        if(CrossesPage(str1 + i) || CrossesPage(str2 + i)) {
+            if(str1[i] != str2[i] || !str1[i])
+                return i;
+            i++;
+            continue;
+        }
+
+        __m128i a = _mm_loadu_si128((const __m128i*)(str1 + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(str2 + i));
+        u32 stop = (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff) | _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero));
+        if(stop)
+            return i + LowestSetBit(stop);
+        i += 16;
+    }
+}
 
 int _strcmp(const char *str1, const char *str2) {
     if(!str1 || !str2)
         return 0;
-    
-    while(*str1 && *str2) {
-        if(*str1 != *str2)
-            return 0;
-        str1++;
-        str2++;
-    }
-    if(*str1 || *str2)
-        return 0;
 
-    return 1;
+    size_t i = FirstDifference(str1, str2);
+    return str1[i] == str2[i];
 }
 
 int _strlen(const char *src) {
     if(!src)
         return -1;
-    
-    int count = 0;
-    while(*src) {
-        count++;
-        src++;;
+
+    // the first load starts at the aligned address below src, the bytes
+    // before src are shifted out of the mask
+    const char *block = (const char*)((uintptr_t)src & ~(uintptr_t)15);
+    __m128i zero = _mm_setzero_si128();
+    u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)block), zero)) >> (src - block);
+    if(mask)
+        return LowestSetBit(mask);
+
+    for(;;) {
+        block += 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)block), zero));
+        if(mask)
+            return block + LowestSetBit(mask) - src;
     }
-    return count;
 }
 
 int _strcpy(const char *src, char *dst, size_t size) {
@@ -44,42 +73,94 @@ int _strcpy(const char *src, char *dst, size_t size) {
     return count;
 }
 
+// parses an unsigned decimal number, returns 0 if str is not one
+int _strtou(const char *str, u32 *res) {
+    if(!str || !*str)
+        return 0;
+
+    u32 value = 0;
+    while(*str) {
+        if(*str < '0' || *str > '9')
+            return 0;
+        value = value * 10 + (*str - '0');
+        str++;
+    }
+    *res = value;
+    return 1;
+}
+
+// writes value in decimal followed by a terminator, returns the number of
+// digits or 0 if dst is too small
+int _utostr(u32 value, char *dst, size_t size) {
+    char digits[10];
+    u32 count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    if(count + 1 > size)
+        return 0;
+    for(u32 i = 0; i < count; ++i)
+        dst[i] = digits[count - 1 - i];
+    dst[count] = '\0';
+    return count;
+}
+
+// a string that ends first comes first, other bytes compare as signed chars
 int compare_str(const void *_str1, const void *_str2) {
     const char *str1 = _str1, *str2 = _str2;
     if(!str1 || !str2)
         return 0;
-    
-    while(*str1 && *str2) {
-        if(*str1 < *str2)
-            return -1;
-        else if(*str1 > *str2)
-            return 1;
-        str1++;
-        str2++;
-    }
-    if(!*str1 && *str2)
+
+    size_t i = FirstDifference(str1, str2);
+    if(str1[i] == str2[i])
+        return 0;
+    if(!str1[i])
         return -1;
-    else if(*str1 && !*str2)
+    if(!str2[i])
         return 1;
-    return 0;
+    return str1[i] < str2[i] ? -1 : 1;
 }
 
-int contains(const char *str, const char *token) {
-    int index = 0;
-    while(str[index]) {
-        int token_index = 0;
-        if(str[index] == token[token_index]) {
-            int tmp_index = index;
-            while(str[tmp_index++] && token[token_index++]) {
-                if(str[tmp_index] != token[token_index])
-                    break;
-            }
-            if(!token[token_index])
-                return index;
-        }
-        index++;
+// Horspool search for one token, prepared once so that it can be run over
+// many strings. shift is how far the window moves for the byte under its
+// last position
+typedef struct substring_search {
+    const char *token;
+    u32 length;
+    u32 shift[256];
+} substring_search;
+
+static void SubstringSearchBegin(substring_search *search, const char *token) {
+    u32 length = _strlen(token);
+    search->token = token;
+    search->length = length;
+    for(u32 i = 0; i < 256; ++i)
+        search->shift[i] = length ? length : 1;
+    for(u32 i = 0; i + 1 < length; ++i)
+        search->shift[(u8)token[i]] = length - 1 - i;
+}
+
+// index of the first occurrence of the token in str, UINT_MAX if there is none
+static u32 SubstringFind(substring_search *search, const char *str) {
+    u32 length = search->length;
+    u32 n = _strlen(str);
+    if(!length)
+        return 0;
+
+    char last = search->token[length - 1];
+    for(u32 pos = 0; pos + length <= n; pos += search->shift[(u8)str[pos + length - 1]]) {
+        if(str[pos + length - 1] == last && !MemCompare(str + pos, search->token, length - 1))
+            return pos;
     }
-    return 0;
+    return UINT_MAX;
+}
+
+u32 contains(const char *str, const char *token) {
+    substring_search search;
+    SubstringSearchBegin(&search, token);
+    return SubstringFind(&search, str);
 }
 
 #define STRING